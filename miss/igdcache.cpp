@@ -0,0 +1,387 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <WinSock2.h>
+#include <iphlpapi.h>
+
+#include <stdio.h>
+
+#include "igdcache.h"
+#include "mapper.h"
+
+#define IGD_CACHE_MAX_ENTRIES 8
+#define IGD_CACHE_DEFAULT_TARGET "default"
+#define TOPOLOGY_SECTION "topology"
+
+typedef struct _IGD_CACHE_SLOT {
+    char target[64];
+    IGD_CACHE_ENTRY entry;
+} IGD_CACHE_SLOT, *PIGD_CACHE_SLOT;
+
+static SRWLOCK s_CacheLock = SRWLOCK_INIT;
+static IGD_CACHE_SLOT s_CacheSlots[IGD_CACHE_MAX_ENTRIES];
+
+static bool s_TopologyLoaded;
+static NAT_TOPOLOGY s_Topology;
+
+static void GetCacheFilePath(char* path, int pathSize)
+{
+    ExpandEnvironmentStringsA("%ProgramData%\\MISS\\igd-cache.ini", path, pathSize);
+}
+
+static PIGD_CACHE_SLOT FindCacheSlot(const char* target)
+{
+    for (int i = 0; i < IGD_CACHE_MAX_ENTRIES; i++) {
+        if (!strcmp(s_CacheSlots[i].target, target)) {
+            return &s_CacheSlots[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static PIGD_CACHE_SLOT AllocateCacheSlot(const char* target)
+{
+    PIGD_CACHE_SLOT slot = FindCacheSlot(target);
+    if (slot == nullptr) {
+        slot = FindCacheSlot("");
+        if (slot == nullptr) {
+            // Full, so just reuse the first one
+            slot = &s_CacheSlots[0];
+        }
+    }
+
+    strncpy(slot->target, target, sizeof(slot->target) - 1);
+    slot->target[sizeof(slot->target) - 1] = 0;
+    return slot;
+}
+
+bool GetCachedIGD(const char* target, PIGD_CACHE_ENTRY entry)
+{
+    char path[MAX_PATH + 1];
+    bool found = false;
+
+    if (target == nullptr) {
+        target = IGD_CACHE_DEFAULT_TARGET;
+    }
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    PIGD_CACHE_SLOT slot = FindCacheSlot(target);
+    if (slot != nullptr) {
+        *entry = slot->entry;
+        found = true;
+    }
+    else {
+        // Not in memory, so see if we saved it before the last restart
+        GetCacheFilePath(path, sizeof(path));
+        GetPrivateProfileStringA(target, "ControlURL", "", entry->controlURL, sizeof(entry->controlURL), path);
+        GetPrivateProfileStringA(target, "ServiceType", "", entry->serviceType, sizeof(entry->serviceType), path);
+        GetPrivateProfileStringA(target, "LocalAddress", "", entry->localAddress, sizeof(entry->localAddress), path);
+        GetPrivateProfileStringA(target, "USN", "", entry->usn, sizeof(entry->usn), path);
+        GetPrivateProfileStringA(target, "DescURL", "", entry->descURL, sizeof(entry->descURL), path);
+        GetPrivateProfileStringA(target, "GatewayMAC", "", entry->gatewayMac, sizeof(entry->gatewayMac), path);
+        GetPrivateProfileStringA(target, "ControlURL6FC", "", entry->controlURL6FC, sizeof(entry->controlURL6FC), path);
+        GetPrivateProfileStringA(target, "ServiceType6FC", "", entry->serviceType6FC, sizeof(entry->serviceType6FC), path);
+        entry->settleTimeMs = GetPrivateProfileIntA(target, "SettleTimeMs", 0, path);
+
+        if (entry->controlURL[0] != 0 && entry->serviceType[0] != 0 && entry->localAddress[0] != 0) {
+            AllocateCacheSlot(target)->entry = *entry;
+            found = true;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+
+    return found;
+}
+
+void SetCachedIGD(const char* target, PIGD_CACHE_ENTRY entry)
+{
+    char path[MAX_PATH + 1];
+    char value[16];
+
+    if (target == nullptr) {
+        target = IGD_CACHE_DEFAULT_TARGET;
+    }
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    GetCacheFilePath(path, sizeof(path));
+
+    // Keep what we learned about the IGD if it's the same one we had before
+    PIGD_CACHE_SLOT slot = FindCacheSlot(target);
+    DWORD settleTimeMs = 0;
+    if (slot != nullptr) {
+        if (!strcmp(slot->entry.controlURL, entry->controlURL)) {
+            settleTimeMs = slot->entry.settleTimeMs;
+        }
+    }
+    else {
+        char controlURL[sizeof(entry->controlURL)];
+        GetPrivateProfileStringA(target, "ControlURL", "", controlURL, sizeof(controlURL), path);
+        if (!strcmp(controlURL, entry->controlURL)) {
+            settleTimeMs = GetPrivateProfileIntA(target, "SettleTimeMs", 0, path);
+        }
+    }
+
+    slot = AllocateCacheSlot(target);
+    slot->entry = *entry;
+    slot->entry.settleTimeMs = settleTimeMs;
+
+    snprintf(value, sizeof(value), "%u", settleTimeMs);
+    WritePrivateProfileStringA(target, "ControlURL", entry->controlURL, path);
+    WritePrivateProfileStringA(target, "ServiceType", entry->serviceType, path);
+    WritePrivateProfileStringA(target, "LocalAddress", entry->localAddress, path);
+    WritePrivateProfileStringA(target, "USN", entry->usn, path);
+    WritePrivateProfileStringA(target, "DescURL", entry->descURL, path);
+    WritePrivateProfileStringA(target, "GatewayMAC", entry->gatewayMac, path);
+    WritePrivateProfileStringA(target, "ControlURL6FC", entry->controlURL6FC, path);
+    WritePrivateProfileStringA(target, "ServiceType6FC", entry->serviceType6FC, path);
+    WritePrivateProfileStringA(target, "SettleTimeMs", value, path);
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+}
+
+void RemoveCachedIGD(const char* target)
+{
+    char path[MAX_PATH + 1];
+
+    if (target == nullptr) {
+        target = IGD_CACHE_DEFAULT_TARGET;
+    }
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    PIGD_CACHE_SLOT slot = FindCacheSlot(target);
+    if (slot != nullptr) {
+        slot->target[0] = 0;
+    }
+
+    // Deletes the whole section
+    GetCacheFilePath(path, sizeof(path));
+    WritePrivateProfileStringA(target, nullptr, nullptr, path);
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+}
+
+bool GetCachedIGDByControlURL(const char* controlURL, PIGD_CACHE_ENTRY entry)
+{
+    bool found = false;
+
+    AcquireSRWLockShared(&s_CacheLock);
+
+    for (int i = 0; i < IGD_CACHE_MAX_ENTRIES; i++) {
+        if (s_CacheSlots[i].target[0] != 0 &&
+                (!strcmp(s_CacheSlots[i].entry.controlURL, controlURL) || !strcmp(s_CacheSlots[i].entry.controlURL6FC, controlURL))) {
+            *entry = s_CacheSlots[i].entry;
+            found = true;
+            break;
+        }
+    }
+
+    ReleaseSRWLockShared(&s_CacheLock);
+
+    return found;
+}
+
+DWORD GetCachedIGDSettleTime(const char* controlURL)
+{
+    DWORD settleTimeMs = 0;
+
+    AcquireSRWLockShared(&s_CacheLock);
+
+    for (int i = 0; i < IGD_CACHE_MAX_ENTRIES; i++) {
+        if (s_CacheSlots[i].target[0] != 0 && !strcmp(s_CacheSlots[i].entry.controlURL, controlURL)) {
+            settleTimeMs = s_CacheSlots[i].entry.settleTimeMs;
+            break;
+        }
+    }
+
+    ReleaseSRWLockShared(&s_CacheLock);
+
+    return settleTimeMs;
+}
+
+void SetCachedIGDSettleTime(const char* controlURL, DWORD settleTimeMs)
+{
+    char path[MAX_PATH + 1];
+    char value[16];
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    GetCacheFilePath(path, sizeof(path));
+    snprintf(value, sizeof(value), "%u", settleTimeMs);
+
+    // The same IGD may be cached for more than one target
+    for (int i = 0; i < IGD_CACHE_MAX_ENTRIES; i++) {
+        if (s_CacheSlots[i].target[0] != 0 && !strcmp(s_CacheSlots[i].entry.controlURL, controlURL)) {
+            s_CacheSlots[i].entry.settleTimeMs = settleTimeMs;
+            WritePrivateProfileStringA(s_CacheSlots[i].target, "SettleTimeMs", value, path);
+        }
+    }
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+}
+
+bool GetGatewayMacAddress(const char* target, char* mac, int macSize)
+{
+    MIB_IPFORWARDROW route;
+    ULONG macAddr[2];
+    ULONG macAddrLen = 6;
+    DWORD error;
+
+    mac[0] = 0;
+
+    if (target != nullptr) {
+        return true;
+    }
+
+    error = GetBestRoute(0, 0, &route);
+    if (error != NO_ERROR) {
+        MappingLog("GetBestRoute() failed: %d\n", error);
+        return false;
+    }
+
+    error = SendARP(route.dwForwardNextHop, 0, macAddr, &macAddrLen);
+    if (error != NO_ERROR || macAddrLen != 6) {
+        MappingLog("SendARP() failed: %d\n", error);
+        return false;
+    }
+
+    unsigned char* bytes = (unsigned char*)macAddr;
+    snprintf(mac, macSize, "%02x-%02x-%02x-%02x-%02x-%02x",
+        bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+    return true;
+}
+
+bool GetTopologyKey(PNAT_TOPOLOGY topology)
+{
+    MIB_IPFORWARDROW route;
+    NET_LUID luid;
+    DWORD error;
+
+    *topology = {};
+
+    error = GetBestRoute(0, 0, &route);
+    if (error != NO_ERROR) {
+        MappingLog("GetBestRoute() failed: %d\n", error);
+        return false;
+    }
+
+    // The LUID stays the same across reboots unlike the interface index
+    error = ConvertInterfaceIndexToLuid(route.dwForwardIfIndex, &luid);
+    if (error != NO_ERROR) {
+        MappingLog("ConvertInterfaceIndexToLuid() failed: %d\n", error);
+        return false;
+    }
+
+    snprintf(topology->interfaceLuid, sizeof(topology->interfaceLuid), "%llx", luid.Value);
+    return GetGatewayMacAddress(nullptr, topology->gatewayMac, sizeof(topology->gatewayMac));
+}
+
+static void LoadTopology(PNAT_TOPOLOGY topology)
+{
+    char path[MAX_PATH + 1];
+
+    *topology = {};
+
+    GetCacheFilePath(path, sizeof(path));
+    GetPrivateProfileStringA(TOPOLOGY_SECTION, "InterfaceLUID", "", topology->interfaceLuid, sizeof(topology->interfaceLuid), path);
+    GetPrivateProfileStringA(TOPOLOGY_SECTION, "GatewayMAC", "", topology->gatewayMac, sizeof(topology->gatewayMac), path);
+    topology->levelCount = GetPrivateProfileIntA(TOPOLOGY_SECTION, "LevelCount", 0, path);
+    if (topology->levelCount < 0 || topology->levelCount > TOPOLOGY_MAX_LEVELS) {
+        topology->levelCount = 0;
+    }
+
+    for (int i = 0; i < topology->levelCount; i++) {
+        PTOPOLOGY_LEVEL level = &topology->levels[i];
+        char key[64];
+
+        snprintf(key, sizeof(key), "Level%dTarget", i);
+        GetPrivateProfileStringA(TOPOLOGY_SECTION, key, "", level->targetAddress, sizeof(level->targetAddress), path);
+        snprintf(key, sizeof(key), "Level%dUpstream", i);
+        GetPrivateProfileStringA(TOPOLOGY_SECTION, key, "", level->upstreamAddress, sizeof(level->upstreamAddress), path);
+        snprintf(key, sizeof(key), "Level%dProtocol", i);
+        GetPrivateProfileStringA(TOPOLOGY_SECTION, key, "", level->protocol, sizeof(level->protocol), path);
+        snprintf(key, sizeof(key), "Level%dEndpoint", i);
+        GetPrivateProfileStringA(TOPOLOGY_SECTION, key, "", level->controlEndpoint, sizeof(level->controlEndpoint), path);
+    }
+}
+
+bool GetCachedTopology(PNAT_TOPOLOGY key, PNAT_TOPOLOGY topology)
+{
+    bool found;
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    // Not in memory, so see if we saved it before the last restart
+    if (!s_TopologyLoaded) {
+        LoadTopology(&s_Topology);
+        s_TopologyLoaded = true;
+    }
+
+    // A different interface or gateway means we're on another network
+    found = s_Topology.levelCount > 0 &&
+        !strcmp(s_Topology.interfaceLuid, key->interfaceLuid) &&
+        !strcmp(s_Topology.gatewayMac, key->gatewayMac);
+    if (found) {
+        *topology = s_Topology;
+    }
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+
+    return found;
+}
+
+void SetCachedTopology(PNAT_TOPOLOGY topology)
+{
+    char path[MAX_PATH + 1];
+    char value[16];
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    s_Topology = *topology;
+    s_TopologyLoaded = true;
+
+    // Replace the whole section so we don't leave levels from a longer chain behind
+    GetCacheFilePath(path, sizeof(path));
+    WritePrivateProfileStringA(TOPOLOGY_SECTION, nullptr, nullptr, path);
+    WritePrivateProfileStringA(TOPOLOGY_SECTION, "InterfaceLUID", topology->interfaceLuid, path);
+    WritePrivateProfileStringA(TOPOLOGY_SECTION, "GatewayMAC", topology->gatewayMac, path);
+    snprintf(value, sizeof(value), "%d", topology->levelCount);
+    WritePrivateProfileStringA(TOPOLOGY_SECTION, "LevelCount", value, path);
+
+    for (int i = 0; i < topology->levelCount; i++) {
+        PTOPOLOGY_LEVEL level = &topology->levels[i];
+        char key[64];
+
+        snprintf(key, sizeof(key), "Level%dTarget", i);
+        WritePrivateProfileStringA(TOPOLOGY_SECTION, key, level->targetAddress, path);
+        snprintf(key, sizeof(key), "Level%dUpstream", i);
+        WritePrivateProfileStringA(TOPOLOGY_SECTION, key, level->upstreamAddress, path);
+        snprintf(key, sizeof(key), "Level%dProtocol", i);
+        WritePrivateProfileStringA(TOPOLOGY_SECTION, key, level->protocol, path);
+        snprintf(key, sizeof(key), "Level%dEndpoint", i);
+        WritePrivateProfileStringA(TOPOLOGY_SECTION, key, level->controlEndpoint, path);
+    }
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+}
+
+void RemoveCachedTopology()
+{
+    char path[MAX_PATH + 1];
+
+    AcquireSRWLockExclusive(&s_CacheLock);
+
+    s_Topology = {};
+    s_TopologyLoaded = true;
+
+    // Deletes the whole section
+    GetCacheFilePath(path, sizeof(path));
+    WritePrivateProfileStringA(TOPOLOGY_SECTION, nullptr, nullptr, path);
+
+    ReleaseSRWLockExclusive(&s_CacheLock);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+typedef struct _IGD_CACHE_ENTRY {
+    char controlURL[256];
+    char serviceType[128];
+    char localAddress[128];
+    char usn[256];
+
+    // Root description, used to check that the USN still matches for gateways
+    // that aren't on-link (since we can't check their MAC address)
+    char descURL[256];
+
+    // Empty for gateways that aren't on-link
+    char gatewayMac[32];
+
+    // Empty if the IGD has no WANIPv6FirewallControl service
+    char controlURL6FC[256];
+    char serviceType6FC[128];
+
+    // Managed by SetCachedIGDSettleTime(). SetCachedIGD() keeps the existing
+    // value as long as the control URL is the same.
+    DWORD settleTimeMs;
+} IGD_CACHE_ENTRY, *PIGD_CACHE_ENTRY;
+
+// The cache is keyed by the address we send UPnP requests to,
+// or null for the IGD found by discovery on the default gateway.
+bool GetCachedIGD(const char* target, PIGD_CACHE_ENTRY entry);
+void SetCachedIGD(const char* target, PIGD_CACHE_ENTRY entry);
+void RemoveCachedIGD(const char* target);
+
+// Finds the cached IGD with this IPv4 or IPv6 firewall control URL, whichever target it was cached for
+bool GetCachedIGDByControlURL(const char* controlURL, PIGD_CACHE_ENTRY entry);
+
+// How long the cached IGD with this control URL needs before its port mappings
+// read back stable. Returns 0 if we don't know or it isn't cached.
+DWORD GetCachedIGDSettleTime(const char* controlURL);
+void SetCachedIGDSettleTime(const char* controlURL, DWORD settleTimeMs);
+
+// Gets the MAC address of the default gateway (if target is null), or an
+// empty string for other targets since they may not be on-link.
+bool GetGatewayMacAddress(const char* target, char* mac, int macSize);
+
+#define TOPOLOGY_MAX_LEVELS 8
+
+typedef struct _TOPOLOGY_LEVEL {
+    // Empty for the default gateway
+    char targetAddress[64];
+    char upstreamAddress[64];
+
+    // The protocol that mapped our ports and where we sent its requests
+    char protocol[16];
+    char controlEndpoint[256];
+} TOPOLOGY_LEVEL, *PTOPOLOGY_LEVEL;
+
+// The chain of NATs between us and the Internet, as seen from one interface
+// behind one gateway
+typedef struct _NAT_TOPOLOGY {
+    char interfaceLuid[32];
+    char gatewayMac[32];
+    int levelCount;
+    TOPOLOGY_LEVEL levels[TOPOLOGY_MAX_LEVELS];
+} NAT_TOPOLOGY, *PNAT_TOPOLOGY;
+
+// Fills in the interface and gateway MAC address that the cached topology must match
+bool GetTopologyKey(PNAT_TOPOLOGY topology);
+
+// Only returns a topology saved for the same interface and gateway as the given key
+bool GetCachedTopology(PNAT_TOPOLOGY key, PNAT_TOPOLOGY topology);
+void SetCachedTopology(PNAT_TOPOLOGY topology);
+void RemoveCachedTopology();
@@ -0,0 +1,306 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <WinSock2.h>
+
+#include <stdio.h>
+#include <limits.h>
+
+#include "lease.h"
+
+#define MAX_LEASES 256
+
+// Leases are renewed at this fraction of their lifetime
+#define LEASE_RENEWAL_DIVISOR 2
+#define LEASE_MIN_RENEWAL_SEC 30
+
+// Permanent mappings can silently disappear when the router reboots, so we
+// read them back this often
+#define LEASE_LIVENESS_CHECK_SEC 600
+
+// Hierarchical timer wheel with 1 second resolution. Level 0 slots are 1 second,
+// level 1 slots are 64 seconds and level 2 slots are 4096 seconds, so the wheel
+// covers about 3 days. Anything further out is parked in the level 2 slot that
+// will be cascaded last and reinserted as time advances.
+#define WHEEL_LEVELS 3
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+
+typedef struct _LEASE {
+    struct _LEASE* next;
+    struct _LEASE* prev;
+    int wheelLevel;
+    int wheelSlot;
+
+    MAPPING_LEASE mapping;
+    ULONGLONG renewTime;
+
+    bool inUse;
+    bool scheduled;
+} LEASE, *PLEASE;
+
+static SRWLOCK s_LeaseLock = SRWLOCK_INIT;
+static LEASE s_Leases[MAX_LEASES];
+static PLEASE s_Wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static ULONGLONG s_WheelTime;
+
+static ULONGLONG GetCurrentTimeSec()
+{
+    return GetTickCount64() / 1000;
+}
+
+static void WheelInsert(PLEASE lease)
+{
+    ULONGLONG delta;
+    int level;
+    int slot;
+
+    if (lease->renewTime <= s_WheelTime) {
+        // Already due, so it fires on the next tick
+        lease->renewTime = s_WheelTime + 1;
+    }
+
+    delta = lease->renewTime - s_WheelTime;
+    if (delta < WHEEL_SLOTS) {
+        level = 0;
+        slot = lease->renewTime & WHEEL_SLOT_MASK;
+    }
+    else if (delta < (1ULL << (2 * WHEEL_SLOT_BITS))) {
+        level = 1;
+        slot = (lease->renewTime >> WHEEL_SLOT_BITS) & WHEEL_SLOT_MASK;
+    }
+    else if (delta < (1ULL << (3 * WHEEL_SLOT_BITS))) {
+        level = 2;
+        slot = (lease->renewTime >> (2 * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+    }
+    else {
+        level = 2;
+        slot = (s_WheelTime >> (2 * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK;
+    }
+
+    lease->prev = nullptr;
+    lease->next = s_Wheel[level][slot];
+    if (lease->next != nullptr) {
+        lease->next->prev = lease;
+    }
+    s_Wheel[level][slot] = lease;
+    lease->wheelLevel = level;
+    lease->wheelSlot = slot;
+    lease->scheduled = true;
+}
+
+static void WheelRemove(PLEASE lease)
+{
+    if (!lease->scheduled) {
+        return;
+    }
+
+    if (lease->prev != nullptr) {
+        lease->prev->next = lease->next;
+    }
+    else {
+        s_Wheel[lease->wheelLevel][lease->wheelSlot] = lease->next;
+    }
+    if (lease->next != nullptr) {
+        lease->next->prev = lease->prev;
+    }
+
+    lease->next = lease->prev = nullptr;
+    lease->scheduled = false;
+}
+
+// Moves everything in a higher level slot down to where it belongs now
+static void WheelCascade(int level, int slot)
+{
+    PLEASE lease = s_Wheel[level][slot];
+    s_Wheel[level][slot] = nullptr;
+
+    while (lease != nullptr) {
+        PLEASE next = lease->next;
+        lease->scheduled = false;
+        WheelInsert(lease);
+        lease = next;
+    }
+}
+
+// Advances the wheel to the current time, taking every lease that comes due off
+// of it. Up to maxLeases of them are copied out and the rest fire on the next tick.
+static int WheelAdvance(ULONGLONG now, PMAPPING_LEASE dueLeases, int maxLeases)
+{
+    int dueCount = 0;
+
+    while (s_WheelTime < now) {
+        s_WheelTime++;
+
+        int slot0 = s_WheelTime & WHEEL_SLOT_MASK;
+        if (slot0 == 0) {
+            int slot1 = (s_WheelTime >> WHEEL_SLOT_BITS) & WHEEL_SLOT_MASK;
+            if (slot1 == 0) {
+                WheelCascade(2, (s_WheelTime >> (2 * WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK);
+            }
+            WheelCascade(1, slot1);
+        }
+
+        PLEASE lease = s_Wheel[0][slot0];
+        s_Wheel[0][slot0] = nullptr;
+        while (lease != nullptr) {
+            PLEASE next = lease->next;
+            lease->scheduled = false;
+
+            if (dueCount < maxLeases) {
+                // The lease stays tracked, and is scheduled again once it's renewed
+                dueLeases[dueCount++] = lease->mapping;
+            }
+            else {
+                WheelInsert(lease);
+            }
+
+            lease = next;
+        }
+    }
+
+    return dueCount;
+}
+
+static PLEASE FindLease(const char* method, const char* gateway, const char* internalAddress, int proto, int port)
+{
+    for (int i = 0; i < MAX_LEASES; i++) {
+        PMAPPING_LEASE mapping = &s_Leases[i].mapping;
+        if (s_Leases[i].inUse && mapping->proto == proto && mapping->port == port &&
+                !strcmp(mapping->method, method) && !strcmp(mapping->gateway, gateway) &&
+                !strcmp(mapping->internalAddress, internalAddress)) {
+            return &s_Leases[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static PLEASE AllocateLease()
+{
+    PLEASE soonest = nullptr;
+
+    for (int i = 0; i < MAX_LEASES; i++) {
+        if (!s_Leases[i].inUse) {
+            return &s_Leases[i];
+        }
+        else if (soonest == nullptr || s_Leases[i].renewTime < soonest->renewTime) {
+            soonest = &s_Leases[i];
+        }
+    }
+
+    // We're full, so give up tracking the one that's due first. That's
+    // safe since it just means we'll renew it on the safety poll.
+    WheelRemove(soonest);
+    return soonest;
+}
+
+void RecordMappingLease(const char* method, const char* gateway, const char* internalAddress,
+    int proto, int port, unsigned int lifetime)
+{
+    if (internalAddress == nullptr) {
+        internalAddress = "";
+    }
+
+    AcquireSRWLockExclusive(&s_LeaseLock);
+
+    if (s_WheelTime == 0) {
+        s_WheelTime = GetCurrentTimeSec();
+    }
+
+    PLEASE lease = FindLease(method, gateway, internalAddress, proto, port);
+    if (lease == nullptr) {
+        lease = AllocateLease();
+        RtlZeroMemory(&lease->mapping, sizeof(lease->mapping));
+        strncpy(lease->mapping.method, method, sizeof(lease->mapping.method) - 1);
+        strncpy(lease->mapping.gateway, gateway, sizeof(lease->mapping.gateway) - 1);
+        strncpy(lease->mapping.internalAddress, internalAddress, sizeof(lease->mapping.internalAddress) - 1);
+        lease->mapping.proto = proto;
+        lease->mapping.port = port;
+        lease->inUse = true;
+        lease->scheduled = false;
+    }
+    else {
+        WheelRemove(lease);
+    }
+
+    lease->mapping.lifetime = lifetime;
+    if (lifetime != 0) {
+        unsigned int renewalDelay = max(lifetime / LEASE_RENEWAL_DIVISOR, (unsigned int)LEASE_MIN_RENEWAL_SEC);
+        lease->renewTime = GetCurrentTimeSec() + renewalDelay;
+    }
+    else {
+        lease->renewTime = GetCurrentTimeSec() + LEASE_LIVENESS_CHECK_SEC;
+    }
+    WheelInsert(lease);
+
+    ReleaseSRWLockExclusive(&s_LeaseLock);
+}
+
+void RemoveMappingLease(const char* method, const char* gateway, const char* internalAddress, int proto, int port)
+{
+    if (internalAddress == nullptr) {
+        internalAddress = "";
+    }
+
+    AcquireSRWLockExclusive(&s_LeaseLock);
+
+    PLEASE lease = FindLease(method, gateway, internalAddress, proto, port);
+    if (lease != nullptr) {
+        WheelRemove(lease);
+        lease->inUse = false;
+    }
+
+    ReleaseSRWLockExclusive(&s_LeaseLock);
+}
+
+DWORD GetNextLeaseRenewalDelayMs(DWORD defaultDelayMs, DWORD maxDelayMs)
+{
+    ULONGLONG nextRenewTime = ULLONG_MAX;
+    bool haveLeases = false;
+
+    AcquireSRWLockShared(&s_LeaseLock);
+
+    for (int i = 0; i < MAX_LEASES; i++) {
+        if (s_Leases[i].inUse) {
+            haveLeases = true;
+            if (s_Leases[i].scheduled) {
+                nextRenewTime = min(nextRenewTime, s_Leases[i].renewTime);
+            }
+        }
+    }
+
+    ReleaseSRWLockShared(&s_LeaseLock);
+
+    // Renewal times are in whole seconds, so wait until the second actually starts
+    ULONGLONG nowMs = GetTickCount64();
+    if (!haveLeases) {
+        return min(defaultDelayMs, maxDelayMs);
+    }
+    else if (nextRenewTime == ULLONG_MAX) {
+        return maxDelayMs;
+    }
+    else if (nextRenewTime * 1000 <= nowMs) {
+        return 0;
+    }
+    else {
+        return (DWORD)min(nextRenewTime * 1000 - nowMs, (ULONGLONG)maxDelayMs);
+    }
+}
+
+int TakeDueLeases(PMAPPING_LEASE dueLeases, int maxLeases)
+{
+    int dueCount = 0;
+
+    AcquireSRWLockExclusive(&s_LeaseLock);
+
+    if (s_WheelTime != 0) {
+        dueCount = WheelAdvance(GetCurrentTimeSec(), dueLeases, maxLeases);
+    }
+
+    ReleaseSRWLockExclusive(&s_LeaseLock);
+
+    return dueCount;
+}
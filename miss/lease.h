@@ -0,0 +1,27 @@
+#pragma once
+
+typedef struct _MAPPING_LEASE {
+    char method[16];
+    char gateway[128];
+    char internalAddress[46]; // INET6_ADDRSTRLEN
+    int proto;
+    int port;
+    unsigned int lifetime;
+} MAPPING_LEASE, *PMAPPING_LEASE;
+
+// Tracks the lease granted for each port mapping so we only talk to the
+// router when something is actually close to expiring. A lifetime of 0
+// means the mapping is permanent, so it only comes due for a periodic check
+// that it's still there. The internal address may be null if the protocol
+// doesn't need one to tell mappings apart.
+void RecordMappingLease(const char* method, const char* gateway, const char* internalAddress,
+    int proto, int port, unsigned int lifetime);
+void RemoveMappingLease(const char* method, const char* gateway, const char* internalAddress, int proto, int port);
+
+// Returns how long to wait before the next lease comes due. If no leases
+// are known, defaultDelayMs is returned. The result never exceeds maxDelayMs.
+DWORD GetNextLeaseRenewalDelayMs(DWORD defaultDelayMs, DWORD maxDelayMs);
+
+// Takes the leases that have come due off of the schedule and copies up to maxLeases
+// of them out. They stay tracked and are scheduled again when they are next recorded.
+int TakeDueLeases(PMAPPING_LEASE dueLeases, int maxLeases);
@@ -0,0 +1,173 @@
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "mapper.h"
+
+// The operation being executed by this thread, if any
+static __declspec(thread) PMAPPING_OP t_CurrentOp;
+
+// Where output outside of an operation goes on this thread, if not stdout
+static __declspec(thread) PMAPPING_LOG_BUFFER t_CurrentBuffer;
+
+int MappingLog(const char* format, ...)
+{
+    PMAPPING_OP op = t_CurrentOp;
+    PMAPPING_LOG_BUFFER buffer = t_CurrentBuffer;
+    va_list va;
+    int ret;
+
+    va_start(va, format);
+    if (op != nullptr) {
+        // Buffer the output so concurrent operations don't interleave their logs
+        int remaining = sizeof(op->log) - op->logLength;
+        ret = vsnprintf(&op->log[op->logLength], remaining, format, va);
+        if (ret > 0) {
+            op->logLength += min(ret, remaining - 1);
+        }
+    }
+    else if (buffer != nullptr) {
+        va_list vaRetry;
+        int remaining = sizeof(buffer->text) - buffer->length;
+
+        va_copy(vaRetry, va);
+        ret = vsnprintf(&buffer->text[buffer->length], remaining, format, va);
+        if (ret >= remaining && buffer->length != 0) {
+            // Out of room, so print what we have so far and start over
+            buffer->text[buffer->length] = 0;
+            FlushMappingLogBuffer(buffer);
+
+            remaining = sizeof(buffer->text);
+            ret = vsnprintf(buffer->text, remaining, format, vaRetry);
+        }
+        if (ret > 0) {
+            buffer->length += min(ret, remaining - 1);
+        }
+        va_end(vaRetry);
+    }
+    else {
+        ret = vprintf(format, va);
+    }
+    va_end(va);
+
+    return ret;
+}
+
+void SetMappingLogBuffer(PMAPPING_LOG_BUFFER buffer)
+{
+    t_CurrentBuffer = buffer;
+}
+
+void FlushMappingLogBuffer(PMAPPING_LOG_BUFFER buffer)
+{
+    if (buffer->length != 0) {
+        // A single write keeps the block together even if other threads are printing
+        fwrite(buffer->text, 1, buffer->length, stdout);
+        fflush(stdout);
+        buffer->length = 0;
+    }
+}
+
+void InitMappingOp(PMAPPING_OP op, PMAPPING_OP_FN mapPort, void* context, const char* internalAddress,
+    int proto, int port, bool enable, bool indefinite, bool required)
+{
+    op->mapPort = mapPort;
+    op->context = context;
+    op->internalAddress = internalAddress;
+    op->proto = proto;
+    op->port = port;
+    op->enable = enable;
+    op->indefinite = indefinite;
+    op->required = required;
+}
+
+static DWORD WINAPI MappingOpThreadProc(LPVOID Context)
+{
+    PMAPPING_OP op = (PMAPPING_OP)Context;
+
+    t_CurrentOp = op;
+    op->success = op->mapPort(op);
+    t_CurrentOp = nullptr;
+
+    return 0;
+}
+
+static void ResetMappingOps(PMAPPING_OP ops, int opCount)
+{
+    for (int i = 0; i < opCount; i++) {
+        ops[i].success = false;
+        ops[i].changed = false;
+        ops[i].logLength = 0;
+        ops[i].log[0] = 0;
+    }
+}
+
+static bool PrintMappingOps(PMAPPING_OP ops, int opCount)
+{
+    bool success = true;
+
+    // Print the results in the order they were submitted
+    for (int i = 0; i < opCount; i++) {
+        MappingLog("%s", ops[i].log);
+        if (ops[i].logLength == sizeof(ops[i].log) - 1) {
+            MappingLog("...\n");
+        }
+
+        if (ops[i].required && !ops[i].success) {
+            success = false;
+        }
+    }
+
+    fflush(stdout);
+    return success;
+}
+
+bool ExecuteMappingOps(PMAPPING_OP ops, int opCount)
+{
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    int threadCount = 0;
+
+    ResetMappingOps(ops, opCount);
+
+    for (int i = 0; i < opCount; i++) {
+        HANDLE thread = nullptr;
+
+        if (threadCount < ARRAYSIZE(threads)) {
+            thread = CreateThread(nullptr, 0, MappingOpThreadProc, &ops[i], 0, nullptr);
+        }
+
+        if (thread != nullptr) {
+            threads[threadCount++] = thread;
+        }
+        else {
+            // Couldn't get a thread, so just run it here
+            MappingOpThreadProc(&ops[i]);
+        }
+    }
+
+    if (threadCount != 0) {
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+        for (int i = 0; i < threadCount; i++) {
+            CloseHandle(threads[i]);
+        }
+    }
+
+    return PrintMappingOps(ops, opCount);
+}
+
+bool ExecuteMappingBatch(PMAPPING_BATCH_FN mapPorts, void* context, PMAPPING_OP ops, int opCount)
+{
+    ResetMappingOps(ops, opCount);
+
+    mapPorts(ops, opCount, context);
+    t_CurrentOp = nullptr;
+
+    return PrintMappingOps(ops, opCount);
+}
+
+void SetCurrentMappingOp(PMAPPING_OP op)
+{
+    t_CurrentOp = op;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#define MAPPING_OP_LOG_SIZE 2048
+#define MAPPING_LOG_BUFFER_SIZE 16384
+
+typedef struct _MAPPING_OP MAPPING_OP, *PMAPPING_OP;
+
+// Performs a single port mapping operation. Returns true on success.
+typedef bool (*PMAPPING_OP_FN)(PMAPPING_OP op);
+
+// Performs all operations in a batch on the calling thread, setting the
+// success field of each one.
+typedef void (*PMAPPING_BATCH_FN)(PMAPPING_OP ops, int opCount, void* context);
+
+struct _MAPPING_OP {
+    PMAPPING_OP_FN mapPort;
+
+    // Protocol-specific state shared by all operations in a batch. Operations
+    // run concurrently, so this must not be modified by the operation.
+    void* context;
+
+    const char* internalAddress;
+    int proto;
+    int port;
+    bool enable;
+    bool indefinite;
+
+    // Failure of this operation fails the whole batch
+    bool required;
+
+    // Filled in by ExecuteMappingOps()
+    bool success;
+    bool changed; // Set by the operation if it found the router state had changed
+    int logLength;
+    char log[MAPPING_OP_LOG_SIZE];
+};
+
+void InitMappingOp(PMAPPING_OP op, PMAPPING_OP_FN mapPort, void* context, const char* internalAddress,
+    int proto, int port, bool enable, bool indefinite, bool required);
+
+// Runs all operations concurrently and prints their log output in order once
+// they have all completed. Returns true if all required operations succeeded.
+bool ExecuteMappingOps(PMAPPING_OP ops, int opCount);
+
+// Like ExecuteMappingOps(), but hands the whole set to a single batch function
+// for protocols that can multiplex operations themselves.
+bool ExecuteMappingBatch(PMAPPING_BATCH_FN mapPorts, void* context, PMAPPING_OP ops, int opCount);
+
+// Directs MappingLog() output on this thread to the given operation. Used by
+// batch functions to keep each operation's log separate.
+void SetCurrentMappingOp(PMAPPING_OP op);
+
+typedef struct _MAPPING_LOG_BUFFER {
+    int length;
+    char text[MAPPING_LOG_BUFFER_SIZE];
+} MAPPING_LOG_BUFFER, *PMAPPING_LOG_BUFFER;
+
+// Collects MappingLog() output on this thread that isn't part of a mapping
+// operation (including the output of finished operations) in the given buffer,
+// so a long-running task can print its log as a single block. Pass nullptr to
+// log directly to stdout again.
+void SetMappingLogBuffer(PMAPPING_LOG_BUFFER buffer);
+
+// Prints the contents of the buffer and empties it
+void FlushMappingLogBuffer(PMAPPING_LOG_BUFFER buffer);
+
+// Logs on behalf of the mapping operation running on the current thread, or to the
+// thread's log buffer (or directly to stdout) if called outside of a mapping operation.
+int MappingLog(const char* format, ...);
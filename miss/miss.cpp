@@ -13,6 +13,12 @@
 #include <stdlib.h>
 
 #include "relay.h"
+#include "mapper.h"
+#include "soap.h"
+#include "igdcache.h"
+#include "lease.h"
+#include "reconcile.h"
+#include "netstate.h"
 #include "..\version.h"
 
 #pragma comment(lib, "miniupnpc.lib")
@@ -24,22 +30,44 @@
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/upnpcommands.h>
 #include <miniupnpc/upnperrors.h>
+#include <miniupnpc/miniwget.h>
 
 #define NATPMP_STATICLIB
 #include <natpmp.h>
 
 bool getHopsIP4(IN_ADDR* hopAddress, int* hopAddressCount);
 struct UPNPDev* getUPnPDevicesByAddress(IN_ADDR address);
-bool PCPMapPort(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen, int proto, int port, bool enable, bool indefinite);
+void PCPMapPorts(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen, PMAPPING_OP ops, int opCount);
+int StartStunBeacon(unsigned short Port);
+int StartPCPAnnounceListener(HANDLE stateLostEvent);
+ULONGLONG TakePCPAnnounceReceiveTime();
+bool PCPProbeServer(PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen);
+void NATPMPMapPorts(PSOCKADDR_IN gatewayAddr, PMAPPING_OP ops, int opCount);
 
 #define NL "\n"
 
 #define SERVICE_NAME "MISS"
 #define UPNP_SERVICE_NAME "Moonlight"
 #define POLLING_DELAY_SEC 120
+#define LEASE_SAFETY_POLL_SEC 1800
 #define PORT_MAPPING_DURATION_SEC 3600
+// Renew leased mappings once they're within a polling interval of the half-life
+#define UPNP_RENEW_THRESHOLD_SEC (PORT_MAPPING_DURATION_SEC / 2 + POLLING_DELAY_SEC)
 #define UPNP_DISCOVERY_DELAY_MS 5000
+#define NATPMP_PROBE_TIMEOUT_MS 4000 // 4 transmissions
+#define RACE_STAGGER_MS 500
+#define UPNP_VERIFY_INITIAL_INTERVAL_MS 250
+#define UPNP_VERIFY_DEADLINE_MS 10000
+#define INTERFACE_SETTLE_INITIAL_INTERVAL_MS 250
+#define INTERFACE_SETTLE_MAX_INTERVAL_MS 2000
+#define INTERFACE_SETTLE_DEADLINE_MS 10000
+#define INTERFACE_DEBOUNCE_QUIET_MS 1000
 #define GAA_INITIAL_SIZE 8192
+#define RELAY_BYPASS_RETRY_INTERVAL_SEC 1800
+#define STUN_BEACON_PORT 47010
+#define MAX_PINHOLE_ADDRESSES 4
+#define IGD_MAX_CANDIDATES 32
+#define IGD_DESCRIPTION_TIMEOUT_MS 4000
 
 static struct port_entry {
     int proto;
@@ -57,6 +85,138 @@ static struct port_entry {
 
 static const int k_WolPorts[] = { 9, 47009 };
 
+// Time each router has needed before its port mappings read back stable
+static struct {
+    char controlURL[256];
+    DWORD settleTimeMs;
+} s_RouterSettleTimes[8];
+static SRWLOCK s_RouterSettleTimeLock = SRWLOCK_INIT;
+
+// Unique IDs the IGD gave our IPv6 pinholes, which we need to refresh or delete them
+static struct {
+    char internalAddress[INET6_ADDRSTRLEN];
+    int proto;
+    int port;
+    char uniqueID[8];
+} s_Pinholes[MAX_PINHOLE_ADDRESSES * 8];
+static SRWLOCK s_PinholeLock = SRWLOCK_INIT;
+
+// Last time we tried to move each relayed mapping on each router off of the relay
+static struct {
+    char controlURL[256];
+    int proto;
+    int port;
+    ULONGLONG attemptTime;
+} s_RelayBypassAttempts[8 * ARRAYSIZE(k_Ports)];
+static SRWLOCK s_RelayBypassLock = SRWLOCK_INIT;
+
+// Records an attempt to map the port directly on the given router. If onlyIfDue is set,
+// the attempt is only recorded (and true returned) if the retry interval has passed.
+bool RecordRelayBypassAttempt(const char* controlURL, int proto, int port, bool onlyIfDue)
+{
+    ULONGLONG now = GetTickCount64();
+    int slot = -1;
+    bool due;
+
+    // Gateways at different NAT levels are mapped concurrently
+    AcquireSRWLockExclusive(&s_RelayBypassLock);
+
+    for (int i = 0; i < ARRAYSIZE(s_RelayBypassAttempts); i++) {
+        if (s_RelayBypassAttempts[i].proto == proto && s_RelayBypassAttempts[i].port == port &&
+                !strcmp(s_RelayBypassAttempts[i].controlURL, controlURL)) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0) {
+        for (int i = 0; i < ARRAYSIZE(s_RelayBypassAttempts); i++) {
+            if (s_RelayBypassAttempts[i].proto == 0) {
+                slot = i;
+                break;
+            }
+        }
+
+        // Take over the first slot if we're full
+        if (slot < 0) {
+            slot = 0;
+        }
+
+        strncpy(s_RelayBypassAttempts[slot].controlURL, controlURL, sizeof(s_RelayBypassAttempts[slot].controlURL) - 1);
+        s_RelayBypassAttempts[slot].controlURL[sizeof(s_RelayBypassAttempts[slot].controlURL) - 1] = 0;
+        s_RelayBypassAttempts[slot].proto = proto;
+        s_RelayBypassAttempts[slot].port = port;
+        s_RelayBypassAttempts[slot].attemptTime = 0;
+    }
+
+    due = s_RelayBypassAttempts[slot].attemptTime == 0 ||
+          now - s_RelayBypassAttempts[slot].attemptTime >= RELAY_BYPASS_RETRY_INTERVAL_SEC * 1000ULL;
+    if (due || !onlyIfDue) {
+        s_RelayBypassAttempts[slot].attemptTime = now;
+    }
+
+    ReleaseSRWLockExclusive(&s_RelayBypassLock);
+
+    return due || !onlyIfDue;
+}
+
+bool UPnPTryRelayBypass(struct UPNPUrls* urls, struct IGDdatas* data, const char* protoStr, const char* myAddr, const char* myDesc, int port)
+{
+    char intClient[16];
+    char intPort[6];
+    char desc[80];
+    char enabled[4];
+    char leaseDuration[16];
+    char portStr[6];
+    char altPortStr[6];
+
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    snprintf(altPortStr, sizeof(altPortStr), "%d", port + RELAY_PORT_OFFSET);
+
+    // Overwrite our relay mapping in place, so there's no window where the port isn't forwarded.
+    // Our relay mapping is static, so keep the direct mapping static too.
+    MappingLog("Retrying direct UPnP port mapping for %s %s -> %s...", protoStr, portStr, myAddr);
+    int err = SoapAddPortMapping(
+        urls->controlURL, data->first.servicetype, portStr,
+        portStr, myAddr, myDesc, protoStr, "0");
+    if (err != UPNPCOMMAND_SUCCESS) {
+        // The router still won't take it, so the relay mapping is untouched
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+        return false;
+    }
+    MappingLog("OK" NL);
+
+    // Some broken routers claim success without changing anything, so read it back
+    MappingLog("Verifying direct UPnP port mapping for %s %s...", protoStr, portStr);
+    err = SoapGetSpecificPortMappingEntry(
+        urls->controlURL, data->first.servicetype, portStr, protoStr,
+        intClient, intPort, desc, enabled, leaseDuration);
+    if (err == UPNPCOMMAND_SUCCESS && !strcmp(intClient, myAddr) && atoi(intPort) == port) {
+        MappingLog("OK (Relay bypassed)" NL);
+        return true;
+    }
+    else if (err == UPNPCOMMAND_SUCCESS) {
+        MappingLog("MISMATCH: %s %s" NL, intClient, intPort);
+    }
+    else {
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+    }
+
+    // Put the relay mapping back
+    MappingLog("Restoring relay UPnP port mapping for %s %s -> %s...", protoStr, portStr, myAddr);
+    err = SoapAddPortMapping(
+        urls->controlURL, data->first.servicetype, portStr,
+        altPortStr, myAddr, myDesc, protoStr, "0");
+    if (err == UPNPCOMMAND_SUCCESS) {
+        MappingLog("OK" NL);
+    }
+    else {
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+    }
+
+    return false;
+}
+
 bool UPnPMapPort(struct UPNPUrls* urls, struct IGDdatas* data, int proto, const char* myAddr, int port, bool enable, bool indefinite, bool validationPass)
 {
     char intClient[16];
@@ -71,7 +231,7 @@ bool UPnPMapPort(struct UPNPUrls* urls, struct IGDdatas* data, int proto, const
 
     DWORD nameLen = sizeof(computerName);
     if (!GetComputerNameA(computerName, &nameLen)) {
-        printf("GetComputerNameA() failed: %d", GetLastError());
+        MappingLog("GetComputerNameA() failed: %d", GetLastError());
         snprintf(computerName, sizeof(computerName), "UNKNOWN");
     }
     snprintf(myDesc, sizeof(myDesc), "%s - %s", UPNP_SERVICE_NAME, computerName);
@@ -90,13 +250,16 @@ bool UPnPMapPort(struct UPNPUrls* urls, struct IGDdatas* data, int proto, const
         return false;
     }
 
-    printf("Checking for existing UPnP port mapping for %s %s -> %s %s...", protoStr, portStr, myAddr, computerName);
-    int err = UPNP_GetSpecificPortMappingEntry(
-        urls->controlURL, data->first.servicetype, portStr, protoStr, nullptr,
+    OBSERVED_MAPPING observed;
+    RtlZeroMemory(&observed, sizeof(observed));
+
+    MappingLog("Checking for existing UPnP port mapping for %s %s -> %s %s...", protoStr, portStr, myAddr, computerName);
+    int err = SoapGetSpecificPortMappingEntry(
+        urls->controlURL, data->first.servicetype, portStr, protoStr,
         intClient, intPort, desc, enabled, leaseDuration);
     if (err == 714) {
         // NoSuchEntryInArray
-        printf("NOT FOUND" NL);
+        MappingLog("NOT FOUND" NL);
 
         if (validationPass) {
             // On validation, we found a missing entry. Convert this entry to indefinite
@@ -105,107 +268,137 @@ bool UPnPMapPort(struct UPNPUrls* urls, struct IGDdatas* data, int proto, const
         }
     }
     else if (err == 606) {
-        printf("UNAUTHORIZED" NL);
+        MappingLog("UNAUTHORIZED" NL);
 
         // If we're just validating, we're done. We can't know if the entry was
         // actually applied but we'll return true to avoid false errors if it was.
         if (validationPass) {
             return true;
         }
+
+        observed.lookupFailed = true;
     }
     else if (err == UPNPCOMMAND_SUCCESS) {
+        observed.present = true;
+        strncpy(observed.internalClient, intClient, sizeof(observed.internalClient) - 1);
+        observed.internalPort = atoi(intPort);
+        observed.leaseRemaining = (unsigned int)strtoul(leaseDuration, nullptr, 10);
+
         // Some routers change the description, so we can't check that here
         if (!strcmp(intClient, myAddr)) {
-            if (atoi(leaseDuration) == 0) {
-                printf("OK (Static, Internal port: %s)" NL, intPort);
-
-                // If we have an existing permanent mapping, we can just leave it alone.
-                if (enable) {
-                    return true;
+            if (observed.leaseRemaining == 0) {
+                MappingLog("OK (Static, Internal port: %s)" NL, intPort);
+
+                // If this permanent mapping points at our relay, periodically check whether the
+                // router will now accept the real internal port (after a reboot or firmware update).
+                // If it does, we can skip the extra hop through the relay.
+                if (enable && !validationPass && observed.internalPort == port + RELAY_PORT_OFFSET) {
+                    if (IsRelayDuplicating(port)) {
+                        // Bypassing the relay would silently stop the duplication
+                        MappingLog("Keeping relay UPnP port mapping for %s %s since it duplicates packets" NL, protoStr, portStr);
+                    }
+                    else if (RecordRelayBypassAttempt(urls->controlURL, proto, port, true)) {
+                        UPnPTryRelayBypass(urls, data, protoStr, myAddr, myDesc, port);
+                    }
                 }
             }
             else {
-                printf("OK (%s seconds remaining, Internal port: %s)" NL, leaseDuration, intPort);
-            }
-
-            // If we're just validating, we found an entry, so we're done.
-            if (validationPass) {
-                return true;
-            }
-
-            if (!enable) {
-                // This is our entry. Go ahead and nuke it
-                printf("Deleting UPnP mapping for %s %s -> %s...", protoStr, portStr, myAddr);
-                err = UPNP_DeletePortMapping(urls->controlURL, data->first.servicetype, portStr, protoStr, nullptr);
-                if (err == UPNPCOMMAND_SUCCESS) {
-                    printf("OK" NL);
-                }
-                else {
-                    printf("ERROR %d" NL, err);
-                }
-
-                return true;
+                MappingLog("OK (%s seconds remaining, Internal port: %s)" NL, leaseDuration, intPort);
             }
         }
         else {
-            printf("CONFLICT: %s %s" NL, intClient, desc);
-
-            // If we're just validating, we found an entry, so we're done.
-            if (validationPass) {
-                return true;
-            }
+            MappingLog("CONFLICT: %s %s" NL, intClient, desc);
+        }
 
-            // Some UPnP IGDs won't let unauthenticated clients delete other conflicting port mappings
-            // for security reasons, but we will give it a try anyway. If GameStream is not enabled,
-            // we will leave the conflicting entry alone to avoid disturbing another PC's port forwarding
-            // (especially if we're double NATed).
-            if (enable) {
-                printf("Trying to delete conflicting UPnP mapping for %s %s -> %s...", protoStr, portStr, intClient);
-                err = UPNP_DeletePortMapping(urls->controlURL, data->first.servicetype, portStr, protoStr, nullptr);
-                if (err == UPNPCOMMAND_SUCCESS) {
-                    printf("OK" NL);
-                }
-                else if (err == 606) {
-                    printf("UNAUTHORIZED" NL);
-                    return false;
-                }
-                else {
-                    printf("ERROR %d" NL, err);
-                    return false;
-                }
-            }
+        // If we're just validating, we found an entry, so we're done.
+        if (validationPass) {
+            return true;
         }
     }
     else {
-        printf("ERROR %d (%s)" NL, err, strupnperror(err));
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
 
         // If we get a strange error from the router, we'll assume it's some old broken IGDv1
         // device and only use indefinite lease durations to hopefully avoid confusing it.
         indefinite = true;
+        observed.lookupFailed = true;
+    }
+
+    // Work out the minimal set of changes needed to get the router to the state we want
+    char reason[96];
+    MAPPING_ACTION action = PlanMappingAction(&observed, enable, myAddr, UPNP_RENEW_THRESHOLD_SEC, reason, sizeof(reason));
+    bool conflictDeleted = false;
+
+    // Actions are only recorded once we know whether the router took them, so
+    // a failed request doesn't leave us expecting an entry that isn't there.
+    if (action == MappingActionNone) {
+        RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, action, reason);
+        if (!enable) {
+            RemoveMappingLease("UPnP", urls->controlURL, myAddr, proto, port);
+        }
+        else {
+            // Wake up again when the remaining lease is half gone
+            RecordMappingLease("UPnP", urls->controlURL, myAddr, proto, port, observed.leaseRemaining);
+        }
+        return true;
     }
+    else if (action == MappingActionDelete) {
+        // This is our entry. Go ahead and nuke it
+        MappingLog("Deleting UPnP mapping for %s %s -> %s (%s)...", protoStr, portStr, myAddr, reason);
+        err = SoapDeletePortMapping(urls->controlURL, data->first.servicetype, portStr, protoStr);
+        if (err == UPNPCOMMAND_SUCCESS) {
+            MappingLog("OK" NL);
+            RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, action, reason);
+        }
+        else {
+            MappingLog("ERROR %d" NL, err);
+            RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, MappingActionNone, "delete failed");
+        }
 
-    // Bail if GameStream is disabled
-    if (!enable) {
+        RemoveMappingLease("UPnP", urls->controlURL, myAddr, proto, port);
         return true;
     }
+    else if (action == MappingActionReplace) {
+        // Some UPnP IGDs won't let unauthenticated clients delete other conflicting port mappings
+        // for security reasons, but we will give it a try anyway. If GameStream is not enabled,
+        // we will leave the conflicting entry alone to avoid disturbing another PC's port forwarding
+        // (especially if we're double NATed).
+        MappingLog("Trying to delete conflicting UPnP mapping for %s %s -> %s...", protoStr, portStr, intClient);
+        err = SoapDeletePortMapping(urls->controlURL, data->first.servicetype, portStr, protoStr);
+        if (err == UPNPCOMMAND_SUCCESS) {
+            MappingLog("OK" NL);
+            conflictDeleted = true;
+        }
+        else if (err == 606) {
+            MappingLog("UNAUTHORIZED" NL);
+            RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, MappingActionNone, "replace unauthorized");
+            return false;
+        }
+        else {
+            MappingLog("ERROR %d" NL, err);
+            RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, MappingActionNone, "replace failed");
+            return false;
+        }
+    }
 
     // Create or update the expiration time of an existing mapping
-    snprintf(leaseDuration, sizeof(leaseDuration), "%d",
-        indefinite ? 0 : PORT_MAPPING_DURATION_SEC);
-    printf("Updating UPnP port mapping for %s %s -> %s...", protoStr, portStr, myAddr);
-    err = UPNP_AddPortMapping(
+    unsigned int lifetime = indefinite ? 0 : PORT_MAPPING_DURATION_SEC;
+    snprintf(leaseDuration, sizeof(leaseDuration), "%u", lifetime);
+    MappingLog("Updating UPnP port mapping for %s %s -> %s (%s)...", protoStr, portStr, myAddr, reason);
+    err = SoapAddPortMapping(
         urls->controlURL, data->first.servicetype, portStr,
-        portStr, myAddr, myDesc, protoStr, nullptr, leaseDuration);
+        portStr, myAddr, myDesc, protoStr, leaseDuration);
     if (err != UPNPCOMMAND_SUCCESS && !indefinite) {
         // This may be a broken IGD that doesn't like non-static mappings. Try a static
         // mapping before finally giving up.
-        err = UPNP_AddPortMapping(
+        err = SoapAddPortMapping(
             urls->controlURL, data->first.servicetype, portStr,
-            portStr, myAddr, myDesc, protoStr, nullptr, "0");
-        printf("STATIC RETRY ");
+            portStr, myAddr, myDesc, protoStr, "0");
+        MappingLog("STATIC RETRY ");
+        lifetime = 0;
     }
     else if (indefinite) {
-        printf("STATIC ");
+        MappingLog("STATIC ");
     }
     if (err == 718 && proto == IPPROTO_UDP && port >= 47000) { // ConflictInMappingEntry
         // Some UPnP implementations incorrectly deduplicate on the internal port instead
@@ -217,17 +410,27 @@ bool UPnPMapPort(struct UPNPUrls* urls, struct IGDdatas* data, int proto, const
         // and we'll use an indefinite mapping too.
         char altPortStr[6];
         snprintf(altPortStr, sizeof(altPortStr), "%d", port + RELAY_PORT_OFFSET);
-        err = UPNP_AddPortMapping(
+        err = SoapAddPortMapping(
             urls->controlURL, data->first.servicetype, portStr,
-            altPortStr, myAddr, myDesc, protoStr, nullptr, "0");
-        printf("ALTERNATE ");
+            altPortStr, myAddr, myDesc, protoStr, "0");
+        MappingLog("ALTERNATE ");
+        lifetime = 0;
+
+        // We just tried the direct mapping, so don't retry it until the next interval
+        RecordRelayBypassAttempt(urls->controlURL, proto, port, false);
     }
     if (err == UPNPCOMMAND_SUCCESS) {
-        printf("OK" NL);
+        MappingLog("OK" NL);
+        RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed, action, reason);
+        RecordMappingLease("UPnP", urls->controlURL, myAddr, proto, port, lifetime);
         return true;
     }
     else {
-        printf("ERROR %d (%s)" NL, err, strupnperror(err));
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+
+        // If we got rid of a conflicting entry, that's all that actually changed
+        RecordMappingAction("UPnP", urls->controlURL, myAddr, proto, port, &observed,
+            conflictDeleted ? MappingActionDelete : MappingActionNone, "update failed");
         return false;
     }
 }
@@ -249,7 +452,7 @@ bool GetIP4OnLinkPrefixLength(char* lanAddressString, int* prefixLength)
         free(addresses);
         addresses = (PIP_ADAPTER_ADDRESSES)malloc(length);
         if (addresses == NULL) {
-            printf("malloc(%u) failed" NL, length);
+            MappingLog("malloc(%u) failed" NL, length);
             return false;
         }
 
@@ -265,7 +468,7 @@ bool GetIP4OnLinkPrefixLength(char* lanAddressString, int* prefixLength)
     } while (error == ERROR_BUFFER_OVERFLOW);
 
     if (error != ERROR_SUCCESS) {
-        printf("GetAdaptersAddresses() failed: %d" NL, error);
+        MappingLog("GetAdaptersAddresses() failed: %d" NL, error);
         free(addresses);
         return false;
     }
@@ -291,524 +494,2175 @@ bool GetIP4OnLinkPrefixLength(char* lanAddressString, int* prefixLength)
         currentAdapter = currentAdapter->Next;
     }
 
-    printf("No adapter found with IPv4 address: %s" NL, lanAddressString);
+    MappingLog("No adapter found with IPv4 address: %s" NL, lanAddressString);
     free(addresses);
     return false;
 }
 
-bool UPnPHandleDeviceList(struct UPNPDev* list, bool enable, char* lanAddrOverride, char* wanAddr)
+typedef struct _UPNP_MAPPING_CONTEXT {
+    struct UPNPUrls* urls;
+    struct IGDdatas* data;
+    bool validationPass;
+} UPNP_MAPPING_CONTEXT, *PUPNP_MAPPING_CONTEXT;
+
+bool UPnPMappingOp(PMAPPING_OP op)
+{
+    PUPNP_MAPPING_CONTEXT context = (PUPNP_MAPPING_CONTEXT)op->context;
+
+    return UPnPMapPort(context->urls, context->data, op->proto, op->internalAddress, op->port,
+        op->enable, op->indefinite, context->validationPass);
+}
+
+bool UPnPVerifyMappingOp(PMAPPING_OP op)
 {
-    struct UPNPUrls urls;
-    struct IGDdatas data;
-    char localAddress[128];
-    char* portMappingInternalAddress;
-    int pinholeAllowed = false;
+    PUPNP_MAPPING_CONTEXT context = (PUPNP_MAPPING_CONTEXT)op->context;
+    char intClient[16];
+    char intPort[6];
+    char desc[80];
+    char enabled[4];
+    char leaseDuration[16];
+    char portStr[6];
+
+    snprintf(portStr, sizeof(portStr), "%d", op->port);
+
+    // Stay quiet unless something changed, since we may poll several times
+    int err = SoapGetSpecificPortMappingEntry(
+        context->urls->controlURL, context->data->first.servicetype, portStr,
+        op->proto == IPPROTO_TCP ? "TCP" : "UDP",
+        intClient, intPort, desc, enabled, leaseDuration);
+    if (err == UPNPCOMMAND_SUCCESS || err == 606) {
+        // Present (possibly a conflict that the mapping pass already reported) or
+        // we're not allowed to look, which the validation pass treats as success.
+        return true;
+    }
+
+    // The entry went missing (or the router is misbehaving), so let the validation
+    // pass convert it to a permanent entry like it always has.
+    op->changed = true;
+    return UPnPMapPort(context->urls, context->data, op->proto, op->internalAddress, op->port,
+        op->enable, op->indefinite, true);
+}
+
+static int FindRouterSettleTimeSlot(const char* controlURL)
+{
+    for (int i = 0; i < ARRAYSIZE(s_RouterSettleTimes); i++) {
+        if (!strcmp(s_RouterSettleTimes[i].controlURL, controlURL)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Returns how long this router has needed for its mappings to settle, or 0 if we don't know
+DWORD GetRouterSettleTime(const char* controlURL)
+{
+    DWORD settleTimeMs;
+
+    // Gateways at different NAT levels are mapped concurrently
+    AcquireSRWLockShared(&s_RouterSettleTimeLock);
+    int slot = FindRouterSettleTimeSlot(controlURL);
+    settleTimeMs = slot >= 0 ? s_RouterSettleTimes[slot].settleTimeMs : 0;
+    ReleaseSRWLockShared(&s_RouterSettleTimeLock);
+
+    // Fall back to what we saved with the cached IGD before the last restart
+    if (slot < 0) {
+        settleTimeMs = GetCachedIGDSettleTime(controlURL);
+    }
+
+    return settleTimeMs;
+}
+
+// Remembers the longest settle time we've seen for this router
+void SetRouterSettleTime(const char* controlURL, DWORD settleTimeMs)
+{
+    bool changed = false;
+
+    AcquireSRWLockExclusive(&s_RouterSettleTimeLock);
+
+    int slot = FindRouterSettleTimeSlot(controlURL);
+    if (slot < 0) {
+        slot = FindRouterSettleTimeSlot("");
+
+        // Take over the first slot if we're full
+        if (slot < 0) {
+            slot = 0;
+        }
+
+        strncpy(s_RouterSettleTimes[slot].controlURL, controlURL, sizeof(s_RouterSettleTimes[slot].controlURL) - 1);
+        s_RouterSettleTimes[slot].controlURL[sizeof(s_RouterSettleTimes[slot].controlURL) - 1] = 0;
+        s_RouterSettleTimes[slot].settleTimeMs = GetCachedIGDSettleTime(controlURL);
+    }
+
+    if (settleTimeMs > s_RouterSettleTimes[slot].settleTimeMs) {
+        s_RouterSettleTimes[slot].settleTimeMs = settleTimeMs;
+        changed = true;
+    }
+
+    ReleaseSRWLockExclusive(&s_RouterSettleTimeLock);
+
+    if (changed) {
+        SetCachedIGDSettleTime(controlURL, settleTimeMs);
+    }
+}
+
+bool UPnPVerifyMappings(struct UPNPUrls* urls, struct IGDdatas* data, char* internalAddress)
+{
+    UPNP_MAPPING_CONTEXT context = { urls, data, true };
+    MAPPING_OP ops[ARRAYSIZE(k_Ports)];
+    DWORD settleTime = GetRouterSettleTime(urls->controlURL);
+    DWORD waitTime = UPNP_VERIFY_INITIAL_INTERVAL_MS;
+    DWORD lastChangeTime = 0;
+    DWORD elapsed;
+    ULONGLONG startTime = GetTickCount64();
     bool success = true;
 
-    int ret = UPNP_GetValidIGD(list, &urls, &data, localAddress, sizeof(localAddress));
-    if (ret == 0) {
-        printf("No UPnP device found!" NL);
+    // Some routers silently drop entries some time after adding them. Poll with increasing
+    // intervals until we've gone past the time this router has needed to settle before.
+    // If we've never seen this router before, we poll all the way to the deadline.
+    DWORD targetTime = settleTime != 0 ? settleTime : UPNP_VERIFY_DEADLINE_MS;
+    MappingLog("Verifying UPnP port mappings for up to %u ms..." NL, targetTime);
+
+    for (;;) {
+        Sleep(waitTime);
+        elapsed = (DWORD)(GetTickCount64() - startTime);
+
+        int opCount = 0;
+        for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
+            InitMappingOp(&ops[opCount++], UPnPVerifyMappingOp, &context, internalAddress,
+                k_Ports[i].proto, k_Ports[i].port, true, false, true);
+        }
+
+        bool pollSuccess = ExecuteMappingOps(ops, opCount);
+
+        bool changed = false;
+        for (int i = 0; i < opCount; i++) {
+            if (ops[i].changed) {
+                changed = true;
+            }
+        }
+
+        if (changed) {
+            MappingLog("UPnP port mappings changed %u ms after being added" NL, elapsed);
+            lastChangeTime = elapsed;
+        }
+
+        if (!pollSuccess) {
+            // We couldn't repair an entry, so polling more won't help
+            success = false;
+            break;
+        }
+        else if (!changed && elapsed >= targetTime) {
+            break;
+        }
+        else if (elapsed >= UPNP_VERIFY_DEADLINE_MS) {
+            break;
+        }
+
+        // Poll at exponentially increasing intervals, but don't overshoot our target
+        DWORD nextTarget = changed || elapsed >= targetTime ? UPNP_VERIFY_DEADLINE_MS : targetTime;
+        waitTime = min(waitTime * 2, nextTarget - elapsed);
+        if (waitTime == 0) {
+            waitTime = UPNP_VERIFY_INITIAL_INTERVAL_MS;
+        }
+    }
+
+    // Learn how long this router takes to settle. A router that never changed settles instantly,
+    // but keep the longest change we've ever seen since it may not happen on every cycle.
+    DWORD observedSettleTime = max(lastChangeTime, (DWORD)UPNP_VERIFY_INITIAL_INTERVAL_MS);
+    if (observedSettleTime > settleTime) {
+        settleTime = observedSettleTime;
+        SetRouterSettleTime(urls->controlURL, settleTime);
+    }
+
+    MappingLog("UPnP port mapping verification %s after %u ms (settle time: %u ms)" NL,
+        success ? "completed" : "failed", elapsed, settleTime);
+    return success;
+}
+
+// Checks that the device at the cached description URL is still the one we cached
+bool UPnPCheckCachedIGDIdentity(PIGD_CACHE_ENTRY entry)
+{
+    char udn[256];
+    int descSize;
+    int statusCode;
+
+    if (entry->usn[0] == 0 || entry->descURL[0] == 0) {
         return false;
     }
-    else if (ret == 3) {
-        printf("No UPnP IGD found!" NL);
-        FreeUPNPUrls(&urls);
+
+    // The USN starts with the device's UDN, which appears in its description
+    strncpy(udn, entry->usn, sizeof(udn) - 1);
+    udn[sizeof(udn) - 1] = 0;
+    char* separator = strstr(udn, "::");
+    if (separator != nullptr) {
+        *separator = 0;
+    }
+
+    char* desc = (char*)miniwget(entry->descURL, &descSize, 0, &statusCode);
+    if (desc == nullptr) {
         return false;
     }
-    else if (ret == 1) {
-        printf("Found a connected UPnP IGD" NL);
+
+    // The description isn't null terminated
+    bool match = false;
+    int udnLength = (int)strlen(udn);
+    for (int i = 0; statusCode == 200 && i + udnLength <= descSize; i++) {
+        if (!memcmp(&desc[i], udn, udnLength)) {
+            match = true;
+            break;
+        }
     }
-    else if (ret == 2) {
-        printf("Found a disconnected UPnP IGD (!)" NL);
 
-        // Even if we are able to add forwarding entries, go ahead and try NAT-PMP
-        success = false;
+    free(desc);
+    return match;
+}
+
+// Returns the same values as UPNP_GetValidIGD(), except that 0 means there's no cached
+// IGD we can use and 3 is never returned
+int UPnPGetCachedIGD(char* target, struct UPNPUrls* urls, struct IGDdatas* data, char* localAddress, int localAddressLen, char* wanAddr)
+{
+    IGD_CACHE_ENTRY entry;
+    char gatewayMac[32];
+    char connectionStatus[64];
+    char lastConnectionError[64];
+    unsigned int uptime;
+    int prefixLength;
+    int ret;
+
+    if (!GetCachedIGD(target, &entry)) {
+        return 0;
     }
-    else {
-        printf("UPNP_GetValidIGD() failed: %d" NL, ret);
-        return false;
+
+    // Make sure we're still on the same network before trusting the cached IGD. We can only see
+    // the MAC address of an on-link gateway, so others are checked against their USN if they
+    // stop answering.
+    if (target == nullptr && (!GetGatewayMacAddress(target, gatewayMac, sizeof(gatewayMac)) || strcmp(gatewayMac, entry.gatewayMac))) {
+        MappingLog("Gateway has changed since the UPnP IGD was cached" NL);
+        RemoveCachedIGD(target);
+        return 0;
+    }
+    else if (target == nullptr && !GetIP4OnLinkPrefixLength(entry.localAddress, &prefixLength)) {
+        MappingLog("Local address has changed since the UPnP IGD was cached" NL);
+        RemoveCachedIGD(target);
+        return 0;
     }
 
-    ret = UPNP_GetExternalIPAddress(urls.controlURL, data.first.servicetype, wanAddr);
-    if (ret == UPNPCOMMAND_SUCCESS) {
-        printf("UPnP IGD WAN address is: %s" NL, wanAddr);
+    RtlZeroMemory(urls, sizeof(*urls));
+    RtlZeroMemory(data, sizeof(*data));
+    urls->controlURL = _strdup(entry.controlURL);
+    strncpy(data->first.servicetype, entry.serviceType, sizeof(data->first.servicetype) - 1);
+
+    // Check the connection like UPNP_GetValidIGD() does, so a disconnected IGD still
+    // lets the other protocols take over
+    MappingLog("Revalidating cached UPnP IGD at %s...", entry.controlURL);
+    if (target == nullptr) {
+        int err = UPNP_GetStatusInfo(urls->controlURL, data->first.servicetype, connectionStatus, &uptime, lastConnectionError);
+        if (err != UPNPCOMMAND_SUCCESS) {
+            MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+            FreeUPNPUrls(urls);
+            RemoveCachedIGD(target);
+            *wanAddr = 0;
+            return 0;
+        }
+
+        err = UPNP_GetExternalIPAddress(urls->controlURL, data->first.servicetype, wanAddr);
+        if (err != UPNPCOMMAND_SUCCESS) {
+            *wanAddr = 0;
+        }
     }
     else {
-        // Empty string
-        *wanAddr = 0;
+        // Upstream IGDs get a single cheap call. Having a WAN address is as good as being connected.
+        int err = UPNP_GetExternalIPAddress(urls->controlURL, data->first.servicetype, wanAddr);
+        if (err != UPNPCOMMAND_SUCCESS) {
+            MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+            FreeUPNPUrls(urls);
+            *wanAddr = 0;
+
+            // Only forget it if something else took its place. Otherwise it's worth trying
+            // again next time, in case discovery doesn't find it either.
+            if (!UPnPCheckCachedIGDIdentity(&entry)) {
+                MappingLog("UPnP IGD at %s has changed since it was cached" NL, target);
+                RemoveCachedIGD(target);
+            }
+            return 0;
+        }
+
+        strcpy(connectionStatus, *wanAddr != 0 && strcmp(wanAddr, "0.0.0.0") ? "Connected" : "No WAN address");
     }
 
-    // We may be mapping on behalf of another device
-    if (lanAddrOverride != nullptr) {
-        portMappingInternalAddress = lanAddrOverride;
+    // An IGD with no WAN address isn't really connected, whatever it says
+    if (strcmp(connectionStatus, "Connected") || *wanAddr == 0 || !strcmp(wanAddr, "0.0.0.0")) {
+        MappingLog("DISCONNECTED (%s)" NL, connectionStatus);
+        ret = 2;
     }
     else {
-        portMappingInternalAddress = localAddress;
+        MappingLog("OK" NL);
+        ret = 1;
     }
 
-    // Create the port mappings
-    for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
-        if (!UPnPMapPort(&urls, &data, k_Ports[i].proto, portMappingInternalAddress, k_Ports[i].port, enable, false, false)) {
-            success = false;
+    if (*wanAddr != 0) {
+        MappingLog("UPnP IGD WAN address is: %s" NL, wanAddr);
+    }
+
+    strncpy(localAddress, entry.localAddress, localAddressLen - 1);
+    localAddress[localAddressLen - 1] = 0;
+    return ret;
+}
+
+typedef struct _IGD_SELECTION IGD_SELECTION, *PIGD_SELECTION;
+
+typedef struct _IGD_CANDIDATE {
+    PIGD_SELECTION selection;
+    char* descURL;
+
+    // Only valid once the status is no longer pending
+    struct UPNPUrls urls;
+    struct IGDdatas data;
+    char lanAddress[128];
+
+    // One of the UPNP_GetValidIGD() return values, or -1 while pending
+    int status;
+
+    // The caller now owns the URLs
+    bool taken;
+} IGD_CANDIDATE, *PIGD_CANDIDATE;
+
+// Shared with the fetch threads, which may outlive the selection if they're slow
+struct _IGD_SELECTION {
+    SRWLOCK lock;
+    CONDITION_VARIABLE statusChanged;
+    LONG refCount;
+    int candidateCount;
+    IGD_CANDIDATE candidates[IGD_MAX_CANDIDATES];
+};
+
+void ReleaseIGDSelection(PIGD_SELECTION selection)
+{
+    if (InterlockedDecrement(&selection->refCount) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < selection->candidateCount; i++) {
+        PIGD_CANDIDATE candidate = &selection->candidates[i];
+
+        if (candidate->status > 0 && !candidate->taken) {
+            FreeUPNPUrls(&candidate->urls);
         }
+        free(candidate->descURL);
     }
 
-    // Do a best-effort for IPv4 Wake-on-LAN broadcast mappings
-    for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
-        if (lanAddrOverride == nullptr) {
-            // Map the port to the broadcast address (may not work on all routers). This
-            // ensures delivery even after the ARP entry for this PC times out on the router.
-            int onLinkPrefixLen;
-            if (GetIP4OnLinkPrefixLength(localAddress, &onLinkPrefixLen)) {
-                int netmask = 0;
-                for (int j = 0; j < onLinkPrefixLen; j++) {
-                    netmask |= (1 << j);
-                }
+    free(selection);
+}
 
-                in_addr broadcastAddr;
-                broadcastAddr.S_un.S_addr = inet_addr(localAddress);
-                broadcastAddr.S_un.S_addr |= ~netmask;
+// Does what UPNP_GetValidIGD() does for a single device
+DWORD WINAPI IGDCandidateThreadProc(LPVOID context)
+{
+    PIGD_CANDIDATE candidate = (PIGD_CANDIDATE)context;
+    PIGD_SELECTION selection = candidate->selection;
+    struct UPNPUrls urls;
+    struct IGDdatas data;
+    char lanAddress[128] = {};
+    int status;
 
-                char broadcastAddrStr[128];
-                inet_ntop(AF_INET, &broadcastAddr, broadcastAddrStr, sizeof(broadcastAddrStr));
+    if (!UPNP_GetIGDFromUrl(candidate->descURL, &urls, &data, lanAddress, sizeof(lanAddress))) {
+        status = 0;
+    }
+    else if (strncmp(data.CIF.servicetype, "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:", 54)) {
+        status = 3;
+    }
+    else if (UPNPIGD_IsConnected(&urls, &data)) {
+        status = 1;
+    }
+    else {
+        status = 2;
+
+        // The IGD may have both a WANIPConnection and a WANPPPConnection, and only one is connected
+        if (data.second.servicetype[0] != 0) {
+            data.tmp = data.first;
+            data.first = data.second;
+            data.second = data.tmp;
+
+            FreeUPNPUrls(&urls);
+            GetUPNPUrls(&urls, &data, candidate->descURL, 0);
+            if (UPNPIGD_IsConnected(&urls, &data)) {
+                status = 1;
+            }
+            else {
+                data.second = data.first;
+                data.first = data.tmp;
 
-                UPnPMapPort(&urls, &data, IPPROTO_UDP, broadcastAddrStr, k_WolPorts[i], enable, true, false);
+                FreeUPNPUrls(&urls);
+                GetUPNPUrls(&urls, &data, candidate->descURL, 0);
             }
         }
-        else {
-            // When we're mapping the WOL ports upstream of our router, we map directly to
-            // the port on the upstream address (likely our router's WAN interface).
-            UPnPMapPort(&urls, &data, IPPROTO_UDP, lanAddrOverride, k_WolPorts[i], enable, true, false);
+    }
+
+    AcquireSRWLockExclusive(&selection->lock);
+    if (status > 0) {
+        candidate->urls = urls;
+        candidate->data = data;
+        strcpy(candidate->lanAddress, lanAddress);
+    }
+    candidate->status = status;
+    ReleaseSRWLockExclusive(&selection->lock);
+
+    WakeAllConditionVariable(&selection->statusChanged);
+    ReleaseIGDSelection(selection);
+    return 0;
+}
+
+// Like UPNP_GetValidIGD(), but fetches every device description at once rather than one
+// after another. A connected IGD is picked as soon as we find it, and devices that haven't
+// answered within the timeout are left behind.
+int UPnPGetValidIGD(struct UPNPDev* list, struct UPNPUrls* urls, struct IGDdatas* data, char* lanAddress, int lanAddressLen)
+{
+    PIGD_SELECTION selection;
+    ULONGLONG startTime = GetTickCount64();
+    ULONGLONG deadline = startTime + IGD_DESCRIPTION_TIMEOUT_MS;
+    int best = -1;
+    int pending;
+
+    selection = (PIGD_SELECTION)calloc(1, sizeof(*selection));
+    if (selection == nullptr) {
+        return UPNP_GetValidIGD(list, urls, data, lanAddress, lanAddressLen);
+    }
+
+    InitializeSRWLock(&selection->lock);
+    InitializeConditionVariable(&selection->statusChanged);
+    selection->refCount = 1;
+
+    AcquireSRWLockExclusive(&selection->lock);
+
+    for (struct UPNPDev* dev = list; dev != nullptr; dev = dev->pNext) {
+        bool duplicate = false;
+
+        // A device answers once for each of its services, but they all share a description
+        for (int i = 0; i < selection->candidateCount; i++) {
+            if (!strcmp(selection->candidates[i].descURL, dev->descURL)) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (duplicate) {
+            continue;
+        }
+        else if (selection->candidateCount == IGD_MAX_CANDIDATES) {
+            MappingLog("Too many UPnP devices. Ignoring %s" NL, dev->descURL);
+            continue;
+        }
+
+        PIGD_CANDIDATE candidate = &selection->candidates[selection->candidateCount];
+        candidate->selection = selection;
+        candidate->descURL = _strdup(dev->descURL);
+        candidate->status = -1;
+        if (candidate->descURL == nullptr) {
+            continue;
+        }
+        selection->candidateCount++;
+
+        InterlockedIncrement(&selection->refCount);
+        HANDLE thread = CreateThread(nullptr, 0, IGDCandidateThreadProc, candidate, 0, nullptr);
+        if (thread == nullptr) {
+            MappingLog("CreateThread() failed: %d" NL, GetLastError());
+            InterlockedDecrement(&selection->refCount);
+            candidate->status = 0;
+        }
+        else {
+            CloseHandle(thread);
+        }
+    }
+
+    // Rank the candidates as they come in. Lower status values are better.
+    for (;;) {
+        best = -1;
+        pending = 0;
+
+        for (int i = 0; i < selection->candidateCount; i++) {
+            int status = selection->candidates[i].status;
+
+            if (status < 0) {
+                pending++;
+            }
+            else if (status > 0 && (best < 0 || status < selection->candidates[best].status)) {
+                best = i;
+            }
+        }
+
+        // Nothing can beat a connected IGD, so don't wait for the rest
+        if (pending == 0 || (best >= 0 && selection->candidates[best].status == 1)) {
+            break;
+        }
+
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) {
+            MappingLog("Gave up waiting for %d of %d UPnP device descriptions" NL, pending, selection->candidateCount);
+            break;
+        }
+
+        SleepConditionVariableSRW(&selection->statusChanged, &selection->lock, (DWORD)(deadline - now), 0);
+    }
+
+    int ret = 0;
+    if (best >= 0) {
+        PIGD_CANDIDATE candidate = &selection->candidates[best];
+
+        *urls = candidate->urls;
+        *data = candidate->data;
+        strncpy(lanAddress, candidate->lanAddress, lanAddressLen - 1);
+        lanAddress[lanAddressLen - 1] = 0;
+        candidate->taken = true;
+        ret = candidate->status;
+
+        MappingLog("Selected UPnP device %s after %llu ms" NL, candidate->descURL, GetTickCount64() - startTime);
+    }
+
+    ReleaseSRWLockExclusive(&selection->lock);
+    ReleaseIGDSelection(selection);
+
+    return ret;
+}
+
+int UPnPSelectIGD(struct UPNPDev* list, char* target, struct UPNPUrls* urls, struct IGDdatas* data, char* localAddress, int localAddressLen, char* wanAddr)
+{
+    int ret = UPnPGetValidIGD(list, urls, data, localAddress, localAddressLen);
+    if (ret == 0) {
+        MappingLog("No UPnP device found!" NL);
+        return 0;
+    }
+    else if (ret == 3) {
+        MappingLog("No UPnP IGD found!" NL);
+        FreeUPNPUrls(urls);
+        return 0;
+    }
+    else if (ret == 1) {
+        MappingLog("Found a connected UPnP IGD" NL);
+    }
+    else if (ret == 2) {
+        MappingLog("Found a disconnected UPnP IGD (!)" NL);
+    }
+    else {
+        MappingLog("UPNP_GetValidIGD() failed: %d" NL, ret);
+        return 0;
+    }
+
+    int err = UPNP_GetExternalIPAddress(urls->controlURL, data->first.servicetype, wanAddr);
+    if (err == UPNPCOMMAND_SUCCESS) {
+        MappingLog("UPnP IGD WAN address is: %s" NL, wanAddr);
+    }
+    else {
+        // Empty string
+        *wanAddr = 0;
+    }
+
+    // Remember connected IGDs so we can skip discovery next time
+    if (ret == 1 && err == UPNPCOMMAND_SUCCESS) {
+        IGD_CACHE_ENTRY entry = {};
+
+        strncpy(entry.controlURL, urls->controlURL, sizeof(entry.controlURL) - 1);
+        strncpy(entry.serviceType, data->first.servicetype, sizeof(entry.serviceType) - 1);
+        strncpy(entry.localAddress, localAddress, sizeof(entry.localAddress) - 1);
+
+        // IGDv2 devices may also manage the IPv6 firewall
+        if (urls->controlURL_6FC != nullptr && data->IPv6FC.servicetype[0] != 0) {
+            strncpy(entry.controlURL6FC, urls->controlURL_6FC, sizeof(entry.controlURL6FC) - 1);
+            strncpy(entry.serviceType6FC, data->IPv6FC.servicetype, sizeof(entry.serviceType6FC) - 1);
+        }
+
+        if (urls->rootdescURL != nullptr) {
+            strncpy(entry.descURL, urls->rootdescURL, sizeof(entry.descURL) - 1);
+        }
+
+        for (struct UPNPDev* dev = list; dev != nullptr; dev = dev->pNext) {
+            if (urls->rootdescURL != nullptr && !strcmp(dev->descURL, urls->rootdescURL)) {
+                strncpy(entry.usn, dev->usn, sizeof(entry.usn) - 1);
+                break;
+            }
+        }
+
+        if (GetGatewayMacAddress(target, entry.gatewayMac, sizeof(entry.gatewayMac))) {
+            SetCachedIGD(target, &entry);
+        }
+    }
+
+    return ret;
+}
+
+bool UPnPMapPorts(struct UPNPUrls* urls, struct IGDdatas* data, char* localAddress, bool connected, bool enable, char* lanAddrOverride)
+{
+    char* portMappingInternalAddress;
+
+    // Even if we are able to add forwarding entries to a disconnected IGD, go ahead and try NAT-PMP
+    bool success = connected;
+
+    // We may be mapping on behalf of another device
+    if (lanAddrOverride != nullptr) {
+        portMappingInternalAddress = lanAddrOverride;
+    }
+    else {
+        portMappingInternalAddress = localAddress;
+    }
+
+    UPNP_MAPPING_CONTEXT context = { urls, data, false };
+    MAPPING_OP ops[ARRAYSIZE(k_Ports) + 1 + ARRAYSIZE(k_WolPorts)];
+    int opCount = 0;
+
+    // Create the port mappings
+    for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
+        InitMappingOp(&ops[opCount++], UPnPMappingOp, &context, portMappingInternalAddress,
+            k_Ports[i].proto, k_Ports[i].port, enable, false, true);
+    }
+
+    // Best effort for the STUN beacon port. It's not required for streaming.
+    InitMappingOp(&ops[opCount++], UPnPMappingOp, &context, portMappingInternalAddress,
+        IPPROTO_UDP, STUN_BEACON_PORT, enable, false, false);
+
+    // Do a best-effort for IPv4 Wake-on-LAN broadcast mappings
+    char broadcastAddrStr[128];
+    char* wolAddress = nullptr;
+    if (lanAddrOverride == nullptr) {
+        // Map the port to the broadcast address (may not work on all routers). This
+        // ensures delivery even after the ARP entry for this PC times out on the router.
+        int onLinkPrefixLen;
+        if (GetIP4OnLinkPrefixLength(localAddress, &onLinkPrefixLen)) {
+            int netmask = 0;
+            for (int j = 0; j < onLinkPrefixLen; j++) {
+                netmask |= (1 << j);
+            }
+
+            in_addr broadcastAddr;
+            broadcastAddr.S_un.S_addr = inet_addr(localAddress);
+            broadcastAddr.S_un.S_addr |= ~netmask;
+
+            inet_ntop(AF_INET, &broadcastAddr, broadcastAddrStr, sizeof(broadcastAddrStr));
+            wolAddress = broadcastAddrStr;
+        }
+    }
+    else {
+        // When we're mapping the WOL ports upstream of our router, we map directly to
+        // the port on the upstream address (likely our router's WAN interface).
+        wolAddress = lanAddrOverride;
+    }
+    if (wolAddress != nullptr) {
+        for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
+            InitMappingOp(&ops[opCount++], UPnPMappingOp, &context, wolAddress,
+                IPPROTO_UDP, k_WolPorts[i], enable, true, false);
+        }
+    }
+
+    if (!ExecuteMappingOps(ops, opCount)) {
+        success = false;
+    }
+
+    // Validate the rules are present and correct if they claimed to be added successfully
+    if (success && enable) {
+        if (!UPnPVerifyMappings(urls, data, portMappingInternalAddress)) {
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+typedef struct _NATPMP_MAPPING_CONTEXT {
+    in_addr_t gateway;
+} NATPMP_MAPPING_CONTEXT, *PNATPMP_MAPPING_CONTEXT;
+
+void NATPMPMappingBatch(PMAPPING_OP ops, int opCount, void* context)
+{
+    PNATPMP_MAPPING_CONTEXT natPmpContext = (PNATPMP_MAPPING_CONTEXT)context;
+    SOCKADDR_IN gatewayAddr = {};
+
+    gatewayAddr.sin_family = AF_INET;
+    gatewayAddr.sin_addr.S_un.S_addr = natPmpContext->gateway;
+
+    // All NAT-PMP requests share one socket and are matched up by protocol and port
+    NATPMPMapPorts(&gatewayAddr, ops, opCount);
+}
+
+typedef struct _PCP_MAPPING_CONTEXT {
+    SOCKADDR_IN internalAddr;
+    SOCKADDR_IN targetAddr;
+} PCP_MAPPING_CONTEXT, *PPCP_MAPPING_CONTEXT;
+
+void PCPMappingBatch(PMAPPING_OP ops, int opCount, void* context)
+{
+    PPCP_MAPPING_CONTEXT pcpContext = (PPCP_MAPPING_CONTEXT)context;
+
+    // PCPMapPorts() writes to the addresses, so give it a private copy
+    SOCKADDR_IN internalAddr = pcpContext->internalAddr;
+    SOCKADDR_IN targetAddr = pcpContext->targetAddr;
+
+    // All PCP requests share one socket and are matched up by nonce
+    PCPMapPorts((PSOCKADDR_STORAGE)&internalAddr, sizeof(internalAddr),
+        (PSOCKADDR_STORAGE)&targetAddr, sizeof(targetAddr),
+        ops, opCount);
+}
+
+bool GetPinholeID(const char* internalAddress, int proto, int port, char* uniqueID)
+{
+    bool found = false;
+
+    AcquireSRWLockShared(&s_PinholeLock);
+
+    for (int i = 0; i < ARRAYSIZE(s_Pinholes); i++) {
+        if (s_Pinholes[i].proto == proto && s_Pinholes[i].port == port &&
+                !strcmp(s_Pinholes[i].internalAddress, internalAddress)) {
+            strcpy(uniqueID, s_Pinholes[i].uniqueID);
+            found = true;
+            break;
+        }
+    }
+
+    ReleaseSRWLockShared(&s_PinholeLock);
+
+    return found;
+}
+
+// Passing a null uniqueID forgets the pinhole
+void SetPinholeID(const char* internalAddress, int proto, int port, const char* uniqueID)
+{
+    int slot = -1;
+
+    AcquireSRWLockExclusive(&s_PinholeLock);
+
+    for (int i = 0; i < ARRAYSIZE(s_Pinholes); i++) {
+        if (s_Pinholes[i].proto == proto && s_Pinholes[i].port == port &&
+                !strcmp(s_Pinholes[i].internalAddress, internalAddress)) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot < 0 && uniqueID != nullptr) {
+        for (int i = 0; i < ARRAYSIZE(s_Pinholes); i++) {
+            if (s_Pinholes[i].proto == 0) {
+                slot = i;
+                break;
+            }
+        }
+
+        // Take over the first slot if we're full. That pinhole will just expire.
+        if (slot < 0) {
+            slot = 0;
+        }
+    }
+
+    if (slot >= 0) {
+        if (uniqueID != nullptr) {
+            strncpy(s_Pinholes[slot].internalAddress, internalAddress, sizeof(s_Pinholes[slot].internalAddress) - 1);
+            s_Pinholes[slot].internalAddress[sizeof(s_Pinholes[slot].internalAddress) - 1] = 0;
+            s_Pinholes[slot].proto = proto;
+            s_Pinholes[slot].port = port;
+            strncpy(s_Pinholes[slot].uniqueID, uniqueID, sizeof(s_Pinholes[slot].uniqueID) - 1);
+            s_Pinholes[slot].uniqueID[sizeof(s_Pinholes[slot].uniqueID) - 1] = 0;
+        }
+        else {
+            RtlZeroMemory(&s_Pinholes[slot], sizeof(s_Pinholes[slot]));
+        }
+    }
+
+    ReleaseSRWLockExclusive(&s_PinholeLock);
+}
+
+// We've lost all of our global addresses, so the pinholes we know about will just expire
+void ForgetPinholes()
+{
+    AcquireSRWLockExclusive(&s_PinholeLock);
+    RtlZeroMemory(s_Pinholes, sizeof(s_Pinholes));
+    ReleaseSRWLockExclusive(&s_PinholeLock);
+}
+
+typedef struct _UPNP_PINHOLE_CONTEXT {
+    const char* controlURL;
+    const char* serviceType;
+    const char* deleteReason;
+} UPNP_PINHOLE_CONTEXT, *PUPNP_PINHOLE_CONTEXT;
+
+bool UPnPPinholeOp(PMAPPING_OP op)
+{
+    PUPNP_PINHOLE_CONTEXT context = (PUPNP_PINHOLE_CONTEXT)op->context;
+    const char* protoStr = op->proto == IPPROTO_TCP ? "TCP" : "UDP";
+    OBSERVED_MAPPING observed = {};
+    char ianaProtoStr[4];
+    char portStr[6];
+    char leaseTimeStr[12];
+    char uniqueID[8];
+    int err;
+
+    // WANIPv6FirewallControl identifies the protocol by number rather than by name
+    snprintf(ianaProtoStr, sizeof(ianaProtoStr), "%d", op->proto);
+    snprintf(portStr, sizeof(portStr), "%d", op->port);
+    snprintf(leaseTimeStr, sizeof(leaseTimeStr), "%d", PORT_MAPPING_DURATION_SEC);
+
+    bool known = GetPinholeID(op->internalAddress, op->proto, op->port, uniqueID);
+
+    MappingLog("Updating UPnP IPv6 pinhole for %s %d -> %s...", protoStr, op->port, op->internalAddress);
+
+    if (!op->enable) {
+        if (!known) {
+            // We never opened one (or lost track of it), so it will expire on its own
+            MappingLog("NOT FOUND" NL);
+            return true;
+        }
+
+        err = UPNP_DeletePinhole(context->controlURL, context->serviceType, uniqueID);
+        SetPinholeID(op->internalAddress, op->proto, op->port, nullptr);
+        if (err == UPNPCOMMAND_SUCCESS || err == 704) {
+            // 704 means it already expired
+            MappingLog("DELETED" NL);
+            RemoveMappingLease("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port);
+            observed.present = err == UPNPCOMMAND_SUCCESS;
+            RecordMappingAction("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port, &observed, MappingActionDelete, context->deleteReason);
+            return true;
+        }
+
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+        return false;
+    }
+
+    if (known) {
+        err = UPNP_UpdatePinhole(context->controlURL, context->serviceType, uniqueID, leaseTimeStr);
+        if (err == UPNPCOMMAND_SUCCESS) {
+            MappingLog("OK (refreshed)" NL);
+            RecordMappingLease("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port, PORT_MAPPING_DURATION_SEC);
+            observed.present = true;
+            RecordMappingAction("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port, &observed, MappingActionRenew, "refreshed");
+            return true;
+        }
+
+        // The IGD may have rebooted and forgotten our pinhole, so open a new one
+        MappingLog("REFRESH FAILED %d (%s)...", err, strupnperror(err));
+        SetPinholeID(op->internalAddress, op->proto, op->port, nullptr);
+    }
+
+    // Any remote host and port may reach us, just like our IPv4 mappings
+    err = UPNP_AddPinhole(context->controlURL, context->serviceType, "", "0",
+        op->internalAddress, portStr, ianaProtoStr, leaseTimeStr, uniqueID);
+    if (err != UPNPCOMMAND_SUCCESS) {
+        MappingLog("ERROR %d (%s)" NL, err, strupnperror(err));
+        return false;
+    }
+
+    MappingLog("OK" NL);
+    SetPinholeID(op->internalAddress, op->proto, op->port, uniqueID);
+    RecordMappingLease("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port, PORT_MAPPING_DURATION_SEC);
+    RecordMappingAction("UPnP-IPv6", context->controlURL, op->internalAddress, op->proto, op->port, &observed, MappingActionAdd, "opened");
+    return true;
+}
+
+// Closes pinholes we opened for addresses that we don't have anymore
+void UPnPCloseStalePinholes(PUPNP_PINHOLE_CONTEXT context, char (*addresses)[INET6_ADDRSTRLEN], int addressCount)
+{
+    char staleAddresses[ARRAYSIZE(s_Pinholes)][INET6_ADDRSTRLEN];
+    MAPPING_OP ops[ARRAYSIZE(s_Pinholes)];
+    int opCount = 0;
+
+    AcquireSRWLockShared(&s_PinholeLock);
+
+    for (int i = 0; i < ARRAYSIZE(s_Pinholes); i++) {
+        bool stale = s_Pinholes[i].proto != 0;
+
+        for (int j = 0; j < addressCount && stale; j++) {
+            if (!strcmp(s_Pinholes[i].internalAddress, addresses[j])) {
+                stale = false;
+            }
+        }
+
+        if (stale) {
+            strcpy(staleAddresses[opCount], s_Pinholes[i].internalAddress);
+            InitMappingOp(&ops[opCount], UPnPPinholeOp, context, staleAddresses[opCount],
+                s_Pinholes[i].proto, s_Pinholes[i].port, false, false, false);
+            opCount++;
+        }
+    }
+
+    ReleaseSRWLockShared(&s_PinholeLock);
+
+    if (opCount != 0) {
+        printf("Closing %d UPnP IPv6 pinholes for addresses we no longer have" NL, opCount);
+        ExecuteMappingOps(ops, opCount);
+    }
+}
+
+bool UPnPUpdatePinholes(bool enable, char (*addresses)[INET6_ADDRSTRLEN], int addressCount)
+{
+    IGD_CACHE_ENTRY entry;
+    UPNP_PINHOLE_CONTEXT context;
+    UPNP_PINHOLE_CONTEXT staleContext;
+    MAPPING_OP ops[MAX_PINHOLE_ADDRESSES * ARRAYSIZE(k_Ports)];
+    int opCount = 0;
+    int firewallEnabled;
+    int inboundPinholeAllowed;
+
+    // The IPv6 firewall is managed by the same IGD that we found on the default gateway
+    if (!GetCachedIGD(nullptr, &entry) || entry.controlURL6FC[0] == 0) {
+        printf("No UPnP IPv6 firewall control service found" NL);
+        return false;
+    }
+
+    context.controlURL = entry.controlURL6FC;
+    context.serviceType = entry.serviceType6FC;
+    context.deleteReason = "disabled";
+
+    printf("Checking UPnP IPv6 firewall status...");
+    int err = UPNP_GetFirewallStatus(context.controlURL, context.serviceType, &firewallEnabled, &inboundPinholeAllowed);
+    if (err != UPNPCOMMAND_SUCCESS) {
+        printf("ERROR %d (%s)" NL, err, strupnperror(err));
+        return false;
+    }
+    else if (!firewallEnabled) {
+        // Nothing is blocking inbound traffic, so there's nothing to open
+        printf("DISABLED" NL);
+        return true;
+    }
+    else if (!inboundPinholeAllowed) {
+        printf("PINHOLES NOT ALLOWED" NL);
+        return false;
+    }
+    printf("OK" NL);
+
+    // This must finish first, since deleting a pinhole also drops the lease for its port
+    staleContext = context;
+    staleContext.deleteReason = "address removed";
+    UPnPCloseStalePinholes(&staleContext, addresses, addressCount);
+
+    for (int i = 0; i < addressCount; i++) {
+        for (int j = 0; j < ARRAYSIZE(k_Ports); j++) {
+            InitMappingOp(&ops[opCount++], UPnPPinholeOp, &context, addresses[i],
+                k_Ports[j].proto, k_Ports[j].port, enable, false, true);
+        }
+    }
+
+    bool success = ExecuteMappingOps(ops, opCount);
+    if (success) {
+        printf("UPnP IPv6 pinholes %s successfully" NL, enable ? "opened" : "closed");
+    }
+
+    return success;
+}
+
+typedef struct _PCP_IPV6_MAPPING_CONTEXT {
+    SOCKADDR_IN6 internalAddr;
+    SOCKADDR_IN6 serverAddr;
+} PCP_IPV6_MAPPING_CONTEXT, *PPCP_IPV6_MAPPING_CONTEXT;
+
+void PCPIPv6MappingBatch(PMAPPING_OP ops, int opCount, void* context)
+{
+    PPCP_IPV6_MAPPING_CONTEXT pcpContext = (PPCP_IPV6_MAPPING_CONTEXT)context;
+
+    // PCPMapPorts() writes to the addresses, so give it a private copy
+    SOCKADDR_IN6 internalAddr = pcpContext->internalAddr;
+    SOCKADDR_IN6 serverAddr = pcpContext->serverAddr;
+
+    // For IPv6, a MAP request opens a pinhole in the PCP server's firewall
+    PCPMapPorts((PSOCKADDR_STORAGE)&internalAddr, sizeof(internalAddr),
+        (PSOCKADDR_STORAGE)&serverAddr, sizeof(serverAddr),
+        ops, opCount);
+}
+
+bool PCPUpdatePinholes(bool enable, PNETWORK_SNAPSHOT snapshot, char (*addresses)[INET6_ADDRSTRLEN], int addressCount)
+{
+    PCP_IPV6_MAPPING_CONTEXT mappingContext = {};
+    MAPPING_OP ops[ARRAYSIZE(k_Ports)];
+    bool success = true;
+
+    if (IN6_IS_ADDR_UNSPECIFIED(&snapshot->ipv6Gateway)) {
+        printf("IPv6 default route has no gateway to send PCP requests to" NL);
+        return false;
+    }
+
+    // The gateway is normally a link-local address, so it needs the interface too
+    mappingContext.serverAddr.sin6_family = AF_INET6;
+    mappingContext.serverAddr.sin6_addr = snapshot->ipv6Gateway;
+    if (IN6_IS_ADDR_LINKLOCAL(&snapshot->ipv6Gateway)) {
+        mappingContext.serverAddr.sin6_scope_id = snapshot->ipv6Interface;
+    }
+
+    if (!PCPProbeServer((PSOCKADDR_STORAGE)&mappingContext.serverAddr, sizeof(mappingContext.serverAddr))) {
+        return false;
+    }
+
+    // Each batch is sent from the address it opens pinholes for
+    for (int i = 0; i < addressCount; i++) {
+        int opCount = 0;
+
+        mappingContext.internalAddr.sin6_family = AF_INET6;
+        inet_pton(AF_INET6, addresses[i], &mappingContext.internalAddr.sin6_addr);
+
+        for (int j = 0; j < ARRAYSIZE(k_Ports); j++) {
+            InitMappingOp(&ops[opCount++], nullptr, &mappingContext, addresses[i],
+                k_Ports[j].proto, k_Ports[j].port, enable, false, true);
+        }
+
+        if (!ExecuteMappingBatch(PCPIPv6MappingBatch, &mappingContext, ops, opCount)) {
+            success = false;
+        }
+    }
+
+    if (success) {
+        printf("PCP IPv6 pinholes %s successfully" NL, enable ? "opened" : "closed");
+    }
+
+    return success;
+}
+
+// Picks the addresses on the IPv6 default route interface that need pinholes. Deprecated
+// and tentative addresses aren't used for new connections, so only preferred ones count.
+// Stable addresses go first so they aren't crowded out by temporary ones.
+int GetPinholeAddresses(PNETWORK_SNAPSHOT snapshot, char (*addresses)[INET6_ADDRSTRLEN], int maxAddresses)
+{
+    PMIB_UNICASTIPADDRESS_TABLE table;
+    int addressCount = 0;
+
+    DWORD error = GetUnicastIpAddressTable(AF_INET6, &table);
+    if (error != NO_ERROR) {
+        printf("GetUnicastIpAddressTable() failed: %d" NL, error);
+        return 0;
+    }
+
+    // The first pass takes stable addresses and the second fills the rest with random ones
+    for (int pass = 0; pass < 2; pass++) {
+        for (ULONG i = 0; i < table->NumEntries && addressCount < maxAddresses; i++) {
+            PMIB_UNICASTIPADDRESS_ROW row = &table->Table[i];
+            PIN6_ADDR address = &row->Address.Ipv6.sin6_addr;
+
+            if (row->InterfaceIndex != snapshot->ipv6Interface || row->DadState != IpDadStatePreferred) {
+                continue;
+            }
+            // Link-local and unique local addresses aren't reachable from the Internet
+            else if (IN6_IS_ADDR_LINKLOCAL(address) || (address->u.Byte[0] & 0xFE) == 0xFC) {
+                continue;
+            }
+            else if ((row->SuffixOrigin == IpSuffixOriginRandom) != (pass == 1)) {
+                continue;
+            }
+
+            inet_ntop(AF_INET6, address, addresses[addressCount++], INET6_ADDRSTRLEN);
+        }
+    }
+
+    FreeMibTable(table);
+    return addressCount;
+}
+
+// Opens (or closes) IPv6 firewall pinholes for our global addresses, so dual-stack
+// clients can reach us directly without going through the IPv4 NAT chain
+void UpdateIPv6Pinholes(bool enable)
+{
+    NETWORK_SNAPSHOT snapshot;
+    char addresses[MAX_PINHOLE_ADDRESSES][INET6_ADDRSTRLEN];
+    int addressCount;
+
+    TakeNetworkSnapshot(&snapshot);
+    if (!snapshot.haveIPv6Route) {
+        printf("No IPv6 default route. Skipping IPv6 pinholes." NL);
+        ForgetPinholes();
+        return;
+    }
+
+    addressCount = GetPinholeAddresses(&snapshot, addresses, ARRAYSIZE(addresses));
+    if (addressCount == 0) {
+        printf("No global IPv6 addresses. Skipping IPv6 pinholes." NL);
+        ForgetPinholes();
+        return;
+    }
+
+    printf("Updating IPv6 pinholes for %d addresses..." NL, addressCount);
+
+    // Try both protocols when closing pinholes, since either may have opened them
+    bool success = UPnPUpdatePinholes(enable, addresses, addressCount);
+    if (!success || !enable) {
+        success = PCPUpdatePinholes(enable, &snapshot, addresses, addressCount) || success;
+    }
+
+    if (!success) {
+        printf("Unable to %s IPv6 pinholes. IPv6 clients may be blocked by the router's firewall." NL,
+            enable ? "open" : "close");
+    }
+}
+
+bool IsGameStreamEnabled()
+{
+    DWORD error;
+    DWORD enabled;
+    DWORD len;
+    HKEY key;
+
+    error = RegOpenKeyExA(HKEY_LOCAL_MACHINE, "Software\\NVIDIA Corporation\\NvStream", 0, KEY_READ | KEY_WOW64_64KEY, &key);
+    if (error != ERROR_SUCCESS) {
+        printf("RegOpenKeyEx() failed: %d\n", error);
+        return false;
+    }
+
+    len = sizeof(enabled);
+    error = RegQueryValueExA(key, "EnableStreaming", nullptr, nullptr, (LPBYTE)&enabled, &len);
+    RegCloseKey(key);
+    if (error != ERROR_SUCCESS) {
+        printf("RegQueryValueExA() failed: %d" NL, error);
+        return false;
+    }
+
+    return enabled != 0;
+}
+
+bool IsLikelyNAT(unsigned long netByteOrderAddr)
+{
+    DWORD addr = htonl(netByteOrderAddr);
+
+    // 10.0.0.0/8
+    if ((addr & 0xFF000000) == 0x0A000000) {
+        return true;
+    }
+    // 172.16.0.0/12
+    else if ((addr & 0xFFF00000) == 0xAC100000) {
+        return true;
+    }
+    // 192.168.0.0/16
+    else if ((addr & 0xFFFF0000) == 0xC0A80000) {
+        return true;
+    }
+    // 100.64.0.0/10 - RFC6598 official CGN address
+    else if ((addr & 0xFFC00000) == 0x64400000) {
+        return true;
+    }
+
+    return false;
+}
+
+// The protocols we race against each other on each gateway, in order of preference
+typedef enum _MAPPING_PROTOCOL {
+    MappingProtocolUPnP,
+    MappingProtocolNatPmp,
+    MappingProtocolPcp,
+    MappingProtocolMax
+} MAPPING_PROTOCOL;
+
+static const char* k_MappingProtocolNames[MappingProtocolMax] = { "UPnP", "NAT-PMP", "PCP" };
+
+// One level of the NAT chain between us and the Internet. Every level is mapped
+// concurrently, but a level can't create mappings until it knows its internal
+// address, which is the upstream address of the level below it.
+typedef struct _NAT_LEVEL {
+    struct _NAT_LEVEL* below;
+    int hopIndex;
+    bool enable;
+    char targetAddress[128]; // Empty for the default gateway
+
+    // Set once the level below has reported whether we're part of the chain
+    bool internalAddressChecked;
+    bool internalAddressValid;
+
+    // Valid once upstreamAddressReady is signalled
+    char upstreamAddress[128];
+    HANDLE upstreamAddressReady;
+
+    // The protocol that worked here last time, or MappingProtocolMax if we don't know
+    MAPPING_PROTOCOL preferredProtocol;
+
+    // Filled in once the level is done
+    bool inChain;
+    MAPPING_PROTOCOL mappedProtocol;
+    char controlEndpoint[256];
+} NAT_LEVEL, *PNAT_LEVEL;
+
+// Waits for the level below us to find its upstream address. Returns false
+// if that address shows there is no NAT at this level.
+bool WaitForInternalAddress(PNAT_LEVEL level)
+{
+    if (level->below == nullptr) {
+        // The default gateway maps to the local machine
+        return true;
+    }
+
+    if (!level->internalAddressChecked) {
+        WaitForSingleObject(level->below->upstreamAddressReady, INFINITE);
+
+        unsigned long upstreamAddr = inet_addr(level->below->upstreamAddress);
+        if (level->below->upstreamAddress[0] == 0 || upstreamAddr == 0) {
+            // The level below didn't get anywhere, so neither can we
+            level->internalAddressValid = false;
+        }
+        else if (IsLikelyNAT(upstreamAddr)) {
+            printf("Upstream address %s is likely a NAT" NL, level->below->upstreamAddress);
+            level->internalAddressValid = true;
+        }
+        else {
+            // If we reach a proper public IP address, we're done
+            printf("Reached the Internet at hop %d" NL, level->hopIndex);
+            level->internalAddressValid = false;
+        }
+
+        level->internalAddressChecked = true;
+    }
+
+    return level->internalAddressValid;
+}
+
+// Tells the level above us which internal address to use
+void PublishUpstreamAddress(PNAT_LEVEL level, const char* upstreamAddrNatPmp, const char* upstreamAddrUPnP)
+{
+    if (upstreamAddrNatPmp[0] != 0 && inet_addr(upstreamAddrNatPmp) != 0) {
+        printf("Using NAT-PMP upstream IPv4 address: %s" NL, upstreamAddrNatPmp);
+        strcpy(level->upstreamAddress, upstreamAddrNatPmp);
+    }
+    else if (upstreamAddrUPnP[0] != 0 && inet_addr(upstreamAddrUPnP) != 0) {
+        printf("Using UPnP upstream IPv4 address: %s" NL, upstreamAddrUPnP);
+        strcpy(level->upstreamAddress, upstreamAddrUPnP);
+    }
+    else {
+        printf("No valid upstream IPv4 address found!" NL);
+        level->upstreamAddress[0] = 0;
+    }
+
+    SetEvent(level->upstreamAddressReady);
+}
+
+typedef enum _RACER_STATE {
+    RacerWaiting,
+    RacerProbing,
+    RacerFound, // Found the gateway and waiting for our turn to map
+    RacerMapping,
+    RacerSucceeded,
+    RacerFailed,
+    RacerCancelled,
+} RACER_STATE;
+
+// All three protocols probe the gateway at once, each starting RACE_STAGGER_MS after
+// the one before it (or as soon as that one gives up). The first to find the gateway
+// gets to map ports. The others only map if it fails, and only one protocol is ever
+// mapping at a time so we don't create the same mappings twice.
+typedef struct _PROTOCOL_RACE {
+    PNAT_LEVEL level;
+    char* targetAddressIP4;
+
+    SRWLOCK lock;
+    CONDITION_VARIABLE changed;
+    RACER_STATE state[MappingProtocolMax];
+    ULONGLONG probeStartTime[MappingProtocolMax];
+    bool attempted[MappingProtocolMax];
+
+    // Reported by the UPnP and NAT-PMP probes
+    char upstreamAddrUPnP[128];
+    char upstreamAddrNatPmp[128];
+
+    // Set once the level knows whether it's part of the NAT chain
+    bool mappingDecided;
+    bool mappingAllowed;
+    char* internalAddressIP4;
+
+    // Each racer logs here so its output is printed as one block once it's done
+    MAPPING_LOG_BUFFER log[MappingProtocolMax];
+} PROTOCOL_RACE, *PPROTOCOL_RACE;
+
+static bool IsProbeDone(RACER_STATE state)
+{
+    return state != RacerWaiting && state != RacerProbing;
+}
+
+static MAPPING_PROTOCOL FindRacerInState(PPROTOCOL_RACE race, RACER_STATE state)
+{
+    for (int i = 0; i < MappingProtocolMax; i++) {
+        if (race->state[i] == state) {
+            return (MAPPING_PROTOCOL)i;
+        }
+    }
+
+    return MappingProtocolMax;
+}
+
+// Waits for our turn to start probing. Returns false if the race was decided without us.
+bool WaitForRaceStart(PPROTOCOL_RACE race, MAPPING_PROTOCOL protocol)
+{
+    bool start;
+
+    AcquireSRWLockExclusive(&race->lock);
+
+    for (;;) {
+        MAPPING_PROTOCOL preferred = race->level->preferredProtocol;
+        DWORD timeoutMs = INFINITE;
+
+        if ((race->level->enable && FindRacerInState(race, RacerSucceeded) != MappingProtocolMax) ||
+                (race->mappingDecided && !race->mappingAllowed)) {
+            race->state[protocol] = RacerCancelled;
+            start = false;
+            break;
+        }
+        else if (preferred != MappingProtocolMax && race->state[preferred] != RacerFailed) {
+            // Go straight to the protocol that worked here last time and
+            // only race the others if it doesn't work anymore
+            if (protocol == preferred) {
+                start = true;
+                break;
+            }
+        }
+        else if (protocol == 0) {
+            start = true;
+            break;
+        }
+        else {
+            RACER_STATE previous = race->state[protocol - 1];
+            if (previous == RacerFailed || previous == RacerCancelled) {
+                // No point waiting on a protocol that has already given up
+                start = true;
+                break;
+            }
+            else if (previous != RacerWaiting) {
+                ULONGLONG elapsed = GetTickCount64() - race->probeStartTime[protocol - 1];
+                if (elapsed >= RACE_STAGGER_MS) {
+                    start = true;
+                    break;
+                }
+
+                timeoutMs = (DWORD)(RACE_STAGGER_MS - elapsed);
+            }
+        }
+
+        SleepConditionVariableSRW(&race->changed, &race->lock, timeoutMs, 0);
+    }
+
+    if (start) {
+        race->state[protocol] = RacerProbing;
+        race->probeStartTime[protocol] = GetTickCount64();
+        WakeAllConditionVariable(&race->changed);
+    }
+
+    ReleaseSRWLockExclusive(&race->lock);
+
+    return start;
+}
+
+// Called once we've found the gateway. Waits until we're allowed to map ports and returns
+// false if another protocol won the race or there's nothing to map at this level.
+bool WaitForMappingTurn(PPROTOCOL_RACE race, MAPPING_PROTOCOL protocol, const char* upstreamAddress)
+{
+    bool allowed;
+
+    AcquireSRWLockExclusive(&race->lock);
+
+    if (protocol == MappingProtocolUPnP) {
+        strcpy(race->upstreamAddrUPnP, upstreamAddress);
+    }
+    else if (protocol == MappingProtocolNatPmp) {
+        strcpy(race->upstreamAddrNatPmp, upstreamAddress);
+    }
+
+    race->state[protocol] = RacerFound;
+    WakeAllConditionVariable(&race->changed);
+
+    for (;;) {
+        MAPPING_PROTOCOL winner;
+
+        if (race->mappingDecided && !race->mappingAllowed) {
+            allowed = false;
+            break;
+        }
+        else if (!race->mappingDecided || FindRacerInState(race, RacerMapping) != MappingProtocolMax) {
+            SleepConditionVariableSRW(&race->changed, &race->lock, INFINITE, 0);
+            continue;
+        }
+        else if (!race->level->enable) {
+            // Always try all possibilities when disabling to ensure we completely clean up
+            allowed = true;
+            break;
+        }
+        else if ((winner = FindRacerInState(race, RacerSucceeded)) != MappingProtocolMax) {
+            MappingLog("Not using %s because %s already mapped ports on %s" NL,
+                k_MappingProtocolNames[protocol], k_MappingProtocolNames[winner],
+                race->targetAddressIP4 ? race->targetAddressIP4 : "default gateway");
+            allowed = false;
+            break;
+        }
+        else if (protocol != MappingProtocolUPnP && race->attempted[MappingProtocolUPnP]) {
+            // Don't try with NAT-PMP if the UPnP attempt for the same gateway failed due to being
+            // disconnected or some other error. This will avoid overwriting UPnP rules on a disconnected IGD
+            // with duplicate NAT-PMP rules. If we have both UPnP and NAT-PMP on the same upstream gateway,
+            // let's assume PCP is on the same box too, so wait to hear from NAT-PMP before using PCP.
+            if (protocol == MappingProtocolPcp && !IsProbeDone(race->state[MappingProtocolNatPmp])) {
+                SleepConditionVariableSRW(&race->changed, &race->lock, INFINITE, 0);
+                continue;
+            }
+            else if (race->upstreamAddrNatPmp[0] != 0 && !strcmp(race->upstreamAddrNatPmp, race->upstreamAddrUPnP)) {
+                MappingLog("Not attempting to use %s to talk to the same UPnP gateway" NL, k_MappingProtocolNames[protocol]);
+                allowed = false;
+                break;
+            }
+        }
+
+        allowed = true;
+        break;
+    }
+
+    if (allowed) {
+        race->state[protocol] = RacerMapping;
+        race->attempted[protocol] = true;
+    }
+    else {
+        race->state[protocol] = RacerCancelled;
+    }
+    WakeAllConditionVariable(&race->changed);
+
+    ReleaseSRWLockExclusive(&race->lock);
+
+    return allowed;
+}
+
+// Remembers which protocol mapped our ports for the topology cache
+void RecordMappedProtocol(PPROTOCOL_RACE race, MAPPING_PROTOCOL protocol, const char* controlEndpoint)
+{
+    AcquireSRWLockExclusive(&race->lock);
+    race->level->mappedProtocol = protocol;
+    strncpy(race->level->controlEndpoint, controlEndpoint, sizeof(race->level->controlEndpoint) - 1);
+    race->level->controlEndpoint[sizeof(race->level->controlEndpoint) - 1] = 0;
+    ReleaseSRWLockExclusive(&race->lock);
+}
+
+// Returns true once we've heard from every protocol that can tell us our upstream address
+static bool IsUpstreamAddressKnown(PPROTOCOL_RACE race)
+{
+    MAPPING_PROTOCOL preferred = race->level->preferredProtocol;
+
+    if (race->upstreamAddrNatPmp[0] != 0) {
+        // This is the one we'd pick anyway
+        return true;
+    }
+    else if (preferred != MappingProtocolMax && IsProbeDone(race->state[preferred]) && race->state[preferred] != RacerFailed) {
+        // The protocol that worked last time found the gateway again. The
+        // others won't even start unless it fails, so don't wait on them.
+        return true;
+    }
+
+    return IsProbeDone(race->state[MappingProtocolUPnP]) && IsProbeDone(race->state[MappingProtocolNatPmp]);
+}
+
+void FinishRacer(PPROTOCOL_RACE race, MAPPING_PROTOCOL protocol, bool success)
+{
+    AcquireSRWLockExclusive(&race->lock);
+    race->state[protocol] = success ? RacerSucceeded : RacerFailed;
+    WakeAllConditionVariable(&race->changed);
+    ReleaseSRWLockExclusive(&race->lock);
+}
+
+DWORD WINAPI UPnPRacerThreadProc(LPVOID context)
+{
+    PPROTOCOL_RACE race = (PPROTOCOL_RACE)context;
+    char* targetAddressIP4 = race->targetAddressIP4;
+    struct UPNPUrls urls;
+    struct IGDdatas data;
+    char localAddress[128];
+    char upstreamAddrUPnP[128] = {};
+    int igdStatus;
+
+    SetMappingLogBuffer(&race->log[MappingProtocolUPnP]);
+
+    if (!WaitForRaceStart(race, MappingProtocolUPnP)) {
+        return 0;
+    }
+
+    // Skip discovery entirely if the IGD we found last time is still there
+    igdStatus = UPnPGetCachedIGD(targetAddressIP4, &urls, &data, localAddress, sizeof(localAddress), upstreamAddrUPnP);
+    if (igdStatus == 0) {
+        int upnpErr;
+        struct UPNPDev* ipv4Devs;
+
+        if (targetAddressIP4 == nullptr) {
+            // If we have no target, use discovery to find the first hop
+            ipv4Devs = upnpDiscoverAll(UPNP_DISCOVERY_DELAY_MS, nullptr, nullptr, UPNP_LOCAL_PORT_ANY, 0, 2, &upnpErr);
+            MappingLog("UPnP IPv4 IGD discovery completed with error code: %d" NL, upnpErr);
+        }
+        else {
+            // We have a specified target, so do discovery against that directly (may be outside our subnet in case of double-NAT)
+            struct in_addr addr;
+            addr.S_un.S_addr = inet_addr(targetAddressIP4);
+            ipv4Devs = getUPnPDevicesByAddress(addr);
+        }
+
+        igdStatus = UPnPSelectIGD(ipv4Devs, targetAddressIP4, &urls, &data, localAddress, sizeof(localAddress), upstreamAddrUPnP);
+        freeUPNPDevlist(ipv4Devs);
+    }
+
+    if (igdStatus == 0) {
+        FinishRacer(race, MappingProtocolUPnP, false);
+        return 0;
+    }
+
+    if (WaitForMappingTurn(race, MappingProtocolUPnP, upstreamAddrUPnP)) {
+        bool success = UPnPMapPorts(&urls, &data, localAddress, igdStatus == 1, race->level->enable, race->internalAddressIP4);
+        if (success) {
+            MappingLog("UPnP IPv4 port mapping successful" NL);
+            RecordMappedProtocol(race, MappingProtocolUPnP, urls.controlURL);
+        }
+
+        FinishRacer(race, MappingProtocolUPnP, success);
+    }
+
+    FreeUPNPUrls(&urls);
+    fflush(stdout);
+    return 0;
+}
+
+DWORD WINAPI NATPMPRacerThreadProc(LPVOID context)
+{
+    PPROTOCOL_RACE race = (PPROTOCOL_RACE)context;
+    char* targetAddressIP4 = race->targetAddressIP4;
+    bool enable = race->level->enable;
+    natpmp_t natpmp;
+    natpmpresp_t response;
+    char upstreamAddrNatPmp[128] = {};
+    ULONGLONG deadline;
+    in_addr_t gateway;
+
+    SetMappingLogBuffer(&race->log[MappingProtocolNatPmp]);
+
+    if (!WaitForRaceStart(race, MappingProtocolNatPmp)) {
+        return 0;
+    }
+
+    int natPmpErr = initnatpmp(&natpmp, targetAddressIP4 ? 1 : 0, targetAddressIP4 ? inet_addr(targetAddressIP4) : 0);
+    if (natPmpErr != 0) {
+        MappingLog("initnatpmp() failed: %d" NL, natPmpErr);
+        FinishRacer(race, MappingProtocolNatPmp, false);
+        return 0;
+    }
+
+    natPmpErr = sendpublicaddressrequest(&natpmp);
+    if (natPmpErr < 0) {
+        MappingLog("sendpublicaddressrequest() failed: %d" NL, natPmpErr);
+        closenatpmp(&natpmp);
+        FinishRacer(race, MappingProtocolNatPmp, false);
+        return 0;
+    }
+
+    // libnatpmp would keep retransmitting for over 2 minutes, so cut it off early
+    deadline = GetTickCount64() + NATPMP_PROBE_TIMEOUT_MS;
+    do {
+        fd_set fds;
+        struct timeval timeout;
+
+        FD_ZERO(&fds);
+        FD_SET(natpmp.s, &fds);
+        getnatpmprequesttimeout(&natpmp, &timeout);
+        select(0, &fds, nullptr, nullptr, &timeout);
+
+        natPmpErr = readnatpmpresponseorretry(&natpmp, &response);
+    } while (natPmpErr == NATPMP_TRYAGAIN && GetTickCount64() < deadline);
+
+    // libnatpmp already found the default gateway for us
+    gateway = natpmp.gateway;
+    closenatpmp(&natpmp);
+
+    if (natPmpErr != 0) {
+        MappingLog("NAT-PMP public address request failed: %d" NL, natPmpErr);
+        FinishRacer(race, MappingProtocolNatPmp, false);
+        return 0;
+    }
+
+    inet_ntop(AF_INET, &response.pnu.publicaddress.addr, upstreamAddrNatPmp, sizeof(upstreamAddrNatPmp));
+    MappingLog("NAT-PMP upstream address is: %s" NL, upstreamAddrNatPmp);
+
+    if (!WaitForMappingTurn(race, MappingProtocolNatPmp, upstreamAddrNatPmp)) {
+        return 0;
+    }
+
+    // NAT-PMP has no description field or other token that we can use to determine
+    // if we created the rules we'd be deleting. Since we don't have that, we can't
+    // safely remove mappings that could be shared by another machine behind a double NAT.
+    if (!enable && targetAddressIP4 != nullptr) {
+        MappingLog("Not removing upstream NAT-PMP mappings on non-default gateway device" NL);
+        FinishRacer(race, MappingProtocolNatPmp, false);
+        return 0;
+    }
+
+    NATPMP_MAPPING_CONTEXT mappingContext;
+    MAPPING_OP ops[ARRAYSIZE(k_Ports) + 1 + ARRAYSIZE(k_WolPorts)];
+    int opCount = 0;
+
+    mappingContext.gateway = targetAddressIP4 ? inet_addr(targetAddressIP4) : gateway;
+
+    for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
+        InitMappingOp(&ops[opCount++], nullptr, &mappingContext, nullptr,
+            k_Ports[i].proto, k_Ports[i].port, enable, false, true);
+    }
+
+    // Best effort, don't care if we fail for the STUN beacon
+    InitMappingOp(&ops[opCount++], nullptr, &mappingContext, nullptr,
+        IPPROTO_UDP, STUN_BEACON_PORT, enable, false, false);
+
+    // We can only map ports for the non-default gateway case because
+    // it will use our LAN address as the internal client address, which
+    // doesn't work (needs to be broadcast) for the last hop.
+    if (targetAddressIP4 != nullptr) {
+        // Best effort, don't care if we fail for WOL
+        for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
+            // Indefinite mapping since we may not be awake to refresh it
+            InitMappingOp(&ops[opCount++], nullptr, &mappingContext, nullptr,
+                IPPROTO_UDP, k_WolPorts[i], enable, true, false);
+        }
+    }
+
+    bool success = ExecuteMappingBatch(NATPMPMappingBatch, &mappingContext, ops, opCount);
+    if (success) {
+        char gatewayStr[INET_ADDRSTRLEN];
+
+        MappingLog("NAT-PMP IPv4 port mapping successful" NL);
+        inet_ntop(AF_INET, &mappingContext.gateway, gatewayStr, sizeof(gatewayStr));
+        RecordMappedProtocol(race, MappingProtocolNatPmp, gatewayStr);
+    }
+
+    FinishRacer(race, MappingProtocolNatPmp, success);
+    fflush(stdout);
+    return 0;
+}
+
+DWORD WINAPI PCPRacerThreadProc(LPVOID context)
+{
+    PPROTOCOL_RACE race = (PPROTOCOL_RACE)context;
+    char* targetAddressIP4 = race->targetAddressIP4;
+    bool enable = race->level->enable;
+    PCP_MAPPING_CONTEXT mappingContext = {};
+    MAPPING_OP ops[ARRAYSIZE(k_Ports) + 1 + ARRAYSIZE(k_WolPorts)];
+    int opCount = 0;
+    const char* internalAddress = nullptr;
+
+    SetMappingLogBuffer(&race->log[MappingProtocolPcp]);
+
+    if (!WaitForRaceStart(race, MappingProtocolPcp)) {
+        return 0;
+    }
+
+    mappingContext.targetAddr.sin_family = AF_INET;
+    mappingContext.internalAddr.sin_family = AF_INET;
+
+    if (targetAddressIP4 != nullptr) {
+        mappingContext.targetAddr.sin_addr.S_un.S_addr = inet_addr(targetAddressIP4);
+    }
+    else {
+        MIB_IPFORWARDROW route;
+        DWORD error = GetBestRoute(0, 0, &route);
+        if (error == NO_ERROR) {
+            mappingContext.targetAddr.sin_addr.S_un.S_addr = route.dwForwardNextHop;
+        }
+        else {
+            MappingLog("GetBestRoute() failed: %d" NL, error);
+            FinishRacer(race, MappingProtocolPcp, false);
+            return 0;
+        }
+    }
+
+    if (!PCPProbeServer((PSOCKADDR_STORAGE)&mappingContext.targetAddr, sizeof(mappingContext.targetAddr))) {
+        FinishRacer(race, MappingProtocolPcp, false);
+        return 0;
+    }
+
+    if (!WaitForMappingTurn(race, MappingProtocolPcp, nullptr)) {
+        return 0;
+    }
+
+    // The internal address is kept with each lease so it can be renewed on its own
+    if (targetAddressIP4 != nullptr && race->internalAddressIP4 != nullptr) {
+        mappingContext.internalAddr.sin_addr.S_un.S_addr = inet_addr(race->internalAddressIP4);
+        internalAddress = race->internalAddressIP4;
+    }
+
+    for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
+        InitMappingOp(&ops[opCount++], nullptr, &mappingContext, internalAddress,
+            k_Ports[i].proto, k_Ports[i].port, enable, false, true);
+    }
+
+    // Best effort, don't care if we fail for the STUN beacon
+    InitMappingOp(&ops[opCount++], nullptr, &mappingContext, internalAddress,
+        IPPROTO_UDP, STUN_BEACON_PORT, enable, false, false);
+
+    // We can only map ports for the non-default gateway case because
+    // it will use our internal address as the internal client address, which
+    // doesn't work (needs to be broadcast) for the last hop.
+    if (race->internalAddressIP4 != nullptr) {
+        // Best effort, don't care if we fail for WOL
+        for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
+            // Indefinite mapping since we may not be awake to refresh it
+            InitMappingOp(&ops[opCount++], nullptr, &mappingContext, internalAddress,
+                IPPROTO_UDP, k_WolPorts[i], enable, true, false);
         }
     }
 
-    // Validate the rules are present and correct if they claimed to be added successfully
-    if (success && enable) {
-        // Wait 10 seconds for the router state to quiesce
-        printf("Waiting before UPnP port validation...");
-        Sleep(10000);
-        printf("done" NL);
+    bool success = ExecuteMappingBatch(PCPMappingBatch, &mappingContext, ops, opCount);
+    if (success) {
+        char serverStr[INET_ADDRSTRLEN];
 
-        // Perform the validation pass (converting any now missing entries to permanent ones)
-        for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
-            if (!UPnPMapPort(&urls, &data, k_Ports[i].proto, portMappingInternalAddress, k_Ports[i].port, enable, false, true)) {
-                success = false;
-            }
-        }
+        MappingLog("PCP IPv4 port mapping successful" NL);
+        inet_ntop(AF_INET, &mappingContext.targetAddr.sin_addr, serverStr, sizeof(serverStr));
+        RecordMappedProtocol(race, MappingProtocolPcp, serverStr);
     }
 
-    FreeUPNPUrls(&urls);
-    return success;
+    FinishRacer(race, MappingProtocolPcp, success);
+    fflush(stdout);
+    return 0;
 }
 
-bool NATPMPMapPort(natpmp_t* natpmp, int proto, int port, bool enable, bool indefinite)
+void UpdatePortMappingsForLevel(PNAT_LEVEL level)
 {
-    int natPmpProto;
-
-    switch (proto)
-    {
-    case IPPROTO_TCP:
-        natPmpProto = NATPMP_PROTOCOL_TCP;
-        break;
-    case IPPROTO_UDP:
-        natPmpProto = NATPMP_PROTOCOL_UDP;
-        break;
-    default:
-        assert(false);
-        return false;
+    static const LPTHREAD_START_ROUTINE k_RacerThreadProcs[MappingProtocolMax] = {
+        UPnPRacerThreadProc, NATPMPRacerThreadProc, PCPRacerThreadProc
+    };
+    PROTOCOL_RACE race = {};
+    HANDLE threads[MappingProtocolMax];
+    char upstreamAddrNatPmp[128];
+    char upstreamAddrUPnP[128];
+    bool mappingAllowed;
+
+    race.level = level;
+    race.targetAddressIP4 = level->targetAddress[0] != 0 ? level->targetAddress : nullptr;
+    InitializeSRWLock(&race.lock);
+    InitializeConditionVariable(&race.changed);
+
+    // Discovery can start before the level below confirms we're part of the chain, but
+    // only for hops with private addresses. Anything else waits so we don't go probing
+    // routers out on the Internet.
+    if (race.targetAddressIP4 != nullptr && !IsLikelyNAT(inet_addr(race.targetAddressIP4))) {
+        if (!WaitForInternalAddress(level)) {
+            return;
+        }
     }
 
-    int lifetime;
+    printf("Starting port mapping update on %s..." NL,
+        race.targetAddressIP4 ? race.targetAddressIP4 : "default gateway");
 
-    if (!enable) {
-        lifetime = 0;
+    for (int i = 0; i < MappingProtocolMax; i++) {
+        threads[i] = CreateThread(nullptr, 0, k_RacerThreadProcs[i], &race, 0, nullptr);
+        if (threads[i] == nullptr) {
+            printf("CreateThread() failed: %d" NL, GetLastError());
+            FinishRacer(&race, (MAPPING_PROTOCOL)i, false);
+        }
     }
-    else if (indefinite) {
-        lifetime = 604800; // 1 week
+
+    // The upstream address for the level above us comes from NAT-PMP if we have it, otherwise UPnP
+    AcquireSRWLockExclusive(&race.lock);
+    while (!IsUpstreamAddressKnown(&race)) {
+        SleepConditionVariableSRW(&race.changed, &race.lock, INFINITE, 0);
     }
-    else {
-        lifetime = PORT_MAPPING_DURATION_SEC;
+    strcpy(upstreamAddrNatPmp, race.upstreamAddrNatPmp);
+    strcpy(upstreamAddrUPnP, race.upstreamAddrUPnP);
+    ReleaseSRWLockExclusive(&race.lock);
+
+    // We can't create any mappings until we know which address to point them at
+    mappingAllowed = WaitForInternalAddress(level);
+    level->inChain = mappingAllowed;
+    if (mappingAllowed) {
+        // Now the level above us can start creating its mappings too
+        PublishUpstreamAddress(level, upstreamAddrNatPmp, upstreamAddrUPnP);
+
+        printf("Mapping ports on %s to %s..." NL,
+            race.targetAddressIP4 ? race.targetAddressIP4 : "default gateway",
+            level->below != nullptr ? level->below->upstreamAddress : "local machine");
     }
 
-    printf("Updating NAT-PMP port mapping for %s %d...", proto == IPPROTO_TCP ? "TCP" : "UDP", port);
-    int err = sendnewportmappingrequest(natpmp, natPmpProto, port, enable ? port : 0, lifetime);
-    if (err < 0) {
-        printf("ERROR %d" NL, err);
-        return false;
+    AcquireSRWLockExclusive(&race.lock);
+    race.mappingDecided = true;
+    race.mappingAllowed = mappingAllowed;
+    race.internalAddressIP4 = level->below != nullptr ? level->below->upstreamAddress : nullptr;
+    WakeAllConditionVariable(&race.changed);
+    ReleaseSRWLockExclusive(&race.lock);
+
+    for (int i = 0; i < MappingProtocolMax; i++) {
+        if (threads[i] != nullptr) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+
+        FlushMappingLogBuffer(&race.log[i]);
     }
+}
 
-    natpmpresp_t response;
-    do
-    {
-        fd_set fds;
-        struct timeval timeout;
+DWORD WINAPI NatLevelThreadProc(LPVOID context)
+{
+    PNAT_LEVEL level = (PNAT_LEVEL)context;
 
-        FD_ZERO(&fds);
-        FD_SET(natpmp->s, &fds);
+    UpdatePortMappingsForLevel(level);
 
-        err = getnatpmprequesttimeout(natpmp, &timeout);
-        if (err != 0) {
-            assert(err == 0);
-            printf("WAIT FAILED: %d" NL, err);
-            return false;
-        }
+    // Unblock the level above us if we bailed out before publishing an address
+    SetEvent(level->upstreamAddressReady);
+    return 0;
+}
 
-        select(0, &fds, nullptr, nullptr, &timeout);
+MAPPING_PROTOCOL ParseMappingProtocol(const char* name)
+{
+    for (int i = 0; i < MappingProtocolMax; i++) {
+        if (!strcmp(k_MappingProtocolNames[i], name)) {
+            return (MAPPING_PROTOCOL)i;
+        }
+    }
 
-        err = readnatpmpresponseorretry(natpmp, &response);
-    } while (err == NATPMP_TRYAGAIN);
+    return MappingProtocolMax;
+}
 
-    if (err != 0) {
-        printf("FAILED %d" NL, err);
-        return false;
-    }
-    else if (response.pnu.newportmapping.lifetime == 0 && !enable) {
-        printf("DELETED" NL);
-        return true;
+// Maps ports on every level of the topology and updates it with what we found. For a
+// cached topology, each level starts with the protocol that worked there last time.
+// Returns true if every level of the chain mapped our ports and, for a cached
+// topology, the chain still looks the way we remembered it.
+bool UpdatePortMappingsForTopology(bool enable, PNAT_TOPOLOGY topology, bool cached)
+{
+    NAT_LEVEL levels[TOPOLOGY_MAX_LEVELS];
+    HANDLE threads[TOPOLOGY_MAX_LEVELS];
+    int levelCount = topology->levelCount;
+    int chainLength;
+    bool complete = true;
+
+    for (int i = 0; i < levelCount; i++) {
+        levels[i] = {};
+        levels[i].below = i > 0 ? &levels[i - 1] : nullptr;
+        levels[i].hopIndex = i - 1;
+        levels[i].enable = enable;
+        levels[i].upstreamAddressReady = CreateEvent(nullptr, true, false, nullptr);
+        levels[i].preferredProtocol = cached ? ParseMappingProtocol(topology->levels[i].protocol) : MappingProtocolMax;
+        levels[i].mappedProtocol = MappingProtocolMax;
+        strcpy(levels[i].targetAddress, topology->levels[i].targetAddress);
     }
-    else if (response.pnu.newportmapping.mappedpublicport != port) {
-        printf("CONFLICT" NL);
 
-        // It couldn't assign us the external port we requested and gave us an alternate external port.
-        // We can't use this alternate mapping, so immediately release it.
-        printf("Deleting unwanted NAT-PMP mapping for %s %d...", proto == IPPROTO_TCP ? "TCP" : "UDP", response.pnu.newportmapping.mappedpublicport);
-        err = sendnewportmappingrequest(natpmp, natPmpProto, response.pnu.newportmapping.privateport, 0, 0);
-        if (err < 0) {
-            printf("ERROR %d" NL, err);
-            return false;
+    // Work on every level at once, so a long chain takes about as long as its slowest hop
+    for (int i = 0; i < levelCount; i++) {
+        threads[i] = CreateThread(nullptr, 0, NatLevelThreadProc, &levels[i], 0, nullptr);
+        if (threads[i] == nullptr) {
+            // The levels below us are already running, so it's safe to do this one here
+            NatLevelThreadProc(&levels[i]);
         }
-        else {
-            do {
-                fd_set fds;
-                struct timeval timeout;
-
-                FD_ZERO(&fds);
-                FD_SET(natpmp->s, &fds);
-
-                err = getnatpmprequesttimeout(natpmp, &timeout);
-                if (err != 0) {
-                    assert(err == 0);
-                    printf("WAIT FAILED: %d" NL, err);
-                    return false;
-                }
-
-                select(0, &fds, nullptr, nullptr, &timeout);
-
-                err = readnatpmpresponseorretry(natpmp, &response);
-            } while (err == NATPMP_TRYAGAIN);
+    }
 
-            if (err == 0) {
-                printf("OK" NL);
-                return false;
-            }
-            else {
-                printf("FAILED %d" NL, err);
-                return false;
-            }
+    for (int i = 0; i < levelCount; i++) {
+        if (threads[i] != nullptr) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        if (levels[i].upstreamAddressReady != nullptr) {
+            CloseHandle(levels[i].upstreamAddressReady);
         }
     }
-    else {
-        printf("OK (%d seconds remaining)" NL, response.pnu.newportmapping.lifetime);
-        return true;
+
+    // The last level found yet another NAT above it, but we don't know where it is
+    PNAT_LEVEL topLevel = &levels[levelCount - 1];
+    if (topLevel->upstreamAddress[0] != 0 && IsLikelyNAT(inet_addr(topLevel->upstreamAddress))) {
+        printf("Upstream address %s is likely a NAT" NL, topLevel->upstreamAddress);
+        printf("Traceroute didn't reach this hop! Aborting!" NL);
+        complete = false;
     }
-}
 
-bool IsGameStreamEnabled()
-{
-    DWORD error;
-    DWORD enabled;
-    DWORD len;
-    HKEY key;
+    for (chainLength = 0; chainLength < levelCount && levels[chainLength].inChain; chainLength++) {
+        PNAT_LEVEL level = &levels[chainLength];
+        PTOPOLOGY_LEVEL topologyLevel = &topology->levels[chainLength];
 
-    error = RegOpenKeyExA(HKEY_LOCAL_MACHINE, "Software\\NVIDIA Corporation\\NvStream", 0, KEY_READ | KEY_WOW64_64KEY, &key);
-    if (error != ERROR_SUCCESS) {
-        printf("RegOpenKeyEx() failed: %d\n", error);
-        return false;
+        if (level->mappedProtocol == MappingProtocolMax) {
+            complete = false;
+        }
+        // The upstream address of the top level is our public address, which can change
+        // without the chain changing. The others lead to the next level of the chain.
+        else if (cached && (level->mappedProtocol != level->preferredProtocol ||
+                            (chainLength < levelCount - 1 && strcmp(level->upstreamAddress, topologyLevel->upstreamAddress)))) {
+            printf("NAT level %d changed since it was cached" NL, chainLength);
+            complete = false;
+        }
+
+        strcpy(topologyLevel->upstreamAddress, level->upstreamAddress);
+        strcpy(topologyLevel->protocol, level->mappedProtocol != MappingProtocolMax ? k_MappingProtocolNames[level->mappedProtocol] : "");
+        strcpy(topologyLevel->controlEndpoint, level->controlEndpoint);
     }
 
-    len = sizeof(enabled);
-    error = RegQueryValueExA(key, "EnableStreaming", nullptr, nullptr, (LPBYTE)&enabled, &len);
-    RegCloseKey(key);
-    if (error != ERROR_SUCCESS) {
-        printf("RegQueryValueExA() failed: %d" NL, error);
-        return false;
+    if (chainLength == 0 || (cached && chainLength != levelCount)) {
+        complete = false;
     }
 
-    return enabled != 0;
+    topology->levelCount = chainLength;
+    return complete;
 }
 
-void UpdatePortMappingsForTarget(bool enable, char* targetAddressIP4, char* internalAddressIP4, char* upstreamAddressIP4)
+// Returns false if any level of the NAT chain was left without our port mappings
+bool UpdatePortMappings(bool enable)
 {
-    natpmp_t natpmp;
-    bool tryNatPmp = true;
-    bool tryPcp = true;
-    char upstreamAddrNatPmp[128] = {};
-    char upstreamAddrUPnP[128] = {};
+    IN_ADDR hops[4];
+    int hopCount = ARRAYSIZE(hops);
+    NAT_TOPOLOGY key;
+    NAT_TOPOLOGY topology;
+    bool haveKey;
+    bool complete;
+
+    haveKey = GetTopologyKey(&key);
+
+    // Skip the traceroute and protocol discovery if we already know what the chain looks like.
+    // We always do full discovery when removing mappings to make sure we find all of them.
+    if (enable && haveKey && GetCachedTopology(&key, &topology)) {
+        printf("Using cached NAT topology with %d levels" NL, topology.levelCount);
+        if (UpdatePortMappingsForTopology(enable, &topology, true)) {
+            UpdateIPv6Pinholes(enable);
+            PrintMappingActionSummary();
+            fflush(stdout);
+            return true;
+        }
 
-    printf("Starting port mapping update on %s to %s..." NL,
-        targetAddressIP4 ? targetAddressIP4 : "default gateway",
-        internalAddressIP4 ? internalAddressIP4 : "local machine");
+        printf("Cached NAT topology is out of date. Rediscovering..." NL);
+        RemoveCachedTopology();
+    }
 
-    int natPmpErr = initnatpmp(&natpmp, targetAddressIP4 ? 1 : 0, targetAddressIP4 ? inet_addr(targetAddressIP4) : 0);
-    if (natPmpErr != 0) {
-        printf("initnatpmp() failed: %d" NL, natPmpErr);
+    printf("Finding upstream IPv4 hops via traceroute..." NL);
+    if (!getHopsIP4(hops, &hopCount)) {
+        hopCount = 0;
     }
     else {
-        natPmpErr = sendpublicaddressrequest(&natpmp);
-        if (natPmpErr < 0) {
-            printf("sendpublicaddressrequest() failed: %d" NL, natPmpErr);
-            closenatpmp(&natpmp);
+        printf("Found %d hops" NL, hopCount);
+    }
+
+    // The first level is the default gateway. getHopsIP4() already skips the default
+    // gateway, so hops[0] is actually the first hop after the default gateway.
+    topology = key;
+    topology.levelCount = hopCount + 1;
+    for (int i = 0; i < topology.levelCount; i++) {
+        // The target IP address to which to send the UPnP/NAT-PMP is the next hop of the traceroute.
+        // The internal IP address for the new mapping will be the upstream address of the last one.
+        if (i > 0) {
+            inet_ntop(AF_INET, &hops[i - 1], topology.levels[i].targetAddress, sizeof(topology.levels[i].targetAddress));
         }
     }
 
+    complete = UpdatePortMappingsForTopology(enable, &topology, false);
+    if (complete && enable && haveKey) {
+        printf("Caching NAT topology with %d levels" NL, topology.levelCount);
+        SetCachedTopology(&topology);
+    }
+
+    // IPv6 has no NAT chain, just the firewall on the default gateway
+    UpdateIPv6Pinholes(enable);
+
+    PrintMappingActionSummary();
+
     fflush(stdout);
+    return complete;
+}
 
-    {
-        int upnpErr;
-        struct UPNPDev* ipv4Devs;
-        
-        if (targetAddressIP4 == nullptr) {
-            // If we have no target, use discovery to find the first hop
-            ipv4Devs = upnpDiscoverAll(UPNP_DISCOVERY_DELAY_MS, nullptr, nullptr, UPNP_LOCAL_PORT_ANY, 0, 2, &upnpErr);
-            printf("UPnP IPv4 IGD discovery completed with error code: %d" NL, upnpErr);
-        }
-        else {
-            // We have a specified target, so do discovery against that directly (may be outside our subnet in case of double-NAT)
-            struct in_addr addr;
-            addr.S_un.S_addr = inet_addr(targetAddressIP4);
-            ipv4Devs = getUPnPDevicesByAddress(addr);
+// Renews a set of due leases that were all granted by the same gateway
+bool RenewLeaseGroup(PMAPPING_LEASE lease, PMAPPING_OP ops, int opCount)
+{
+    if (!strcmp(lease->method, "UPnP") || !strcmp(lease->method, "UPnP-IPv6")) {
+        IGD_CACHE_ENTRY entry;
+
+        if (!GetCachedIGDByControlURL(lease->gateway, &entry)) {
+            printf("UPnP IGD at %s is no longer cached" NL, lease->gateway);
+            return false;
         }
 
-        // Use the delay of discovery to also allow the NAT-PMP endpoint time to respond
-        if (natPmpErr >= 0) {
-            natpmpresp_t response;
-            natPmpErr = readnatpmpresponseorretry(&natpmp, &response);
-            if (natPmpErr == 0) {
-                inet_ntop(AF_INET, &response.pnu.publicaddress.addr, upstreamAddrNatPmp, sizeof(upstreamAddrNatPmp));
-                printf("NAT-PMP upstream address is: %s" NL, upstreamAddrNatPmp);
-            }
-            else {
-                printf("NAT-PMP public address request failed: %d" NL, natPmpErr);
-                closenatpmp(&natpmp);
+        if (!strcmp(lease->method, "UPnP")) {
+            struct UPNPUrls urls = {};
+            struct IGDdatas data = {};
+            UPNP_MAPPING_CONTEXT context = { &urls, &data, false };
+
+            urls.controlURL = entry.controlURL;
+            strncpy(data.first.servicetype, entry.serviceType, sizeof(data.first.servicetype) - 1);
+
+            // UPnPMapPort() reads the entry back first, so this is all a permanent mapping needs
+            // to be checked and it only touches leased ones once they're within the threshold.
+            for (int i = 0; i < opCount; i++) {
+                ops[i].mapPort = UPnPMappingOp;
+                ops[i].context = &context;
             }
+
+            return ExecuteMappingOps(ops, opCount);
         }
+        else {
+            UPNP_PINHOLE_CONTEXT context = { entry.controlURL6FC, entry.serviceType6FC, "disabled" };
 
-        // Don't try NAT-PMP if UPnP succeeds
-        if (UPnPHandleDeviceList(ipv4Devs, enable, internalAddressIP4, upstreamAddrUPnP)) {
-            printf("UPnP IPv4 port mapping successful" NL);
-            if (enable) {
-                // We still want to try NAT-PMP if we're removing
-                // rules to ensure any NAT-PMP rules get cleaned up
-                tryNatPmp = false;
-                tryPcp = false;
+            for (int i = 0; i < opCount; i++) {
+                ops[i].mapPort = UPnPPinholeOp;
+                ops[i].context = &context;
             }
-        }
 
-        freeUPNPDevlist(ipv4Devs);
+            return ExecuteMappingOps(ops, opCount);
+        }
     }
+    else if (!strcmp(lease->method, "NAT-PMP")) {
+        NATPMP_MAPPING_CONTEXT context;
 
-    fflush(stdout);
-
-    if (natPmpErr == 0) {
-        // NAT-PMP has no description field or other token that we can use to determine
-        // if we created the rules we'd be deleting. Since we don't have that, we can't
-        // safely remove mappings that could be shared by another machine behind a double NAT.
-        if (!enable && targetAddressIP4 != nullptr) {
-            printf("Not removing upstream NAT-PMP mappings on non-default gateway device" NL);
-            tryNatPmp = false;
+        context.gateway = inet_addr(lease->gateway);
+        for (int i = 0; i < opCount; i++) {
+            ops[i].context = &context;
         }
 
-        // Don't try with NAT-PMP if the UPnP attempt for the same gateway failed due to being
-        // disconnected or some other error. This will avoid overwriting UPnP rules on a disconnected IGD
-        // with duplicate NAT-PMP rules. We want to allow deletion of NAT-PMP rules in any case though.
-        if (enable && !strcmp(upstreamAddrNatPmp, upstreamAddrUPnP)) {
-            printf("Not attempting to use NAT-PMP/PCP to talk to the same UPnP gateway\n");
-            tryNatPmp = false;
+        return ExecuteMappingBatch(NATPMPMappingBatch, &context, ops, opCount);
+    }
+    else if (!strcmp(lease->method, "PCP")) {
+        IN_ADDR serverAddr4;
 
-            // We have both UPnP and NAT-PMP on the same upstream gateway, so let's
-            // assume PCP is on the same box too.
-            tryPcp = false;
-        }
+        if (inet_pton(AF_INET, lease->gateway, &serverAddr4) == 1) {
+            PCP_MAPPING_CONTEXT context = {};
 
-        if (tryNatPmp) {
-            bool success = true;
-            for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
-                if (!NATPMPMapPort(&natpmp, k_Ports[i].proto, k_Ports[i].port, enable, false)) {
-                    success = false;
-                }
+            context.targetAddr.sin_family = AF_INET;
+            context.targetAddr.sin_addr = serverAddr4;
+            context.internalAddr.sin_family = AF_INET;
+            if (lease->internalAddress[0] != 0) {
+                inet_pton(AF_INET, lease->internalAddress, &context.internalAddr.sin_addr);
             }
 
-            // We can only map ports for the non-default gateway case because
-            // it will use our LAN address as the internal client address, which
-            // doesn't work (needs to be broadcast) for the last hop.
-            if (targetAddressIP4 != nullptr) {
-                // Best effort, don't care if we fail for WOL
-                for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
-                    // Indefinite mapping since we may not be awake to refresh it
-                    NATPMPMapPort(&natpmp, IPPROTO_UDP, k_WolPorts[i], enable, true);
-                }
+            for (int i = 0; i < opCount; i++) {
+                ops[i].context = &context;
             }
 
-            if (success) {
-                printf("NAT-PMP IPv4 port mapping successful" NL);
+            return ExecuteMappingBatch(PCPMappingBatch, &context, ops, opCount);
+        }
+        else {
+            PCP_IPV6_MAPPING_CONTEXT context = {};
 
-                // Always try all possibilities when disabling to ensure
-                // we completely clean up
-                if (enable) {
-                    tryPcp = false;
-                }
+            context.serverAddr.sin6_family = AF_INET6;
+            inet_pton(AF_INET6, lease->gateway, &context.serverAddr.sin6_addr);
+            if (IN6_IS_ADDR_LINKLOCAL(&context.serverAddr.sin6_addr)) {
+                NETWORK_SNAPSHOT snapshot;
+
+                // Same as PCPUpdatePinholes(), the gateway needs the interface too
+                TakeNetworkSnapshot(&snapshot);
+                context.serverAddr.sin6_scope_id = snapshot.ipv6Interface;
+            }
+            context.internalAddr.sin6_family = AF_INET6;
+            inet_pton(AF_INET6, lease->internalAddress, &context.internalAddr.sin6_addr);
+
+            for (int i = 0; i < opCount; i++) {
+                ops[i].context = &context;
             }
+
+            return ExecuteMappingBatch(PCPIPv6MappingBatch, &context, ops, opCount);
         }
+    }
 
-        closenatpmp(&natpmp);
+    printf("Unknown lease type: %s" NL, lease->method);
+    return false;
+}
+
+// Renews only the leases that have come due (and checks that permanent mappings are
+// still there) without walking the NAT chain again. Returns false if nothing was due
+// or something couldn't be renewed, in which case the caller does a full update.
+bool RenewDueLeases()
+{
+    MAPPING_LEASE leases[64];
+    bool taken[ARRAYSIZE(leases)] = {};
+    MAPPING_OP ops[ARRAYSIZE(leases)];
+    bool success = true;
+
+    int leaseCount = TakeDueLeases(leases, ARRAYSIZE(leases));
+    if (leaseCount == 0) {
+        printf("No leases are due for renewal" NL);
+        return false;
     }
 
-    // Try PCP for IPv4 if UPnP and NAT-PMP have both failed. This may be the case for CGN that only supports PCP.
-    if (tryPcp) {
-        SOCKADDR_IN targetAddr = {};
-        SOCKADDR_IN internalAddr = {};
+    printf("Renewing %d due leases..." NL, leaseCount);
 
-        targetAddr.sin_family = AF_INET;
-        internalAddr.sin_family = AF_INET;
+    for (int i = 0; i < leaseCount; i++) {
+        int opCount = 0;
 
-        if (targetAddressIP4 != nullptr && internalAddressIP4 != nullptr) {
-            targetAddr.sin_addr.S_un.S_addr = inet_addr(targetAddressIP4);
-            internalAddr.sin_addr.S_un.S_addr = inet_addr(internalAddressIP4);
-        }
-        else {
-            MIB_IPFORWARDROW route;
-            DWORD error = GetBestRoute(0, 0, &route);
-            if (error == NO_ERROR) {
-                targetAddr.sin_addr.S_un.S_addr = route.dwForwardNextHop;
-            }
-            else {
-                printf("GetBestRoute() failed: %d" NL, error);
-                goto Exit;
-            }
+        if (taken[i]) {
+            continue;
         }
 
-        bool success = true;
-        for (int i = 0; i < ARRAYSIZE(k_Ports); i++) {
-            if (!PCPMapPort((PSOCKADDR_STORAGE)&internalAddr, sizeof(internalAddr),
-                (PSOCKADDR_STORAGE)&targetAddr, sizeof(targetAddr),
-                k_Ports[i].proto, k_Ports[i].port, enable, false)) {
-                success = false;
+        // Everything due on the same gateway goes together. PCP pinholes must also be
+        // sent from the address they're for.
+        for (int j = i; j < leaseCount; j++) {
+            if (taken[j] || strcmp(leases[j].method, leases[i].method) || strcmp(leases[j].gateway, leases[i].gateway)) {
+                continue;
             }
-        }
-
-        // We can only map ports for the non-default gateway case because
-        // it will use our internal address as the internal client address, which
-        // doesn't work (needs to be broadcast) for the last hop.
-        if (internalAddressIP4 != nullptr) {
-            // Best effort, don't care if we fail for WOL
-            for (int i = 0; i < ARRAYSIZE(k_WolPorts); i++) {
-                // Indefinite mapping since we may not be awake to refresh it
-                PCPMapPort((PSOCKADDR_STORAGE)&internalAddr, sizeof(internalAddr),
-                    (PSOCKADDR_STORAGE)&targetAddr, sizeof(targetAddr),
-                    IPPROTO_UDP, k_WolPorts[i], enable, true);
+            else if (!strcmp(leases[i].method, "PCP") && strcmp(leases[j].internalAddress, leases[i].internalAddress)) {
+                continue;
             }
+
+            // Ask for the same kind of lease we had before. Only WoL mappings get more than an
+            // hour, and permanent ones are either WoL or on IGDs that refused to lease them.
+            InitMappingOp(&ops[opCount++], nullptr, nullptr,
+                leases[j].internalAddress[0] != 0 ? leases[j].internalAddress : nullptr,
+                leases[j].proto, leases[j].port, true,
+                leases[j].lifetime == 0 || leases[j].lifetime > PORT_MAPPING_DURATION_SEC, true);
+            taken[j] = true;
         }
 
-        if (success) {
-            printf("PCP IPv4 port mapping successful" NL);
+        printf("Renewing %d %s leases on %s" NL, opCount, leases[i].method, leases[i].gateway);
+        if (!RenewLeaseGroup(&leases[i], ops, opCount)) {
+            success = false;
         }
     }
 
-Exit:
-    // Write this at the end to avoid clobbering an input parameter
-    if (upstreamAddrNatPmp[0] != 0 && inet_addr(upstreamAddrNatPmp) != 0) {
-        printf("Using NAT-PMP upstream IPv4 address: %s" NL, upstreamAddrNatPmp);
-        strcpy(upstreamAddressIP4, upstreamAddrNatPmp);
-    }
-    else if (upstreamAddrUPnP[0] != 0 && inet_addr(upstreamAddrUPnP) != 0) {
-        printf("Using UPnP upstream IPv4 address: %s" NL, upstreamAddrUPnP);
-        strcpy(upstreamAddressIP4, upstreamAddrUPnP);
-    }
-    else {
-        printf("No valid upstream IPv4 address found!" NL);
-        upstreamAddressIP4[0] = 0;
-    }
+    PrintMappingActionSummary();
+
+    fflush(stdout);
+    return success;
 }
 
-bool IsLikelyNAT(unsigned long netByteOrderAddr)
+void NETIOAPI_API_ IpInterfaceChangeNotificationCallback(PVOID context, PMIB_IPINTERFACE_ROW, MIB_NOTIFICATION_TYPE)
 {
-    DWORD addr = htonl(netByteOrderAddr);
-
-    // 10.0.0.0/8
-    if ((addr & 0xFF000000) == 0x0A000000) {
-        return true;
-    }
-    // 172.16.0.0/12
-    else if ((addr & 0xFFF00000) == 0xAC100000) {
-        return true;
-    }
-    // 192.168.0.0/16
-    else if ((addr & 0xFFFF0000) == 0xC0A80000) {
-        return true;
-    }
-    // 100.64.0.0/10 - RFC6598 official CGN address
-    else if ((addr & 0xFFC00000) == 0x64400000) {
-        return true;
-    }
-
-    return false;
+    SetEvent((HANDLE)context);
 }
 
-void UpdatePortMappings(bool enable)
+bool IsInterfaceAddressReady(NET_IFINDEX interfaceIndex)
 {
-    IN_ADDR hops[4];
-    int hopCount = ARRAYSIZE(hops);
-    char upstreamAddrStr[128];
-    unsigned long upstreamAddr;
+    PMIB_UNICASTIPADDRESS_TABLE table;
+    bool ready = false;
 
-    printf("Finding upstream IPv4 hops via traceroute..." NL);
-    if (!getHopsIP4(hops, &hopCount)) {
-        hopCount = 0;
+    DWORD error = GetUnicastIpAddressTable(AF_INET, &table);
+    if (error != NO_ERROR) {
+        printf("GetUnicastIpAddressTable() failed: %d" NL, error);
+        return false;
     }
-    else {
-        printf("Found %d hops" NL, hopCount);
+
+    // All addresses on the interface must have finished duplicate address detection
+    for (ULONG i = 0; i < table->NumEntries; i++) {
+        if (table->Table[i].InterfaceIndex != interfaceIndex) {
+            continue;
+        }
+        else if (table->Table[i].DadState != IpDadStatePreferred) {
+            ready = false;
+            break;
+        }
+
+        ready = true;
     }
 
-    // getHopsIP4() already skips the default gateway, so 0
-    // is actually the first hop after the default gateway
-    int nextHopIndex = 0;
+    FreeMibTable(table);
+    return ready;
+}
 
-    // Start by probing for the default gateway
-    UpdatePortMappingsForTarget(enable, nullptr, nullptr, upstreamAddrStr);
-    while (upstreamAddrStr[0] != 0 && (upstreamAddr = inet_addr(upstreamAddrStr)) != 0) {
-        // We got an upstream address. Let's check if this is a NAT
-        if (IsLikelyNAT(upstreamAddr)) {
-            printf("Upstream address %s is likely a NAT" NL, upstreamAddrStr);
+void WaitForInterfaceSettle()
+{
+    DWORD waitTime = INTERFACE_SETTLE_INITIAL_INTERVAL_MS;
+    ULONGLONG startTime = GetTickCount64();
+    MIB_IPFORWARDROW lastRoute = {};
+    bool lastReady = false;
 
-            if (nextHopIndex >= hopCount) {
-                printf("Traceroute didn't reach this hop! Aborting!" NL);
-                break;
-            }
+    // Wait until we have a usable default route that stays the same across two polls
+    for (;;) {
+        MIB_IPFORWARDROW route;
 
-            char targetAddress[128];
-            inet_ntop(AF_INET, &hops[nextHopIndex], targetAddress, sizeof(targetAddress));
+        Sleep(waitTime);
 
-            // It's a NAT, so let's direct our UPnP/NAT-PMP messages to it.
-            // The internal IP address for the new mapping will be the upstream address of the last one.
-            // The target IP address to which to send the UPnP/NAT-PMP is the next hop of the traceroute.
-            UpdatePortMappingsForTarget(enable, targetAddress, upstreamAddrStr, upstreamAddrStr);
+        bool ready = GetBestRoute(0, 0, &route) == NO_ERROR && IsInterfaceAddressReady(route.dwForwardIfIndex);
+        if (ready && lastReady &&
+                route.dwForwardIfIndex == lastRoute.dwForwardIfIndex &&
+                route.dwForwardNextHop == lastRoute.dwForwardNextHop) {
+            printf("Network settled after %llu ms" NL, GetTickCount64() - startTime);
+            return;
         }
-        else {
-            // If we reach a proper public IP address, we're done
-            printf("Reached the Internet at hop %d" NL, nextHopIndex);
-            break;
+        else if (GetTickCount64() - startTime >= INTERFACE_SETTLE_DEADLINE_MS) {
+            printf("Network still not settled after %llu ms" NL, GetTickCount64() - startTime);
+            return;
         }
 
-        // Next hop
-        nextHopIndex++;
-    }
+        lastReady = ready;
+        if (ready) {
+            lastRoute = route;
+        }
 
-    fflush(stdout);
+        waitTime = min(waitTime * 2, INTERFACE_SETTLE_MAX_INTERVAL_MS);
+    }
 }
 
-void NETIOAPI_API_ IpInterfaceChangeNotificationCallback(PVOID context, PMIB_IPINTERFACE_ROW, MIB_NOTIFICATION_TYPE)
+// Interface events tend to come in bursts, so wait for them to die down
+void WaitForInterfaceChangesToStop(HANDLE ifaceChangeEvent)
 {
-    SetEvent((HANDLE)context);
+    ULONGLONG startTime = GetTickCount64();
+
+    do {
+        ResetEvent(ifaceChangeEvent);
+    } while (WaitForSingleObject(ifaceChangeEvent, INTERFACE_DEBOUNCE_QUIET_MS) == WAIT_OBJECT_0 &&
+             GetTickCount64() - startTime < INTERFACE_SETTLE_DEADLINE_MS);
 }
 
 void ResetLogFile(bool standaloneExe)
@@ -880,12 +2734,21 @@ int Run(bool standaloneExe)
 {
     HANDLE ifaceChangeEvent = CreateEvent(nullptr, true, false, nullptr);
     HANDLE gsChangeEvent = CreateEvent(nullptr, true, false, nullptr);
-    HANDLE events[2] = { ifaceChangeEvent, gsChangeEvent };
+    HANDLE pcpStateLostEvent = CreateEvent(nullptr, true, false, nullptr);
+    HANDLE events[3] = { ifaceChangeEvent, gsChangeEvent, pcpStateLostEvent };
+    NETWORK_SNAPSHOT lastSnapshot;
+    int suppressedChanges = 0;
+    int totalSuppressedChanges = 0;
+    bool gameStreamEnabled = false;
+    bool mappingsComplete = false;
+    bool renewDueLeasesOnly = false;
+    ULONGLONG announceReceiveTime = 0;
 
     ResetLogFile(standaloneExe);
 
     // Bump the process priority class to above normal. The UDP relay threads will
-    // further raise their own thread priorities to avoid preemption by other activity.
+    // further raise their own thread priorities while a stream is active to avoid
+    // preemption by other activity.
     SetPriorityClass(GetCurrentProcess(), ABOVE_NORMAL_PRIORITY_CLASS);
 
     // Create the UDP alternate port relays
@@ -895,6 +2758,12 @@ int Run(bool standaloneExe)
         }
     }
 
+    // Answer STUN binding requests so clients can check reachability in one round trip
+    StartStunBeacon(STUN_BEACON_PORT);
+
+    // Remap right away if a PCP server tells us it rebooted
+    StartPCPAnnounceListener(pcpStateLostEvent);
+
     // Create the thread to watch for GameStream state changes
     CreateThread(nullptr, 0, GameStreamStateChangeThread, gsChangeEvent, 0, nullptr);
 
@@ -905,33 +2774,84 @@ int Run(bool standaloneExe)
     for (;;) {
         ResetEvent(gsChangeEvent);
         ResetEvent(ifaceChangeEvent);
+        ResetEvent(pcpStateLostEvent);
+
+        // When we only woke up because leases came due, nothing else has changed, so
+        // just renew those. Anything that can't be renewed on its own gets a full update.
+        if (!renewDueLeasesOnly || !RenewDueLeases()) {
+            // Remember what the network looked like when we last mapped ports
+            TakeNetworkSnapshot(&lastSnapshot);
 
-        bool gameStreamEnabled = IsGameStreamEnabled();
+            gameStreamEnabled = IsGameStreamEnabled();
+
+            if (gameStreamEnabled) {
+                printf("GameStream is ON!" NL);
+            }
+            else {
+                printf("GameStream is OFF!" NL);
+            }
 
-        if (gameStreamEnabled) {
-            printf("GameStream is ON!" NL);
+            mappingsComplete = UpdatePortMappings(gameStreamEnabled);
         }
-        else {
-            printf("GameStream is OFF!" NL);
+
+        if (announceReceiveTime != 0) {
+            printf("Remapping finished %llu ms after the PCP ANNOUNCE was received" NL,
+                GetTickCount64() - announceReceiveTime);
+            announceReceiveTime = 0;
         }
 
-        UpdatePortMappings(gameStreamEnabled);
+        renewDueLeasesOnly = false;
 
-        // Refresh when half the duration is expired or if an IP interface
-        // change event occurs.
-        printf("Going to sleep..." NL);
+        // Wake up when the first lease is halfway to expiring (or a permanent mapping
+        // is due to be read back) or if an IP interface change event occurs. If
+        // something couldn't be mapped or we have no leases, keep polling at the
+        // old interval.
+        DWORD sleepTime = GetNextLeaseRenewalDelayMs(POLLING_DELAY_SEC * 1000, LEASE_SAFETY_POLL_SEC * 1000);
+        if (!mappingsComplete) {
+            sleepTime = min(sleepTime, (DWORD)(POLLING_DELAY_SEC * 1000));
+        }
+        printf("Going to sleep for %u seconds..." NL, sleepTime / 1000);
         fflush(stdout);
 
         ULONGLONG beforeSleepTime = GetTickCount64();
-        DWORD ret = WaitForMultipleObjects(ARRAYSIZE(events), events, false, POLLING_DELAY_SEC * 1000);
+        DWORD ret;
+        char changeReason[64];
+        for (;;) {
+            ULONGLONG elapsed = GetTickCount64() - beforeSleepTime;
+
+            ret = WaitForMultipleObjects(ARRAYSIZE(events), events, false, elapsed < sleepTime ? (DWORD)(sleepTime - elapsed) : 0);
+            if (ret != WAIT_OBJECT_0) {
+                break;
+            }
+
+            // Only remap if the change affects our default route or addresses
+            WaitForInterfaceChangesToStop(ifaceChangeEvent);
+
+            NETWORK_SNAPSHOT snapshot;
+            TakeNetworkSnapshot(&snapshot);
+            if (CompareNetworkSnapshots(&lastSnapshot, &snapshot, changeReason, sizeof(changeReason))) {
+                break;
+            }
+
+            suppressedChanges++;
+            totalSuppressedChanges++;
+            printf("Ignoring interface change that doesn't affect port mappings (%d suppressed since last update, %d total)" NL,
+                suppressedChanges, totalSuppressedChanges);
+            fflush(stdout);
+        }
+
         if (ret == WAIT_OBJECT_0) {
             ResetLogFile(standaloneExe);
 
-            printf("Woke up for interface change notification after %lld seconds" NL,
-                (GetTickCount64() - beforeSleepTime) / 1000);
+            printf("Woke up for interface change notification after %lld seconds: %s" NL,
+                (GetTickCount64() - beforeSleepTime) / 1000, changeReason);
+            if (suppressedChanges != 0) {
+                printf("Suppressed %d interface changes since the last update (%d total)" NL,
+                    suppressedChanges, totalSuppressedChanges);
+            }
 
             // Wait a little bit for the interface to settle down (DHCP, RA, etc)
-            Sleep(10000);
+            WaitForInterfaceSettle();
         }
         else if (ret == WAIT_OBJECT_0 + 1) {
             ResetLogFile(standaloneExe);
@@ -939,11 +2859,27 @@ int Run(bool standaloneExe)
             printf("Woke up for GameStream state change notification after %lld seconds" NL,
                 (GetTickCount64() - beforeSleepTime) / 1000);
         }
+        else if (ret == WAIT_OBJECT_0 + 2) {
+            ResetLogFile(standaloneExe);
+
+            printf("Woke up for PCP server state loss after %lld seconds" NL,
+                (GetTickCount64() - beforeSleepTime) / 1000);
+
+            announceReceiveTime = TakePCPAnnounceReceiveTime();
+        }
         else {
             ResetLogFile(standaloneExe);
 
-            printf("Woke up for periodic refresh" NL);
+            if (gameStreamEnabled && mappingsComplete) {
+                printf("Woke up to renew due leases" NL);
+                renewDueLeasesOnly = true;
+            }
+            else {
+                printf("Woke up for periodic refresh" NL);
+            }
         }
+
+        suppressedChanges = 0;
     }
 }
 
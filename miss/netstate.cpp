@@ -0,0 +1,134 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <iphlpapi.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "netstate.h"
+#include "igdcache.h"
+
+static int compareIPv4Addresses(const void* a, const void* b)
+{
+    return memcmp(a, b, sizeof(IN_ADDR));
+}
+
+static int compareIPv6Addresses(const void* a, const void* b)
+{
+    return memcmp(a, b, sizeof(IN6_ADDR));
+}
+
+static void getIPv4DefaultRoute(PNETWORK_SNAPSHOT snapshot)
+{
+    MIB_IPFORWARDROW route;
+
+    if (GetBestRoute(0, 0, &route) == NO_ERROR) {
+        snapshot->haveIPv4Route = true;
+        snapshot->ipv4Interface = route.dwForwardIfIndex;
+        snapshot->ipv4Gateway.S_un.S_addr = route.dwForwardNextHop;
+
+        // If this fails, the next snapshot will look different and we'll just remap
+        if (route.dwForwardNextHop != 0) {
+            GetGatewayMacAddress(nullptr, snapshot->ipv4GatewayMac, sizeof(snapshot->ipv4GatewayMac));
+        }
+    }
+}
+
+static void getIPv6DefaultRoute(PNETWORK_SNAPSHOT snapshot)
+{
+    MIB_IPFORWARD_ROW2 route;
+    SOCKADDR_INET destination = {};
+    SOCKADDR_INET source;
+
+    // Any global unicast address will do since we only want the default route
+    destination.si_family = AF_INET6;
+    destination.Ipv6.sin6_family = AF_INET6;
+    destination.Ipv6.sin6_addr.u.Byte[0] = 0x20;
+
+    if (GetBestRoute2(nullptr, 0, nullptr, &destination, 0, &route, &source) == NO_ERROR) {
+        snapshot->haveIPv6Route = true;
+        snapshot->ipv6Interface = route.InterfaceIndex;
+        snapshot->ipv6Gateway = route.NextHop.Ipv6.sin6_addr;
+    }
+}
+
+void TakeNetworkSnapshot(PNETWORK_SNAPSHOT snapshot)
+{
+    PMIB_UNICASTIPADDRESS_TABLE table;
+
+    *snapshot = {};
+
+    getIPv4DefaultRoute(snapshot);
+    getIPv6DefaultRoute(snapshot);
+
+    DWORD error = GetUnicastIpAddressTable(AF_UNSPEC, &table);
+    if (error != NO_ERROR) {
+        printf("GetUnicastIpAddressTable() failed: %d\n", error);
+        return;
+    }
+
+    // We only care about addresses on the interfaces that carry our default routes
+    for (ULONG i = 0; i < table->NumEntries; i++) {
+        PMIB_UNICASTIPADDRESS_ROW row = &table->Table[i];
+
+        if (row->Address.si_family == AF_INET) {
+            if (snapshot->haveIPv4Route && row->InterfaceIndex == snapshot->ipv4Interface &&
+                    snapshot->ipv4AddressCount < NETWORK_SNAPSHOT_MAX_ADDRESSES) {
+                snapshot->ipv4Addresses[snapshot->ipv4AddressCount++] = row->Address.Ipv4.sin_addr;
+            }
+        }
+        else if (row->Address.si_family == AF_INET6) {
+            // Link-local addresses aren't used for anything we map
+            if (snapshot->haveIPv6Route && row->InterfaceIndex == snapshot->ipv6Interface &&
+                    !IN6_IS_ADDR_LINKLOCAL(&row->Address.Ipv6.sin6_addr) &&
+                    snapshot->ipv6AddressCount < NETWORK_SNAPSHOT_MAX_ADDRESSES) {
+                snapshot->ipv6Addresses[snapshot->ipv6AddressCount++] = row->Address.Ipv6.sin6_addr;
+            }
+        }
+    }
+
+    FreeMibTable(table);
+
+    // Sort them so the order the table comes back in doesn't matter
+    qsort(snapshot->ipv4Addresses, snapshot->ipv4AddressCount, sizeof(IN_ADDR), compareIPv4Addresses);
+    qsort(snapshot->ipv6Addresses, snapshot->ipv6AddressCount, sizeof(IN6_ADDR), compareIPv6Addresses);
+}
+
+bool CompareNetworkSnapshots(PNETWORK_SNAPSHOT before, PNETWORK_SNAPSHOT after, char* reason, int reasonSize)
+{
+    if (before->haveIPv4Route != after->haveIPv4Route ||
+            before->ipv4Interface != after->ipv4Interface) {
+        snprintf(reason, reasonSize, "IPv4 default route changed");
+    }
+    else if (memcmp(&before->ipv4Gateway, &after->ipv4Gateway, sizeof(after->ipv4Gateway))) {
+        snprintf(reason, reasonSize, "IPv4 gateway changed");
+    }
+    else if (strcmp(before->ipv4GatewayMac, after->ipv4GatewayMac)) {
+        snprintf(reason, reasonSize, "IPv4 gateway MAC address changed");
+    }
+    else if (before->ipv4AddressCount != after->ipv4AddressCount ||
+             memcmp(before->ipv4Addresses, after->ipv4Addresses, after->ipv4AddressCount * sizeof(IN_ADDR))) {
+        snprintf(reason, reasonSize, "IPv4 addresses changed");
+    }
+    else if (before->haveIPv6Route != after->haveIPv6Route ||
+             before->ipv6Interface != after->ipv6Interface) {
+        snprintf(reason, reasonSize, "IPv6 default route changed");
+    }
+    else if (memcmp(&before->ipv6Gateway, &after->ipv6Gateway, sizeof(after->ipv6Gateway))) {
+        snprintf(reason, reasonSize, "IPv6 gateway changed");
+    }
+    else if (before->ipv6AddressCount != after->ipv6AddressCount ||
+             memcmp(before->ipv6Addresses, after->ipv6Addresses, after->ipv6AddressCount * sizeof(IN6_ADDR))) {
+        snprintf(reason, reasonSize, "IPv6 addresses changed");
+    }
+    else {
+        reason[0] = 0;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#define NETWORK_SNAPSHOT_MAX_ADDRESSES 16
+
+// The parts of the network configuration that our port mappings depend on.
+// Interface events for anything else (virtual switches, VPN adapters that
+// don't carry the default route, etc.) don't need a remap.
+typedef struct _NETWORK_SNAPSHOT {
+    bool haveIPv4Route;
+    NET_IFINDEX ipv4Interface;
+    IN_ADDR ipv4Gateway;
+
+    // Catches moving to a different router that uses the same gateway address
+    char ipv4GatewayMac[32];
+
+    int ipv4AddressCount;
+    IN_ADDR ipv4Addresses[NETWORK_SNAPSHOT_MAX_ADDRESSES];
+
+    bool haveIPv6Route;
+    NET_IFINDEX ipv6Interface;
+    IN6_ADDR ipv6Gateway;
+    int ipv6AddressCount;
+    IN6_ADDR ipv6Addresses[NETWORK_SNAPSHOT_MAX_ADDRESSES];
+} NETWORK_SNAPSHOT, *PNETWORK_SNAPSHOT;
+
+void TakeNetworkSnapshot(PNETWORK_SNAPSHOT snapshot);
+
+// Returns true if anything that affects our port mappings changed and describes the first difference
+bool CompareNetworkSnapshots(PNETWORK_SNAPSHOT before, PNETWORK_SNAPSHOT after, char* reason, int reasonSize);
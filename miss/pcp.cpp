@@ -13,10 +13,34 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdarg.h>
 
-#define RECV_TIMEOUT_SEC 3
+#include "mapper.h"
+#include "lease.h"
+#include "transact.h"
+
+#define PCP_SERVER_PORT 5351
+#define PCP_CLIENT_PORT 5350
+#define PCP_ANNOUNCE_MULTICAST_ADDRESS "224.0.0.1"
+
+// RFC 6887 section 14.1.3 asks clients to wait a random time before
+// re-creating mappings after an ANNOUNCE to avoid a storm of requests.
+#define PCP_ANNOUNCE_MAX_DELAY_MS 5000
+
+#define MAX_PCP_SERVERS 8
+
+// Retransmission parameters from RFC 6887 section 8.1.1. The RFC allows retrying
+// forever (MRD = 0), but our callers are waiting on us, so we give up after a
+// couple of transmissions.
+#define PCP_IRT_MS 3000
+#define PCP_MRT_MS 1024000
+#define PCP_MAX_DURATION_MS 7000
+
+#define PCP_MAX_BATCH_SIZE 32
 
 #define PCP_VERSION 2
+#define OPCODE_ANNOUNCE_REQUEST 0x00
+#define OPCODE_ANNOUNCE_RESPONSE 0x80
 #define OPCODE_MAP_REQUEST  0x01
 #define OPCODE_MAP_RESPONSE 0x81
 
@@ -75,6 +99,38 @@ typedef struct _PCP_MAP_RESPONSE {
 
 #pragma pack(pop)
 
+typedef struct _PCP_BATCH PCP_BATCH, *PPCP_BATCH;
+
+typedef struct _PCP_PENDING_REQUEST {
+    UDP_TRANSACTION transaction;
+    PPCP_BATCH batch;
+    PMAPPING_OP op;
+    PCP_MAP_REQUEST msg;
+    int msgLen;
+} PCP_PENDING_REQUEST, *PPCP_PENDING_REQUEST;
+
+struct _PCP_BATCH {
+    PCP_PENDING_REQUEST requests[PCP_MAX_BATCH_SIZE];
+    int requestCount;
+    char pcpAddrStr[INET6_ADDRSTRLEN];
+};
+
+// RFC 6887 section 8.1.1
+static const UDP_RETRANSMIT_SCHEDULE k_PcpRetransmitSchedule = { PCP_IRT_MS, PCP_MRT_MS, 0, true };
+
+typedef struct _PCP_SERVER_EPOCH {
+    char address[INET6_ADDRSTRLEN];
+    unsigned int epoch;
+    ULONGLONG receiveTime;
+} PCP_SERVER_EPOCH, *PPCP_SERVER_EPOCH;
+
+static SRWLOCK s_ServerEpochLock = SRWLOCK_INIT;
+static PCP_SERVER_EPOCH s_ServerEpochs[MAX_PCP_SERVERS];
+static HANDLE s_StateLostEvent;
+
+// When we received the ANNOUNCE that set s_StateLostEvent, so the remap can be timed
+static volatile LONG64 s_AnnounceReceiveTime;
+
 static void populateMappingNonce(PPCP_MAP_REQUEST request, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen)
 {
     struct {
@@ -109,37 +165,269 @@ static void populateAddressFromSockAddr(PSOCKADDR_STORAGE sockAddr, unsigned cha
     }
 }
 
-bool PCPMapPort(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen, int proto, int port, bool enable, bool indefinite)
+static void getAddressString(PSOCKADDR_STORAGE addr, char* addrStr, int addrStrLen)
 {
-    SOCKET sock;
-    PCP_MAP_REQUEST reqMsg;
-    int reqMsgLen;
-    int i;
-    int bytesRead;
-    union {
-        PCP_MAP_RESPONSE hdr;
-        char buf[1100];
-    } resp;
+    if (addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((PSOCKADDR_IN)addr)->sin_addr, addrStr, addrStrLen);
+    }
+    else {
+        inet_ntop(AF_INET6, &((PSOCKADDR_IN6)addr)->sin6_addr, addrStr, addrStrLen);
+    }
+}
+
+// Validates the server's epoch against the last one we saw from it using the
+// rules in RFC 6887 section 8.5. Returns true if the server has lost its state.
+// If knownOnly is set, epochs from servers we haven't talked to are ignored.
+static bool checkServerEpoch(const char* serverAddrStr, unsigned int epoch, bool knownOnly)
+{
+    PPCP_SERVER_EPOCH entry = nullptr;
+    ULONGLONG now = GetTickCount64();
+    bool stateLost = false;
+
+    AcquireSRWLockExclusive(&s_ServerEpochLock);
+
+    for (int i = 0; i < MAX_PCP_SERVERS; i++) {
+        if (!strcmp(s_ServerEpochs[i].address, serverAddrStr)) {
+            entry = &s_ServerEpochs[i];
+            break;
+        }
+    }
+
+    if (entry != nullptr) {
+        long long serverDelta = (long long)epoch - entry->epoch;
+        long long clientDelta = (long long)((now - entry->receiveTime) / 1000);
+
+        if (serverDelta < -1) {
+            // The epoch went backwards, so the server restarted
+            stateLost = true;
+        }
+        else if (clientDelta + 2 < serverDelta - serverDelta / 16 ||
+                 serverDelta + 2 < clientDelta - clientDelta / 16) {
+            // The server's clock isn't keeping pace with ours
+            stateLost = true;
+        }
+    }
+    else if (!knownOnly) {
+        // Take a free slot or replace the one we heard from least recently
+        entry = &s_ServerEpochs[0];
+        for (int i = 0; i < MAX_PCP_SERVERS; i++) {
+            if (s_ServerEpochs[i].address[0] == 0) {
+                entry = &s_ServerEpochs[i];
+                break;
+            }
+            else if (s_ServerEpochs[i].receiveTime < entry->receiveTime) {
+                entry = &s_ServerEpochs[i];
+            }
+        }
+
+        strncpy(entry->address, serverAddrStr, sizeof(entry->address) - 1);
+        entry->address[sizeof(entry->address) - 1] = 0;
+    }
+
+    if (entry != nullptr) {
+        entry->epoch = epoch;
+        entry->receiveTime = now;
+    }
+
+    ReleaseSRWLockExclusive(&s_ServerEpochLock);
+
+    return stateLost;
+}
+
+static void logPCPResult(unsigned char result)
+{
+    switch (result) {
+    case 1: // UNSUPP_VERSION
+        MappingLog("UNSUPPORTED\n");
+        break;
+    case 2: // NOT_AUTHORIZED
+        MappingLog("UNAUTHORIZED\n");
+        break;
+    case 11: // CANNOT_PROVIDE_EXTERNAL
+        MappingLog("CONFLICT\n");
+        break;
+    default:
+        MappingLog("ERROR: %d\n", result);
+        break;
+    }
+}
+
+// Fails all outstanding requests with the same log message
+static void failPendingRequests(PPCP_BATCH batch, const char* format, ...)
+{
+    char message[256];
+    va_list va;
+
+    va_start(va, format);
+    vsnprintf(message, sizeof(message), format, va);
+    va_end(va);
+
+    for (int i = 0; i < batch->requestCount; i++) {
+        PPCP_PENDING_REQUEST request = &batch->requests[i];
+        if (request->transaction.state == UdpTransactionPending) {
+            SetCurrentMappingOp(request->op);
+            MappingLog("%s", message);
+            CancelUdpTransaction(&request->transaction);
+        }
+    }
+}
+
+static bool handleMapResponse(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length)
+{
+    PPCP_PENDING_REQUEST request = (PPCP_PENDING_REQUEST)transaction->context;
+    PPCP_BATCH batch = request->batch;
+    PPCP_MAP_RESPONSE resp = (PPCP_MAP_RESPONSE)data;
+    PMAPPING_OP op = request->op;
+
+    if (length < sizeof(resp->hdr)) {
+        // Too short to even tell what this is
+        return false;
+    }
+    else if (resp->hdr.version != PCP_VERSION) {
+        failPendingRequests(batch, "PCP version mismatch: %x\n", resp->hdr.version);
+        return true;
+    }
+    else if (resp->hdr.opcode != OPCODE_MAP_RESPONSE) {
+        // Not a response to any of our requests
+        return false;
+    }
+    else if (length < sizeof(*resp)) {
+        // An error response may not carry the MAP fields, in which case it
+        // applies to everything we sent.
+        if (resp->hdr.result == 0) {
+            return false;
+        }
+
+        for (int i = 0; i < batch->requestCount; i++) {
+            if (batch->requests[i].transaction.state == UdpTransactionPending) {
+                SetCurrentMappingOp(batch->requests[i].op);
+                logPCPResult(resp->hdr.result);
+                CompleteUdpTransaction(&batch->requests[i].transaction);
+            }
+        }
+        return true;
+    }
+    // TCP and UDP mappings for the same port share a nonce, so match on the protocol too
+    else if (memcmp(request->msg.mappingNonce, resp->mappingNonce, sizeof(resp->mappingNonce)) ||
+             request->msg.protocol != resp->protocol ||
+             request->msg.internalPort != resp->internalPort) {
+        return false;
+    }
+
+    SetCurrentMappingOp(op);
+    CompleteUdpTransaction(transaction);
+
+    // We're already (re)creating this mapping, so there's nothing more to do
+    // than note it if the server lost its state since we last heard from it.
+    if (checkServerEpoch(batch->pcpAddrStr, ntohl(resp->hdr.epoch), false)) {
+        MappingLog("(PCP server lost state) ");
+    }
+
+    if (resp->hdr.result != 0) {
+        logPCPResult(resp->hdr.result);
+    }
+    else if (request->msg.externalPort != resp->externalPort) {
+        MappingLog("PCP returned different external port: %d wanted %d\n", htons(resp->externalPort), htons(request->msg.externalPort));
+        if (op->enable) {
+            // Clear the port mapping by modifying and resending the old request (with the same nonce)
+            request->msg.hdr.lifetime = 0;
+            request->msg.externalPort = resp->externalPort;
+            request->msgLen = sizeof(request->msg) - sizeof(request->msg.preferFailureOption);
+            if (send(transaction->sock, (char*)&request->msg, request->msgLen, 0) == SOCKET_ERROR) {
+                MappingLog("Failed to unmap unexpected external port: %d\n", WSAGetLastError());
+            }
+        }
+    }
+    else if (op->enable) {
+        MappingLog("OK (%d seconds remaining)\n", ntohl(resp->hdr.lifetime));
+        RecordMappingLease("PCP", batch->pcpAddrStr, op->internalAddress, op->proto, op->port, ntohl(resp->hdr.lifetime));
+        op->success = true;
+    }
+    else {
+        MappingLog("DELETED\n");
+        RemoveMappingLease("PCP", batch->pcpAddrStr, op->internalAddress, op->proto, op->port);
+        op->success = true;
+    }
+
+    return true;
+}
+
+static void populateMapRequest(PPCP_PENDING_REQUEST request, PSOCKADDR_STORAGE localAddr, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen)
+{
+    PMAPPING_OP op = request->op;
     int lifetime;
 
-    if (!enable) {
+    if (!op->enable) {
         lifetime = 0;
     }
-    else if (indefinite) {
+    else if (op->indefinite) {
         lifetime = 604800; // 1 week
     }
     else {
         lifetime = 3600;
     }
 
+    request->msg = {};
+    request->msg.hdr.version = PCP_VERSION;
+    request->msg.hdr.opcode = OPCODE_MAP_REQUEST;
+    request->msg.hdr.lifetime = htonl(lifetime);
+    populateAddressFromSockAddr(localAddr, request->msg.hdr.localAddress);
+
+    request->msg.protocol = op->proto;
+    request->msg.internalPort = htons(op->port);
+    request->msg.externalPort = htons(op->port);
+
+    SOCKADDR_STORAGE noneAddr = {};
+    noneAddr.ss_family = localAddr->ss_family;
+    populateAddressFromSockAddr(&noneAddr, request->msg.externalAddress);
+
+    if (op->enable) {
+        // We don't want an alternate allocation if this fails
+        request->msg.preferFailureOption.code = CODE_PREFER_FAILURE;
+        request->msg.preferFailureOption.length = 0;
+        request->msgLen = sizeof(request->msg);
+    }
+    else {
+        // We don't append PREFER_FAILURE for an unmap request
+        request->msgLen = sizeof(request->msg) - sizeof(request->msg.preferFailureOption);
+    }
+
+    // This must be done after the rest of the message is populated
+    populateMappingNonce(&request->msg, pcpAddr, pcpAddrLen);
+
+    request->transaction.requestLength = request->msgLen;
+}
+
+static void mapPortBatch(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen, PMAPPING_OP ops, int opCount)
+{
+    PCP_BATCH batch;
+    PUDP_TRANSACTION transactions[PCP_MAX_BATCH_SIZE];
+    SOCKET sock;
+
+    assert(opCount <= PCP_MAX_BATCH_SIZE);
     assert(localAddr->ss_family == pcpAddr->ss_family);
 
-    printf("Updating PCP port mapping for %s %d...", proto == IPPROTO_TCP ? "TCP" : "UDP", port);
+    batch.requestCount = opCount;
+    getAddressString(pcpAddr, batch.pcpAddrStr, sizeof(batch.pcpAddrStr));
+
+    for (int i = 0; i < opCount; i++) {
+        PPCP_PENDING_REQUEST request = &batch.requests[i];
+
+        request->batch = &batch;
+        request->op = &ops[i];
+        InitUdpTransaction(&request->transaction, INVALID_SOCKET, nullptr, 0,
+            (char*)&request->msg, 0, &k_PcpRetransmitSchedule, PCP_MAX_DURATION_MS,
+            handleMapResponse, request);
+        transactions[i] = &request->transaction;
+
+        SetCurrentMappingOp(&ops[i]);
+        MappingLog("Updating PCP port mapping for %s %d...", ops[i].proto == IPPROTO_TCP ? "TCP" : "UDP", ops[i].port);
+    }
 
     sock = socket(localAddr->ss_family, SOCK_DGRAM, IPPROTO_UDP);
     if (sock == INVALID_SOCKET) {
-        printf("socket() failed: %d\n", WSAGetLastError());
-        return false;
+        failPendingRequests(&batch, "socket() failed: %d\n", WSAGetLastError());
+        return;
     }
 
     if (localAddr->ss_family == AF_INET6) {
@@ -147,17 +435,15 @@ bool PCPMapPort(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE
         // is opened correctly and that the PCP server doesn't refuse our mapping.
         ((PSOCKADDR_IN6)localAddr)->sin6_port = 0;
         if (bind(sock, (struct sockaddr*)localAddr, localAddrLen) == SOCKET_ERROR) {
-            printf("bind() failed: %d\n", WSAGetLastError());
-            closesocket(sock);
-            return false;
+            failPendingRequests(&batch, "bind() failed: %d\n", WSAGetLastError());
+            goto Exit;
         }
     }
 
-    ((PSOCKADDR_IN)pcpAddr)->sin_port = htons(5351);
+    ((PSOCKADDR_IN)pcpAddr)->sin_port = htons(PCP_SERVER_PORT);
     if (connect(sock, (struct sockaddr*)pcpAddr, pcpAddrLen) == SOCKET_ERROR) {
-        printf("connect() failed: %d\n", WSAGetLastError());
-        closesocket(sock);
-        return false;
+        failPendingRequests(&batch, "connect() failed: %d\n", WSAGetLastError());
+        goto Exit;
     }
 
     // If we didn't get a local address, use the address of the interface we bound to.
@@ -165,147 +451,234 @@ bool PCPMapPort(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE
     // device if we're behind multiple NATs.
     if (localAddr->ss_family == AF_INET && ((PSOCKADDR_IN)localAddr)->sin_addr.S_un.S_addr == 0) {
         if (getsockname(sock, (struct sockaddr*)localAddr, &localAddrLen) == SOCKET_ERROR) {
-            printf("getsockname() failed: %d\n", WSAGetLastError());
-            closesocket(sock);
-            return false;
+            failPendingRequests(&batch, "getsockname() failed: %d\n", WSAGetLastError());
+            goto Exit;
         }
     }
 
-    reqMsg = {};
-    reqMsg.hdr.version = PCP_VERSION;
-    reqMsg.hdr.opcode = OPCODE_MAP_REQUEST;
-    reqMsg.hdr.lifetime = htonl(lifetime);
-    populateAddressFromSockAddr(localAddr, reqMsg.hdr.localAddress);
+    for (int i = 0; i < opCount; i++) {
+        batch.requests[i].transaction.sock = sock;
+        populateMapRequest(&batch.requests[i], localAddr, pcpAddr, pcpAddrLen);
+    }
 
-    reqMsg.protocol = proto;
-    reqMsg.internalPort = htons(port);
-    reqMsg.externalPort = htons(port);
+    // All requests go out at once and responses are matched up by nonce
+    RunUdpTransactions(transactions, opCount);
 
-    SOCKADDR_STORAGE noneAddr = {};
-    noneAddr.ss_family = localAddr->ss_family;
-    populateAddressFromSockAddr(&noneAddr, reqMsg.externalAddress);
+    for (int i = 0; i < opCount; i++) {
+        PPCP_PENDING_REQUEST request = &batch.requests[i];
 
-    if (enable) {
-        // We don't want an alternate allocation if this fails
-        reqMsg.preferFailureOption.code = CODE_PREFER_FAILURE;
-        reqMsg.preferFailureOption.length = 0;
-        reqMsgLen = sizeof(reqMsg);
-    }
-    else {
-        // We don't append PREFER_FAILURE for an unmap request
-        reqMsgLen = sizeof(reqMsg) - sizeof(reqMsg.preferFailureOption);
+        SetCurrentMappingOp(request->op);
+        if (request->transaction.state == UdpTransactionTimedOut) {
+            MappingLog("NO RESPONSE\n");
+        }
+        else if (request->transaction.state == UdpTransactionFailed) {
+            MappingLog("Failed to exchange PCP messages: %d\n", request->transaction.error);
+        }
     }
 
-    // This must be done after the rest of the message is populated
-    populateMappingNonce(&reqMsg, pcpAddr, pcpAddrLen);
-
-    bytesRead = 0;
-    for (i = 0; i < RECV_TIMEOUT_SEC; i++) {
-        // Retransmit the request every second until the timeout elapses
-        if (send(sock, (char *)&reqMsg, reqMsgLen, 0) == SOCKET_ERROR) {
-            printf("send() failed: %d\n", WSAGetLastError());
-            closesocket(sock);
-            return false;
-        }
+Exit:
+    closesocket(sock);
+}
 
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
+void PCPMapPorts(PSOCKADDR_STORAGE localAddr, int localAddrLen, PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen, PMAPPING_OP ops, int opCount)
+{
+    // Split very large sets into batches that fit on the stack
+    for (int i = 0; i < opCount; i += PCP_MAX_BATCH_SIZE) {
+        mapPortBatch(localAddr, localAddrLen, pcpAddr, pcpAddrLen, &ops[i], min(opCount - i, PCP_MAX_BATCH_SIZE));
+    }
 
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+    SetCurrentMappingOp(nullptr);
+}
 
-        int selectRes = select(0, &fds, nullptr, nullptr, &tv);
-        if (selectRes == 0) {
-            // Timeout - continue looping
-            continue;
-        }
-        else if (selectRes == SOCKET_ERROR) {
-            printf("select() failed: %d\n", WSAGetLastError());
-            closesocket(sock);
-            return false;
-        }
+static bool handleAnnounceResponse(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length)
+{
+    PPCP_RESPONSE_HEADER resp = (PPCP_RESPONSE_HEADER)data;
+    bool* found = (bool*)transaction->context;
 
-        // Error handling is below
-        bytesRead = recv(sock, resp.buf, sizeof(resp.buf), 0);
-        break;
+    if (length < 4) {
+        return false;
     }
-
-    if (bytesRead == 0) {
-        printf("NO RESPONSE\n");
-        goto fail;
+    else if (resp->version != PCP_VERSION) {
+        // A NAT-PMP server answers with its own version and UNSUPP_VERSION (RFC 6887
+        // section 9), which tells us right away that there's no PCP server here.
+        CompleteUdpTransaction(transaction);
+        return true;
     }
-    else if (bytesRead == SOCKET_ERROR) {
-        printf("Failed to read PCP response: %d\n", WSAGetLastError());
-        goto fail;
+    else if (resp->opcode != OPCODE_ANNOUNCE_RESPONSE) {
+        return false;
     }
-    else if (bytesRead < sizeof(resp.hdr)) {
-        printf("PCP message truncated: %d\n", bytesRead);
-        goto fail;
+
+    // Any result (even an error) means there's a PCP server here
+    *found = true;
+    CompleteUdpTransaction(transaction);
+    return true;
+}
+
+// Sends an ANNOUNCE request to find out if there's a PCP server at the given
+// address without touching any mappings. Returns true if one answered.
+bool PCPProbeServer(PSOCKADDR_STORAGE pcpAddr, int pcpAddrLen)
+{
+    PCP_REQUEST_HEADER msg = {};
+    UDP_TRANSACTION transaction;
+    PUDP_TRANSACTION transactions[1];
+    SOCKADDR_STORAGE serverAddr;
+    SOCKADDR_STORAGE localAddr;
+    int localAddrLen;
+    char serverAddrStr[INET6_ADDRSTRLEN];
+    bool found = false;
+    SOCKET sock;
+
+    memcpy(&serverAddr, pcpAddr, pcpAddrLen);
+    getAddressString(&serverAddr, serverAddrStr, sizeof(serverAddrStr));
+
+    sock = socket(serverAddr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        MappingLog("socket() failed: %d\n", WSAGetLastError());
+        return false;
     }
-    else if (resp.hdr.hdr.version != PCP_VERSION) {
-        printf("PCP version mismatch: %x\n", resp.hdr.hdr.version);
-        goto fail;
+
+    ((PSOCKADDR_IN)&serverAddr)->sin_port = htons(PCP_SERVER_PORT);
+    if (connect(sock, (struct sockaddr*)&serverAddr, pcpAddrLen) == SOCKET_ERROR) {
+        MappingLog("connect() failed: %d\n", WSAGetLastError());
+        goto Exit;
     }
-    else if (resp.hdr.hdr.opcode != OPCODE_MAP_RESPONSE) {
-        printf("PCP message type mismatch: %x\n", resp.hdr.hdr.opcode);
-        goto fail;
+
+    localAddrLen = sizeof(localAddr);
+    if (getsockname(sock, (struct sockaddr*)&localAddr, &localAddrLen) == SOCKET_ERROR) {
+        MappingLog("getsockname() failed: %d\n", WSAGetLastError());
+        goto Exit;
     }
-    else if (resp.hdr.hdr.result != 0) {
-        switch (resp.hdr.hdr.result) {
-        case 1: // UNSUPP_VERSION
-            printf("UNSUPPORTED\n");
-            break;
-        case 2: // NOT_AUTHORIZED
-            printf("UNAUTHORIZED\n");
-            break;
-        case 11: // CANNOT_PROVIDE_EXTERNAL
-            printf("CONFLICT\n");
-            break;
-        default:
-            printf("ERROR: %d\n", resp.hdr.hdr.result);
-            break;
-        }
-        goto fail;
+
+    msg.version = PCP_VERSION;
+    msg.opcode = OPCODE_ANNOUNCE_REQUEST;
+    populateAddressFromSockAddr(&localAddr, msg.localAddress);
+
+    InitUdpTransaction(&transaction, sock, nullptr, 0, (char*)&msg, sizeof(msg),
+        &k_PcpRetransmitSchedule, PCP_MAX_DURATION_MS, handleAnnounceResponse, &found);
+    transactions[0] = &transaction;
+    RunUdpTransactions(transactions, 1);
+
+    if (transaction.state == UdpTransactionFailed) {
+        MappingLog("Failed to probe for PCP server on %s: %d\n", serverAddrStr, transaction.error);
     }
-    else if (memcmp(reqMsg.mappingNonce, resp.hdr.mappingNonce, sizeof(reqMsg.mappingNonce))) {
-        printf("PCP mapping nonce mismatch\n");
-        goto fail;
+    else {
+        MappingLog("PCP server probe on %s: %s\n", serverAddrStr, found ? "FOUND" : "NOT FOUND");
     }
-    else if (reqMsg.protocol != resp.hdr.protocol) {
-        printf("PCP protocol mismatch: %d wanted %d\n", resp.hdr.protocol, reqMsg.protocol);
-        goto fail;
+
+Exit:
+    closesocket(sock);
+    return found;
+}
+
+static DWORD WINAPI announceListenerThreadProc(LPVOID context)
+{
+    SOCKET sock = (SOCKET)context;
+
+    for (;;) {
+        union {
+            PCP_RESPONSE_HEADER hdr;
+            char buf[1100];
+        } msg;
+        SOCKADDR_STORAGE sourceAddr;
+        int sourceAddrLen;
+        int recvLen;
+
+        sourceAddrLen = sizeof(sourceAddr);
+        recvLen = recvfrom(sock, msg.buf, sizeof(msg.buf), 0, (struct sockaddr*)&sourceAddr, &sourceAddrLen);
+        if (recvLen == SOCKET_ERROR) {
+            continue;
+        }
+
+        if (recvLen < sizeof(msg.hdr) ||
+                msg.hdr.version != PCP_VERSION ||
+                msg.hdr.opcode != OPCODE_ANNOUNCE_RESPONSE ||
+                msg.hdr.result != 0 ||
+                ((PSOCKADDR_IN)&sourceAddr)->sin_port != htons(PCP_SERVER_PORT)) {
+            continue;
+        }
+
+        LONG64 receiveTime = (LONG64)GetTickCount64();
+
+        // Only servers we've mapped ports with can make us remap
+        char sourceAddrStr[INET6_ADDRSTRLEN];
+        getAddressString(&sourceAddr, sourceAddrStr, sizeof(sourceAddrStr));
+        if (!checkServerEpoch(sourceAddrStr, ntohl(msg.hdr.epoch), true)) {
+            continue;
+        }
+
+        unsigned int delayMs;
+        if (rand_s(&delayMs) != 0) {
+            delayMs = 0;
+        }
+        delayMs %= PCP_ANNOUNCE_MAX_DELAY_MS;
+
+        printf("PCP server %s announced that it lost state (epoch %u). Remapping in %u ms...\n",
+            sourceAddrStr, ntohl(msg.hdr.epoch), delayMs);
+        Sleep(delayMs);
+
+        // If we haven't remapped for an earlier ANNOUNCE yet, time from that one
+        InterlockedCompareExchange64(&s_AnnounceReceiveTime, receiveTime, 0);
+        SetEvent(s_StateLostEvent);
     }
-    else if (reqMsg.internalPort != resp.hdr.internalPort) {
-        printf("PCP internal port mismatch: %d wanted %d\n", htons(resp.hdr.internalPort), htons(reqMsg.internalPort));
-        goto fail;
+
+    closesocket(sock);
+    return 0;
+}
+
+ULONGLONG TakePCPAnnounceReceiveTime()
+{
+    return (ULONGLONG)InterlockedExchange64(&s_AnnounceReceiveTime, 0);
+}
+
+int StartPCPAnnounceListener(HANDLE stateLostEvent)
+{
+    SOCKET sock;
+    SOCKADDR_IN addr;
+    struct ip_mreq mreq;
+    HANDLE thread;
+    int error;
+    BOOL val;
+
+    s_StateLostEvent = stateLostEvent;
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        error = WSAGetLastError();
+        printf("socket() failed: %d\n", error);
+        return error;
     }
-    else if (reqMsg.externalPort != resp.hdr.externalPort) {
-        printf("PCP returned different external port: %d wanted %d\n", htons(resp.hdr.externalPort), htons(reqMsg.externalPort));
-        if (enable) {
-            // Clear the port mapping by modifying and resending the old request (with the same nonce)
-            reqMsg.hdr.lifetime = 0;
-            reqMsg.externalPort = resp.hdr.externalPort;
-            reqMsgLen = sizeof(reqMsg) - sizeof(reqMsg.preferFailureOption);
-            if (send(sock, (char*)&reqMsg, reqMsgLen, 0) == SOCKET_ERROR) {
-                printf("Failed to unmap unexpected external port: %d\n", WSAGetLastError());
-            }
-        }
-        goto fail;
+
+    // Other PCP clients on this machine may want to hear ANNOUNCEs too
+    val = TRUE;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&val, sizeof(val));
+
+    RtlZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PCP_CLIENT_PORT);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        error = WSAGetLastError();
+        printf("bind() failed: %d\n", error);
+        closesocket(sock);
+        return error;
     }
 
-    if (enable) {
-        printf("OK (%d seconds remaining)\n", ntohl(resp.hdr.hdr.lifetime));
+    // Servers multicast ANNOUNCEs to the all-hosts group
+    mreq.imr_multiaddr.S_un.S_addr = inet_addr(PCP_ANNOUNCE_MULTICAST_ADDRESS);
+    mreq.imr_interface.S_un.S_addr = INADDR_ANY;
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) == SOCKET_ERROR) {
+        printf("Failed to join PCP ANNOUNCE multicast group: %d\n", WSAGetLastError());
     }
-    else {
-        printf("DELETED\n");
+
+    thread = CreateThread(NULL, 0, announceListenerThreadProc, (LPVOID)sock, 0, NULL);
+    if (thread == NULL) {
+        error = GetLastError();
+        printf("CreateThread() failed: %d\n", error);
+        closesocket(sock);
+        return error;
     }
 
-    closesocket(sock);
-    return true;
+    CloseHandle(thread);
 
-fail:
-    closesocket(sock);
-    return false;
+    printf("Listening for PCP ANNOUNCEs on UDP %d\n", PCP_CLIENT_PORT);
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,230 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#include <Windows.h>
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "mapper.h"
+#include "lease.h"
+#include "transact.h"
+
+#define NATPMP_SERVER_PORT 5351
+
+#define NATPMP_VERSION 0
+#define OPCODE_MAP_UDP_REQUEST 1
+#define OPCODE_MAP_TCP_REQUEST 2
+#define OPCODE_RESPONSE_FLAG 0x80
+
+// RFC 6886 section 3.1 starts at 250 ms and doubles for up to 9 attempts,
+// which adds up to over 2 minutes. We stop after 5 attempts (7.75 seconds).
+#define NATPMP_INITIAL_TIMEOUT_MS 250
+#define NATPMP_MAX_ATTEMPTS 5
+
+#define NATPMP_MAX_BATCH_SIZE 32
+
+#pragma pack(push, 1)
+
+typedef struct _NATPMP_MAP_REQUEST {
+    unsigned char version;
+    unsigned char opcode;
+    unsigned short reserved;
+    unsigned short internalPort;
+    unsigned short externalPort;
+    unsigned int lifetime;
+} NATPMP_MAP_REQUEST, *PNATPMP_MAP_REQUEST;
+
+typedef struct _NATPMP_MAP_RESPONSE {
+    unsigned char version;
+    unsigned char opcode;
+    unsigned short result;
+    unsigned int epoch;
+    unsigned short internalPort;
+    unsigned short externalPort;
+    unsigned int lifetime;
+} NATPMP_MAP_RESPONSE, *PNATPMP_MAP_RESPONSE;
+
+#pragma pack(pop)
+
+typedef struct _NATPMP_BATCH NATPMP_BATCH, *PNATPMP_BATCH;
+
+typedef struct _NATPMP_PENDING_REQUEST {
+    UDP_TRANSACTION transaction;
+    PNATPMP_BATCH batch;
+    PMAPPING_OP op;
+    NATPMP_MAP_REQUEST msg;
+
+    // We're deleting an unwanted mapping on an alternate external port
+    bool releasing;
+} NATPMP_PENDING_REQUEST, *PNATPMP_PENDING_REQUEST;
+
+struct _NATPMP_BATCH {
+    NATPMP_PENDING_REQUEST requests[NATPMP_MAX_BATCH_SIZE];
+    int requestCount;
+    char gatewayStr[INET_ADDRSTRLEN];
+};
+
+// RFC 6886 section 3.1, except for the number of attempts
+static const UDP_RETRANSMIT_SCHEDULE k_NatPmpRetransmitSchedule = { NATPMP_INITIAL_TIMEOUT_MS, UINT_MAX, NATPMP_MAX_ATTEMPTS, false };
+
+static bool handleMapResponse(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length)
+{
+    PNATPMP_PENDING_REQUEST request = (PNATPMP_PENDING_REQUEST)transaction->context;
+    PNATPMP_MAP_RESPONSE resp = (PNATPMP_MAP_RESPONSE)data;
+    PMAPPING_OP op = request->op;
+
+    // NAT-PMP has no transaction ID, so responses are matched by protocol and internal port
+    if (length < sizeof(*resp) || resp->version != NATPMP_VERSION ||
+            resp->opcode != (request->msg.opcode | OPCODE_RESPONSE_FLAG) ||
+            resp->internalPort != request->msg.internalPort) {
+        return false;
+    }
+
+    SetCurrentMappingOp(op);
+
+    if (request->releasing) {
+        if (resp->result == 0 && resp->lifetime != 0) {
+            // A late duplicate of the response to the original mapping request
+            return true;
+        }
+        else if (resp->result == 0) {
+            MappingLog("OK\n");
+        }
+        else {
+            MappingLog("FAILED %d\n", ntohs(resp->result));
+        }
+
+        // We didn't get the port we wanted either way
+        CompleteUdpTransaction(transaction);
+    }
+    else if (resp->result != 0) {
+        MappingLog("ERROR %d\n", ntohs(resp->result));
+        CompleteUdpTransaction(transaction);
+    }
+    else if (ntohl(resp->lifetime) == 0 && !op->enable) {
+        MappingLog("DELETED\n");
+        RemoveMappingLease("NAT-PMP", request->batch->gatewayStr, op->internalAddress, op->proto, op->port);
+        op->success = true;
+        CompleteUdpTransaction(transaction);
+    }
+    else if (ntohs(resp->externalPort) != op->port) {
+        MappingLog("CONFLICT\n");
+
+        // It couldn't assign us the external port we requested and gave us an alternate external port.
+        // We can't use this alternate mapping, so release it while the other requests carry on.
+        MappingLog("Deleting unwanted NAT-PMP mapping for %s %d...", op->proto == IPPROTO_TCP ? "TCP" : "UDP", ntohs(resp->externalPort));
+        request->msg.externalPort = 0;
+        request->msg.lifetime = 0;
+        request->releasing = true;
+        RestartUdpTransaction(transaction, (char*)&request->msg, sizeof(request->msg));
+    }
+    else {
+        MappingLog("OK (%d seconds remaining)\n", ntohl(resp->lifetime));
+        RecordMappingLease("NAT-PMP", request->batch->gatewayStr, op->internalAddress, op->proto, op->port, ntohl(resp->lifetime));
+        op->success = true;
+        CompleteUdpTransaction(transaction);
+    }
+
+    return true;
+}
+
+static void mapPortBatch(PSOCKADDR_IN gatewayAddr, PMAPPING_OP ops, int opCount)
+{
+    NATPMP_BATCH batch;
+    PUDP_TRANSACTION transactions[NATPMP_MAX_BATCH_SIZE];
+    SOCKET sock;
+
+    assert(opCount <= NATPMP_MAX_BATCH_SIZE);
+
+    batch.requestCount = opCount;
+    inet_ntop(AF_INET, &gatewayAddr->sin_addr, batch.gatewayStr, sizeof(batch.gatewayStr));
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        // Nothing has been logged for these yet
+        for (int i = 0; i < opCount; i++) {
+            SetCurrentMappingOp(&ops[i]);
+            MappingLog("socket() failed: %d\n", WSAGetLastError());
+        }
+        return;
+    }
+
+    for (int i = 0; i < opCount; i++) {
+        PNATPMP_PENDING_REQUEST request = &batch.requests[i];
+        PMAPPING_OP op = &ops[i];
+        unsigned int lifetime;
+
+        assert(op->proto == IPPROTO_TCP || op->proto == IPPROTO_UDP);
+
+        if (!op->enable) {
+            lifetime = 0;
+        }
+        else if (op->indefinite) {
+            lifetime = 604800; // 1 week
+        }
+        else {
+            lifetime = 3600;
+        }
+
+        request->batch = &batch;
+        request->op = op;
+        request->msg = {};
+        request->msg.version = NATPMP_VERSION;
+        request->msg.opcode = op->proto == IPPROTO_TCP ? OPCODE_MAP_TCP_REQUEST : OPCODE_MAP_UDP_REQUEST;
+        request->msg.internalPort = htons(op->port);
+        request->msg.externalPort = htons(op->enable ? op->port : 0);
+        request->msg.lifetime = htonl(lifetime);
+        request->releasing = false;
+
+        InitUdpTransaction(&request->transaction, sock, nullptr, 0,
+            (char*)&request->msg, sizeof(request->msg), &k_NatPmpRetransmitSchedule, 0,
+            handleMapResponse, request);
+        transactions[i] = &request->transaction;
+
+        SetCurrentMappingOp(op);
+        MappingLog("Updating NAT-PMP port mapping for %s %d...", op->proto == IPPROTO_TCP ? "TCP" : "UDP", op->port);
+    }
+
+    // Connecting ensures we only see responses from the gateway
+    gatewayAddr->sin_port = htons(NATPMP_SERVER_PORT);
+    if (connect(sock, (struct sockaddr*)gatewayAddr, sizeof(*gatewayAddr)) == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        for (int i = 0; i < opCount; i++) {
+            SetCurrentMappingOp(&ops[i]);
+            MappingLog("connect() failed: %d\n", error);
+        }
+        closesocket(sock);
+        return;
+    }
+
+    // All requests go out at once and responses are matched up by protocol and port
+    RunUdpTransactions(transactions, opCount);
+
+    for (int i = 0; i < opCount; i++) {
+        PNATPMP_PENDING_REQUEST request = &batch.requests[i];
+
+        SetCurrentMappingOp(request->op);
+        if (request->transaction.state == UdpTransactionTimedOut) {
+            MappingLog(request->releasing ? "FAILED (no response)\n" : "NO RESPONSE\n");
+        }
+        else if (request->transaction.state == UdpTransactionFailed) {
+            MappingLog("Failed to exchange NAT-PMP messages: %d\n", request->transaction.error);
+        }
+    }
+
+    closesocket(sock);
+}
+
+void NATPMPMapPorts(PSOCKADDR_IN gatewayAddr, PMAPPING_OP ops, int opCount)
+{
+    // Split very large sets into batches that fit on the stack
+    for (int i = 0; i < opCount; i += NATPMP_MAX_BATCH_SIZE) {
+        mapPortBatch(gatewayAddr, &ops[i], min(opCount - i, NATPMP_MAX_BATCH_SIZE));
+    }
+
+    SetCurrentMappingOp(nullptr);
+}
@@ -0,0 +1,177 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <WinSock2.h>
+
+#include <stdio.h>
+
+#include "reconcile.h"
+#include "mapper.h"
+
+#define MAX_MAPPING_STATES 128
+
+typedef struct _MAPPING_STATE {
+    bool inUse;
+    char method[16];
+    char gateway[128];
+    char internalAddress[46]; // INET6_ADDRSTRLEN
+    int proto;
+    int port;
+
+    OBSERVED_MAPPING observed;
+    MAPPING_ACTION lastAction;
+    char lastReason[96];
+    ULONGLONG lastActionTime;
+} MAPPING_STATE, *PMAPPING_STATE;
+
+static const char* k_ActionNames[MappingActionMax] = {
+    "unchanged",
+    "added",
+    "renewed",
+    "replaced",
+    "deleted",
+};
+
+static SRWLOCK s_StateLock = SRWLOCK_INIT;
+static MAPPING_STATE s_States[MAX_MAPPING_STATES];
+static int s_ActionCounts[MappingActionMax];
+
+MAPPING_ACTION PlanMappingAction(POBSERVED_MAPPING observed, bool desired, const char* desiredClient,
+    unsigned int renewThreshold, char* reason, int reasonSize)
+{
+    if (!desired) {
+        if (observed->present && !strcmp(observed->internalClient, desiredClient)) {
+            snprintf(reason, reasonSize, "no longer wanted");
+            return MappingActionDelete;
+        }
+        else if (observed->present) {
+            // Don't disturb another PC's port forwarding
+            snprintf(reason, reasonSize, "owned by %s", observed->internalClient);
+            return MappingActionNone;
+        }
+        else {
+            snprintf(reason, reasonSize, "not present");
+            return MappingActionNone;
+        }
+    }
+    else if (observed->lookupFailed) {
+        snprintf(reason, reasonSize, "existing entry unknown");
+        return MappingActionAdd;
+    }
+    else if (!observed->present) {
+        snprintf(reason, reasonSize, "not present");
+        return MappingActionAdd;
+    }
+    else if (strcmp(observed->internalClient, desiredClient)) {
+        snprintf(reason, reasonSize, "conflicts with %s", observed->internalClient);
+        return MappingActionReplace;
+    }
+    else if (observed->leaseRemaining == 0) {
+        snprintf(reason, reasonSize, "static entry present");
+        return MappingActionNone;
+    }
+    else if (observed->leaseRemaining > renewThreshold) {
+        snprintf(reason, reasonSize, "%u seconds remaining", observed->leaseRemaining);
+        return MappingActionNone;
+    }
+    else {
+        snprintf(reason, reasonSize, "only %u seconds remaining", observed->leaseRemaining);
+        return MappingActionRenew;
+    }
+}
+
+static PMAPPING_STATE FindMappingState(const char* method, const char* gateway, const char* internalAddress, int proto, int port)
+{
+    PMAPPING_STATE freeState = nullptr;
+
+    for (int i = 0; i < MAX_MAPPING_STATES; i++) {
+        PMAPPING_STATE state = &s_States[i];
+        if (!state->inUse) {
+            if (freeState == nullptr) {
+                freeState = state;
+            }
+        }
+        else if (state->proto == proto && state->port == port &&
+                !strcmp(state->method, method) && !strcmp(state->gateway, gateway) &&
+                !strcmp(state->internalAddress, internalAddress)) {
+            return state;
+        }
+    }
+
+    if (freeState == nullptr) {
+        // Full, so forget the oldest one
+        freeState = &s_States[0];
+        for (int i = 1; i < MAX_MAPPING_STATES; i++) {
+            if (s_States[i].lastActionTime < freeState->lastActionTime) {
+                freeState = &s_States[i];
+            }
+        }
+    }
+
+    RtlZeroMemory(freeState, sizeof(*freeState));
+    strncpy(freeState->method, method, sizeof(freeState->method) - 1);
+    strncpy(freeState->gateway, gateway, sizeof(freeState->gateway) - 1);
+    strncpy(freeState->internalAddress, internalAddress, sizeof(freeState->internalAddress) - 1);
+    freeState->proto = proto;
+    freeState->port = port;
+    freeState->lastAction = MappingActionMax;
+    return freeState;
+}
+
+void RecordMappingAction(const char* method, const char* gateway, const char* internalAddress, int proto, int port,
+    POBSERVED_MAPPING observed, MAPPING_ACTION action, const char* reason)
+{
+    if (internalAddress == nullptr) {
+        internalAddress = "";
+    }
+
+    AcquireSRWLockExclusive(&s_StateLock);
+
+    PMAPPING_STATE state = FindMappingState(method, gateway, internalAddress, proto, port);
+
+    // If we left the entry in place last time, it should still be there. If not,
+    // the router probably rebooted or something else removed it.
+    if (state->inUse && state->lastAction != MappingActionDelete &&
+            state->observed.present && !observed->present && !observed->lookupFailed) {
+        MappingLog("%s mapping for %s %d on %s disappeared since the last check\n",
+            method, proto == IPPROTO_TCP ? "TCP" : "UDP", port, gateway);
+    }
+
+    state->inUse = true;
+    state->observed = *observed;
+    state->lastAction = action;
+    strncpy(state->lastReason, reason, sizeof(state->lastReason) - 1);
+    state->lastReason[sizeof(state->lastReason) - 1] = 0;
+    state->lastActionTime = GetTickCount64();
+
+    // Reflect the effect of our action so the next check has the right expectation
+    if (action == MappingActionDelete) {
+        state->observed.present = false;
+    }
+    else if (action != MappingActionNone) {
+        state->observed.present = true;
+    }
+
+    s_ActionCounts[action]++;
+
+    ReleaseSRWLockExclusive(&s_StateLock);
+}
+
+void PrintMappingActionSummary()
+{
+    char summary[256];
+    int offset = 0;
+
+    AcquireSRWLockExclusive(&s_StateLock);
+
+    for (int i = 0; i < MappingActionMax; i++) {
+        offset += snprintf(&summary[offset], sizeof(summary) - offset, "%s%d %s",
+            i == 0 ? "" : ", ", s_ActionCounts[i], k_ActionNames[i]);
+        s_ActionCounts[i] = 0;
+    }
+
+    ReleaseSRWLockExclusive(&s_StateLock);
+
+    printf("Port mapping changes this cycle: %s\n", summary);
+}
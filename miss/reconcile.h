@@ -0,0 +1,31 @@
+#pragma once
+
+typedef enum _MAPPING_ACTION {
+    MappingActionNone,
+    MappingActionAdd,
+    MappingActionRenew,
+    MappingActionReplace,
+    MappingActionDelete,
+    MappingActionMax
+} MAPPING_ACTION;
+
+// What we found on the router for a mapping
+typedef struct _OBSERVED_MAPPING {
+    bool present;
+    bool lookupFailed; // We couldn't tell whether the entry exists
+    char internalClient[16];
+    int internalPort;
+    unsigned int leaseRemaining; // 0 for a static entry
+} OBSERVED_MAPPING, *POBSERVED_MAPPING;
+
+// Computes the action needed to take the observed router state to the desired state
+MAPPING_ACTION PlanMappingAction(POBSERVED_MAPPING observed, bool desired, const char* desiredClient,
+    unsigned int renewThreshold, char* reason, int reasonSize);
+
+// Remembers what we observed for a mapping and what we did about it. The internal
+// address may be null if the protocol doesn't need one to tell mappings apart.
+void RecordMappingAction(const char* method, const char* gateway, const char* internalAddress, int proto, int port,
+    POBSERVED_MAPPING observed, MAPPING_ACTION action, const char* reason);
+
+// Prints the actions taken since the last summary
+void PrintMappingActionSummary();
@@ -8,12 +8,366 @@
 #include <Ws2ipdef.h>
 
 #include "relay.h"
+#include "streaming.h"
+
+// A relay returns to idle mode if it hasn't seen traffic for this long
+// and GameStream is no longer streaming.
+#define RELAY_IDLE_TIMEOUT_MS 5000
+
+#define RELAY_IDLE_BUFFER_SIZE 8192
+#define RELAY_STREAMING_BUFFER_SIZE (512 * 1024)
+
+#define RELAY_CONFIG_KEY "Software\\Moonlight Internet Streaming Service"
+
+// Audio packets can optionally be sent twice to ride out random loss on the path to the client
+#define RELAY_AUDIO_PORT 48000
+#define RELAY_DEFAULT_DUPLICATION_GAP_US 200
+#define RELAY_MAX_DUPLICATION_GAP_US 999
+#define RELAY_DUPLICATE_QUEUE_SIZE 32
+#define RELAY_MAX_DUPLICATE_SIZE 1500
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+static_assert(sizeof(RELAY_ECHO_PROBE) == sizeof(RELAY_ECHO_REPLY), "Echo probe and reply must be the same length");
+
+typedef enum _RELAY_MODE {
+    RelayModeIdle,
+    RelayModeStreaming
+} RELAY_MODE;
+
+// A copy of a packet waiting for the duplication gap to pass
+typedef struct _DUPLICATE_PACKET {
+    LARGE_INTEGER dueTime;
+    SOCKADDR_IN destination;
+    int length;
+    char data[RELAY_MAX_DUPLICATE_SIZE];
+} DUPLICATE_PACKET, *PDUPLICATE_PACKET;
 
 typedef struct _UDP_TUPLE {
     SOCKET socket;
     unsigned short port;
+    int index;
+    RELAY_MODE mode;
+    DWORD_PTR idleAffinityMask;
+    LARGE_INTEGER modeChangeTime;
+
+    bool duplicateRemotePackets;
+    ULONGLONG remotePackets;
+
+    // Duplicates are sent by their own thread, so the relay never waits out the gap
+    SRWLOCK duplicateLock;
+    HANDLE duplicateEvent;
+    DUPLICATE_PACKET duplicateQueue[RELAY_DUPLICATE_QUEUE_SIZE];
+    int duplicateHead;
+    int duplicateCount;
+    volatile LONG64 duplicatePackets;
+    volatile LONG64 duplicateBytes;
+    volatile LONG64 duplicateFailures;
 } UDP_TUPLE, *PUDP_TUPLE;
 
+static LARGE_INTEGER s_QpcFrequency;
+static DWORD s_BusyPollUs;
+static bool s_PinCores;
+static bool s_DuplicateAudio;
+static DWORD s_DuplicationGapUs;
+static LONG s_RelayCount;
+static volatile LONG s_StreamingRelayCount;
+static ULONGLONG s_SessionStartTime;
+
+static DWORD GetRelayConfigValue(const char* name, DWORD defaultValue)
+{
+    HKEY key;
+    DWORD value;
+    DWORD len;
+
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, RELAY_CONFIG_KEY, 0, KEY_READ | KEY_WOW64_64KEY, &key) != ERROR_SUCCESS) {
+        return defaultValue;
+    }
+
+    len = sizeof(value);
+    if (RegQueryValueExA(key, name, nullptr, nullptr, (LPBYTE)&value, &len) != ERROR_SUCCESS) {
+        value = defaultValue;
+    }
+
+    RegCloseKey(key);
+    return value;
+}
+
+static LONGLONG QpcToUs(LONGLONG qpcDelta)
+{
+    return (qpcDelta * 1000000) / s_QpcFrequency.QuadPart;
+}
+
+static void SetRelaySocketBuffers(SOCKET sock, int size)
+{
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)&size, sizeof(size));
+}
+
+static DWORD_PTR GetRelayCoreMask(int index)
+{
+    DWORD_PTR processMask, systemMask;
+    int coreCount = 0;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        return 0;
+    }
+
+    for (DWORD_PTR mask = processMask; mask != 0; mask &= mask - 1) {
+        coreCount++;
+    }
+
+    // Don't bother pinning on single core systems
+    if (coreCount <= 1) {
+        return 0;
+    }
+
+    // Hand out cores starting from the highest numbered one, since core 0
+    // tends to be the busiest with interrupts and the game's main thread.
+    int target = index % coreCount;
+    for (int bit = sizeof(DWORD_PTR) * 8 - 1; bit >= 0; bit--) {
+        DWORD_PTR coreMask = (DWORD_PTR)1 << bit;
+        if (processMask & coreMask) {
+            if (target-- == 0) {
+                return coreMask;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void EnterStreamingMode(PUDP_TUPLE tuple, PLARGE_INTEGER packetTime)
+{
+    LARGE_INTEGER startTime, endTime;
+
+    QueryPerformanceCounter(&startTime);
+
+    // Ensure the relay threads aren't preempted by games or other CPU intensive activity
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+    SetRelaySocketBuffers(tuple->socket, RELAY_STREAMING_BUFFER_SIZE);
+
+    if (s_PinCores) {
+        DWORD_PTR coreMask = GetRelayCoreMask(tuple->index);
+        if (coreMask != 0) {
+            tuple->idleAffinityMask = SetThreadAffinityMask(GetCurrentThread(), coreMask);
+        }
+    }
+
+    if (s_BusyPollUs != 0) {
+        // We'll spin on the non-blocking socket and fall back to select() when idle
+        u_long mode = 1;
+        ioctlsocket(tuple->socket, FIONBIO, &mode);
+    }
+    else {
+        // Wake up periodically to check if the stream has ended
+        DWORD timeout = RELAY_IDLE_TIMEOUT_MS;
+        setsockopt(tuple->socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    }
+
+    tuple->mode = RelayModeStreaming;
+
+    QueryPerformanceCounter(&endTime);
+    tuple->modeChangeTime = endTime;
+
+    if (InterlockedIncrement(&s_StreamingRelayCount) == 1) {
+        s_SessionStartTime = GetTickCount64();
+        printf("Streaming session detected by UDP relay %d\n", tuple->port);
+    }
+
+    printf("UDP relay %d entered streaming mode in %lld us (%lld us after first packet)\n",
+        tuple->port,
+        QpcToUs(endTime.QuadPart - startTime.QuadPart),
+        QpcToUs(endTime.QuadPart - packetTime->QuadPart));
+}
+
+static void EnterIdleMode(PUDP_TUPLE tuple)
+{
+    LARGE_INTEGER startTime, endTime;
+
+    QueryPerformanceCounter(&startTime);
+
+    if (s_BusyPollUs != 0) {
+        u_long mode = 0;
+        ioctlsocket(tuple->socket, FIONBIO, &mode);
+    }
+
+    // Block indefinitely until the next stream begins
+    DWORD timeout = 0;
+    setsockopt(tuple->socket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+    if (tuple->idleAffinityMask != 0) {
+        SetThreadAffinityMask(GetCurrentThread(), tuple->idleAffinityMask);
+        tuple->idleAffinityMask = 0;
+    }
+
+    SetRelaySocketBuffers(tuple->socket, RELAY_IDLE_BUFFER_SIZE);
+
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+
+    tuple->mode = RelayModeIdle;
+
+    QueryPerformanceCounter(&endTime);
+
+    printf("UDP relay %d returned to idle mode in %lld us after %lld ms of streaming\n",
+        tuple->port,
+        QpcToUs(endTime.QuadPart - startTime.QuadPart),
+        QpcToUs(startTime.QuadPart - tuple->modeChangeTime.QuadPart) / 1000);
+
+    tuple->modeChangeTime = endTime;
+
+    if (tuple->duplicateRemotePackets) {
+        printf("UDP relay %d duplicated %lld of %llu packets to the client (%lld bytes extra, %lld failed)\n",
+            tuple->port, InterlockedExchange64(&tuple->duplicatePackets, 0), tuple->remotePackets,
+            InterlockedExchange64(&tuple->duplicateBytes, 0), InterlockedExchange64(&tuple->duplicateFailures, 0));
+    }
+
+    tuple->remotePackets = 0;
+
+    if (InterlockedDecrement(&s_StreamingRelayCount) == 0) {
+        printf("Streaming session ended after %llu seconds\n",
+            (GetTickCount64() - s_SessionStartTime) / 1000);
+    }
+}
+
+static int RelayReceive(PUDP_TUPLE tuple, char* buffer, int bufferLen, PSOCKADDR_IN sourceAddr, int* sourceAddrLen)
+{
+    if (tuple->mode == RelayModeStreaming && s_BusyPollUs != 0) {
+        LARGE_INTEGER startTime, currentTime;
+        int recvLen;
+
+        // Spin for a short while to avoid the wakeup latency of a blocking wait
+        QueryPerformanceCounter(&startTime);
+        do {
+            recvLen = recvfrom(tuple->socket, buffer, bufferLen, 0, (PSOCKADDR)sourceAddr, sourceAddrLen);
+            if (recvLen != SOCKET_ERROR || WSAGetLastError() != WSAEWOULDBLOCK) {
+                return recvLen;
+            }
+
+            YieldProcessor();
+            QueryPerformanceCounter(&currentTime);
+        } while (QpcToUs(currentTime.QuadPart - startTime.QuadPart) < s_BusyPollUs);
+
+        // Nothing arrived while spinning, so block until traffic arrives or the idle timeout expires
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(tuple->socket, &fds);
+
+        struct timeval tv;
+        tv.tv_sec = RELAY_IDLE_TIMEOUT_MS / 1000;
+        tv.tv_usec = (RELAY_IDLE_TIMEOUT_MS % 1000) * 1000;
+
+        int selectRes = select(0, &fds, nullptr, nullptr, &tv);
+        if (selectRes == 0) {
+            WSASetLastError(WSAETIMEDOUT);
+            return SOCKET_ERROR;
+        }
+        else if (selectRes == SOCKET_ERROR) {
+            return SOCKET_ERROR;
+        }
+    }
+
+    return recvfrom(tuple->socket, buffer, bufferLen, 0, (PSOCKADDR)sourceAddr, sourceAddrLen);
+}
+
+static void QueueDuplicatePacket(PUDP_TUPLE tuple, char* buffer, int len, PSOCKADDR_IN destinationAddr)
+{
+    bool queued = false;
+
+    if (len <= RELAY_MAX_DUPLICATE_SIZE) {
+        AcquireSRWLockExclusive(&tuple->duplicateLock);
+        if (tuple->duplicateCount < RELAY_DUPLICATE_QUEUE_SIZE) {
+            PDUPLICATE_PACKET packet = &tuple->duplicateQueue[(tuple->duplicateHead + tuple->duplicateCount) % RELAY_DUPLICATE_QUEUE_SIZE];
+
+            QueryPerformanceCounter(&packet->dueTime);
+            packet->dueTime.QuadPart += (s_DuplicationGapUs * s_QpcFrequency.QuadPart) / 1000000;
+            packet->destination = *destinationAddr;
+            packet->length = len;
+            RtlCopyMemory(packet->data, buffer, len);
+
+            tuple->duplicateCount++;
+            queued = true;
+        }
+        ReleaseSRWLockExclusive(&tuple->duplicateLock);
+    }
+
+    if (queued) {
+        SetEvent(tuple->duplicateEvent);
+    }
+    else {
+        // Never hold up the relay for a duplicate
+        InterlockedIncrement64(&tuple->duplicateFailures);
+    }
+}
+
+DWORD
+WINAPI
+UdpDuplicateThreadProc(LPVOID Context)
+{
+    PUDP_TUPLE tuple = (PUDP_TUPLE)Context;
+    DUPLICATE_PACKET packet;
+
+    // The gap is well under the default timer resolution, so ask for a high resolution
+    // timer. Older versions of Windows don't have them, so the gap will be longer there.
+    HANDLE timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (timer == nullptr) {
+        timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    }
+    if (timer == nullptr) {
+        printf("CreateWaitableTimerExW() failed: %d\n", GetLastError());
+        return 0;
+    }
+
+    // Duplicates only flow while streaming, so this doesn't compete with anything when idle
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+    for (;;) {
+        bool havePacket = false;
+
+        AcquireSRWLockExclusive(&tuple->duplicateLock);
+        if (tuple->duplicateCount != 0) {
+            packet = tuple->duplicateQueue[tuple->duplicateHead];
+            tuple->duplicateHead = (tuple->duplicateHead + 1) % RELAY_DUPLICATE_QUEUE_SIZE;
+            tuple->duplicateCount--;
+            havePacket = true;
+        }
+        ReleaseSRWLockExclusive(&tuple->duplicateLock);
+
+        if (!havePacket) {
+            WaitForSingleObject(tuple->duplicateEvent, INFINITE);
+            continue;
+        }
+
+        // Space the copies out slightly so a short burst of loss doesn't take out both
+        LARGE_INTEGER currentTime;
+        QueryPerformanceCounter(&currentTime);
+        if (packet.dueTime.QuadPart > currentTime.QuadPart) {
+            LARGE_INTEGER dueTime;
+
+            // Negative times are relative, in 100 ns units
+            dueTime.QuadPart = -((packet.dueTime.QuadPart - currentTime.QuadPart) * 10000000 / s_QpcFrequency.QuadPart);
+            if (dueTime.QuadPart != 0 && SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE)) {
+                WaitForSingleObject(timer, INFINITE);
+            }
+        }
+
+        // The client discards the copy with the repeated RTP sequence number
+        if (sendto(tuple->socket, packet.data, packet.length, 0, (PSOCKADDR)&packet.destination, sizeof(packet.destination)) == SOCKET_ERROR) {
+            InterlockedIncrement64(&tuple->duplicateFailures);
+        }
+        else {
+            InterlockedIncrement64(&tuple->duplicatePackets);
+            InterlockedExchangeAdd64(&tuple->duplicateBytes, packet.length);
+        }
+    }
+
+    CloseHandle(timer);
+    return 0;
+}
+
 DWORD
 WINAPI
 UdpRelayThreadProc(LPVOID Context)
@@ -22,9 +376,6 @@ UdpRelayThreadProc(LPVOID Context)
     USHORT nboPort = htons(tuple->port);
     SOCKADDR_IN lastRemoteAddr;
 
-    // Ensure the relay threads aren't preempted by games or other CPU intensive activity
-    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-
     RtlZeroMemory(&lastRemoteAddr, sizeof(lastRemoteAddr));
 
     for (;;) {
@@ -34,15 +385,37 @@ UdpRelayThreadProc(LPVOID Context)
         int recvLen;
 
         sourceAddrLen = sizeof(sourceAddr);
-        recvLen = recvfrom(tuple->socket, buffer, sizeof(buffer), 0, (PSOCKADDR)&sourceAddr, &sourceAddrLen);
+        recvLen = RelayReceive(tuple, buffer, sizeof(buffer), &sourceAddr, &sourceAddrLen);
         if (recvLen == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAETIMEDOUT && tuple->mode == RelayModeStreaming) {
+                // Traffic stopped. Drop back to idle mode unless GameStream is still running.
+                if (!IsCurrentlyStreaming()) {
+                    EnterIdleMode(tuple);
+                }
+            }
+            continue;
+        }
+
+        // Answer echo probes ourselves. These shouldn't wake the relay up either.
+        if (recvLen >= sizeof(RELAY_ECHO_PROBE) - 1 && RtlEqualMemory(buffer, RELAY_ECHO_PROBE, sizeof(RELAY_ECHO_PROBE) - 1)) {
+            RtlCopyMemory(buffer, RELAY_ECHO_REPLY, sizeof(RELAY_ECHO_REPLY) - 1);
+            sendto(tuple->socket, buffer, recvLen, 0, (PSOCKADDR)&sourceAddr, sourceAddrLen);
             continue;
         }
-        
+
+        if (tuple->mode == RelayModeIdle) {
+            // Switch to streaming mode before we forward the first packet
+            LARGE_INTEGER packetTime;
+            QueryPerformanceCounter(&packetTime);
+            EnterStreamingMode(tuple, &packetTime);
+        }
+
         SOCKADDR_IN destinationAddr;
+        bool remoteBound;
         if (RtlEqualMemory(&sourceAddr.sin_addr, &in4addr_loopback, sizeof(sourceAddr.sin_addr)) && sourceAddr.sin_port == nboPort) {
             // Traffic incoming from loopback interface - send it to the last remote address
             destinationAddr = lastRemoteAddr;
+            remoteBound = true;
         }
         else {
             // Traffic incoming from the remote host - remember the source
@@ -52,9 +425,17 @@ UdpRelayThreadProc(LPVOID Context)
             destinationAddr = sourceAddr;
             destinationAddr.sin_addr = in4addr_loopback;
             destinationAddr.sin_port = nboPort;
+            remoteBound = false;
         }
 
         sendto(tuple->socket, buffer, recvLen, 0, (PSOCKADDR)&destinationAddr, sizeof(destinationAddr));
+
+        if (remoteBound) {
+            tuple->remotePackets++;
+            if (tuple->duplicateRemotePackets) {
+                QueueDuplicatePacket(tuple, buffer, recvLen, &destinationAddr);
+            }
+        }
     }
 
     closesocket(tuple->socket);
@@ -70,6 +451,28 @@ int StartUdpRelay(unsigned short Port)
     PUDP_TUPLE tuple;
     int error;
 
+    if (s_QpcFrequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&s_QpcFrequency);
+
+        // Busy polling burns a core while streaming, so it's opt-in
+        s_BusyPollUs = GetRelayConfigValue("RelayBusyPollUs", 0);
+        s_PinCores = GetRelayConfigValue("RelayPinCores", 1) != 0;
+
+        printf("UDP relay streaming mode: busy-poll %u us, core pinning %s\n",
+            s_BusyPollUs, s_PinCores ? "on" : "off");
+
+        // Audio duplication trades a little bandwidth for fewer audible dropouts on lossy links
+        s_DuplicateAudio = GetRelayConfigValue("RelayDuplicateAudio", 0) != 0;
+        s_DuplicationGapUs = GetRelayConfigValue("RelayDuplicationGapUs", RELAY_DEFAULT_DUPLICATION_GAP_US);
+        if (s_DuplicationGapUs > RELAY_MAX_DUPLICATION_GAP_US) {
+            s_DuplicationGapUs = RELAY_MAX_DUPLICATION_GAP_US;
+        }
+
+        if (s_DuplicateAudio) {
+            printf("UDP relay audio duplication enabled with %u us gap\n", s_DuplicationGapUs);
+        }
+    }
+
     sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock == INVALID_SOCKET) {
         error = WSAGetLastError();
@@ -88,13 +491,33 @@ int StartUdpRelay(unsigned short Port)
         return error;
     }
 
+    // Relays start in idle mode until the first packet arrives
+    SetRelaySocketBuffers(sock, RELAY_IDLE_BUFFER_SIZE);
+
     tuple = (PUDP_TUPLE)malloc(sizeof(*tuple));
     if (tuple == NULL) {
         return ERROR_OUTOFMEMORY;
     }
 
+    RtlZeroMemory(tuple, sizeof(*tuple));
     tuple->socket = sock;
     tuple->port = Port;
+    tuple->index = s_RelayCount++;
+    tuple->mode = RelayModeIdle;
+    tuple->duplicateRemotePackets = s_DuplicateAudio && Port == RELAY_AUDIO_PORT;
+    InitializeSRWLock(&tuple->duplicateLock);
+
+    if (tuple->duplicateRemotePackets) {
+        tuple->duplicateEvent = CreateEvent(nullptr, false, false, nullptr);
+        thread = tuple->duplicateEvent != nullptr ? CreateThread(NULL, 0, UdpDuplicateThreadProc, tuple, 0, NULL) : NULL;
+        if (thread == NULL) {
+            printf("Unable to start audio duplication for UDP relay %d: %d\n", Port, GetLastError());
+            tuple->duplicateRemotePackets = false;
+        }
+        else {
+            CloseHandle(thread);
+        }
+    }
 
     thread = CreateThread(NULL, 0, UdpRelayThreadProc, tuple, 0, NULL);
     if (thread == NULL) {
@@ -107,4 +530,9 @@ int StartUdpRelay(unsigned short Port)
     CloseHandle(thread);
 
     return 0;
+}
+
+bool IsRelayDuplicating(unsigned short Port)
+{
+    return s_DuplicateAudio && Port == RELAY_AUDIO_PORT;
 }
\ No newline at end of file
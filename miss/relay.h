@@ -2,4 +2,14 @@
 
 #define RELAY_PORT_OFFSET -10000
 
-int StartUdpRelay(unsigned short Port);
\ No newline at end of file
+// UDP packets starting with the probe string are echoed back to the sender with the
+// probe string replaced by the reply string instead of being relayed. MIST uses this
+// to test ports that GFE already has bound. Both strings must be the same length.
+#define RELAY_ECHO_PROBE "moonlight-echo-req"
+#define RELAY_ECHO_REPLY "moonlight-echo-rsp"
+
+int StartUdpRelay(unsigned short Port);
+
+// Returns true if the relay for this port sends extra copies of packets to the client.
+// That only works while traffic goes through the relay.
+bool IsRelayDuplicating(unsigned short Port);
\ No newline at end of file
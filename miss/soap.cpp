@@ -0,0 +1,671 @@
+#define _CRT_SECURE_NO_WARNINGS
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MINIUPNP_STATICLIB
+#include <miniupnpc/upnpcommands.h>
+
+#include "soap.h"
+#include "..\version.h"
+
+#define SOAP_MAX_CONNECTIONS 16
+#define SOAP_MAX_URL_LENGTH 256
+#define SOAP_IDLE_TIMEOUT_MS 10000
+#define SOAP_IO_TIMEOUT_MS 3000
+#define SOAP_REQUEST_SIZE 2048
+#define SOAP_RESPONSE_SIZE 8192
+
+// Returned by SoapCall() when we can't send the request ourselves, so nothing has reached
+// the IGD and it's safe to fall back to miniupnpc
+#define SOAP_TRANSPORT_ERROR -1
+
+// Returned by SoapCall() when the exchange with the IGD failed. The IGD may have acted on
+// the request, so it must not be sent again.
+#define SOAP_NETWORK_ERROR -2
+
+typedef struct _SOAP_CONNECTION {
+    // Empty if this slot has no connection
+    char controlURL[SOAP_MAX_URL_LENGTH];
+    SOCKET socket;
+    bool inUse;
+    ULONGLONG lastUseTime;
+} SOAP_CONNECTION, *PSOAP_CONNECTION;
+
+static SRWLOCK s_ConnectionLock = SRWLOCK_INIT;
+static SOAP_CONNECTION s_Connections[SOAP_MAX_CONNECTIONS];
+
+static const char k_RequestTemplate[] =
+    "POST %s HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: MISS/" VER_VERSION_STR " UPnP/1.1\r\n"
+    "Content-Length: %d\r\n"
+    "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+    "SOAPAction: \"%s#%s\"\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "%s";
+
+static const char k_EnvelopeTemplate[] =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+    "<s:Body><u:%s xmlns:u=\"%s\">%s</u:%s></s:Body></s:Envelope>\r\n";
+
+static const char k_GetSpecificPortMappingEntryArgs[] =
+    "<NewRemoteHost></NewRemoteHost>"
+    "<NewExternalPort>%s</NewExternalPort>"
+    "<NewProtocol>%s</NewProtocol>";
+
+static const char k_AddPortMappingArgs[] =
+    "<NewRemoteHost></NewRemoteHost>"
+    "<NewExternalPort>%s</NewExternalPort>"
+    "<NewProtocol>%s</NewProtocol>"
+    "<NewInternalPort>%s</NewInternalPort>"
+    "<NewInternalClient>%s</NewInternalClient>"
+    "<NewEnabled>1</NewEnabled>"
+    "<NewPortMappingDescription>%s</NewPortMappingDescription>"
+    "<NewLeaseDuration>%s</NewLeaseDuration>";
+
+static const char k_DeletePortMappingArgs[] =
+    "<NewRemoteHost></NewRemoteHost>"
+    "<NewExternalPort>%s</NewExternalPort>"
+    "<NewProtocol>%s</NewProtocol>";
+
+// Splits an http:// URL into the authority (for the Host header and connecting) and the path
+static bool ParseControlURL(const char* url, char* host, int hostSize, char* port, int portSize, char* authority, int authoritySize, const char** path)
+{
+    const char* hostStart;
+    const char* hostEnd;
+    const char* portStart;
+    const char* authorityEnd;
+
+    if (_strnicmp(url, "http://", 7) != 0) {
+        return false;
+    }
+
+    hostStart = url + 7;
+    authorityEnd = hostStart + strcspn(hostStart, "/");
+
+    if (*hostStart == '[') {
+        // IPv6 literal
+        hostStart++;
+        hostEnd = strchr(hostStart, ']');
+        if (hostEnd == nullptr || hostEnd > authorityEnd) {
+            return false;
+        }
+        portStart = hostEnd + 1;
+    }
+    else {
+        hostEnd = hostStart + strcspn(hostStart, ":/");
+        portStart = hostEnd;
+    }
+
+    if (hostEnd == hostStart || hostEnd - hostStart >= hostSize || authorityEnd - (url + 7) >= authoritySize) {
+        return false;
+    }
+
+    memcpy(host, hostStart, hostEnd - hostStart);
+    host[hostEnd - hostStart] = 0;
+
+    memcpy(authority, url + 7, authorityEnd - (url + 7));
+    authority[authorityEnd - (url + 7)] = 0;
+
+    if (*portStart == ':') {
+        portStart++;
+        if (authorityEnd - portStart == 0 || authorityEnd - portStart >= portSize) {
+            return false;
+        }
+        memcpy(port, portStart, authorityEnd - portStart);
+        port[authorityEnd - portStart] = 0;
+    }
+    else {
+        strcpy(port, "80");
+    }
+
+    *path = *authorityEnd != 0 ? authorityEnd : "/";
+    return true;
+}
+
+static SOCKET SoapConnect(const char* host, const char* port)
+{
+    struct addrinfo hints = {};
+    struct addrinfo* result;
+    SOCKET sock = INVALID_SOCKET;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        // Not a literal address, so we'll need to resolve it
+        hints.ai_flags = 0;
+        if (getaddrinfo(host, port, &hints, &result) != 0) {
+            return INVALID_SOCKET;
+        }
+    }
+
+    for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+
+        // Connect without blocking so we can bound the time spent on an unresponsive IGD
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+        if (connect(sock, ai->ai_addr, (int)ai->ai_addrlen) == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            fd_set writeFds, exceptFds;
+            struct timeval timeout;
+
+            FD_ZERO(&writeFds);
+            FD_SET(sock, &writeFds);
+            FD_ZERO(&exceptFds);
+            FD_SET(sock, &exceptFds);
+
+            timeout.tv_sec = SOAP_IO_TIMEOUT_MS / 1000;
+            timeout.tv_usec = (SOAP_IO_TIMEOUT_MS % 1000) * 1000;
+
+            if (select(0, nullptr, &writeFds, &exceptFds, &timeout) != 1 || !FD_ISSET(sock, &writeFds)) {
+                closesocket(sock);
+                sock = INVALID_SOCKET;
+                continue;
+            }
+        }
+
+        nonBlocking = 0;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+        DWORD timeoutMs = SOAP_IO_TIMEOUT_MS;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+
+        DWORD noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+        break;
+    }
+
+    freeaddrinfo(result);
+    return sock;
+}
+
+// Returns an idle connection to the control URL if we have one. Otherwise returns a slot
+// with an empty control URL that the caller must connect.
+static PSOAP_CONNECTION AcquireConnection(const char* controlURL)
+{
+    PSOAP_CONNECTION conn = nullptr;
+    PSOAP_CONNECTION freeSlot = nullptr;
+    PSOAP_CONNECTION evictSlot = nullptr;
+    ULONGLONG now = GetTickCount64();
+
+    AcquireSRWLockExclusive(&s_ConnectionLock);
+
+    for (int i = 0; i < SOAP_MAX_CONNECTIONS; i++) {
+        PSOAP_CONNECTION c = &s_Connections[i];
+
+        if (c->inUse) {
+            continue;
+        }
+
+        // IGDs tend to close idle connections, so don't bother trying stale ones
+        if (c->controlURL[0] != 0 && now - c->lastUseTime >= SOAP_IDLE_TIMEOUT_MS) {
+            closesocket(c->socket);
+            c->controlURL[0] = 0;
+        }
+
+        if (c->controlURL[0] == 0) {
+            if (freeSlot == nullptr) {
+                freeSlot = c;
+            }
+        }
+        else if (!strcmp(c->controlURL, controlURL)) {
+            conn = c;
+            break;
+        }
+        else if (evictSlot == nullptr || c->lastUseTime < evictSlot->lastUseTime) {
+            evictSlot = c;
+        }
+    }
+
+    if (conn == nullptr) {
+        if (freeSlot != nullptr) {
+            conn = freeSlot;
+        }
+        else if (evictSlot != nullptr) {
+            closesocket(evictSlot->socket);
+            evictSlot->controlURL[0] = 0;
+            conn = evictSlot;
+        }
+    }
+
+    if (conn != nullptr) {
+        conn->inUse = true;
+    }
+
+    ReleaseSRWLockExclusive(&s_ConnectionLock);
+
+    return conn;
+}
+
+static void ReleaseConnection(PSOAP_CONNECTION conn, bool keepAlive)
+{
+    AcquireSRWLockExclusive(&s_ConnectionLock);
+
+    if (!keepAlive && conn->controlURL[0] != 0) {
+        closesocket(conn->socket);
+        conn->controlURL[0] = 0;
+    }
+
+    conn->lastUseTime = GetTickCount64();
+    conn->inUse = false;
+
+    ReleaseSRWLockExclusive(&s_ConnectionLock);
+}
+
+static const char* FindHeader(const char* headers, const char* headersEnd, const char* name)
+{
+    size_t nameLen = strlen(name);
+
+    for (const char* line = strstr(headers, "\r\n"); line != nullptr && line < headersEnd; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (_strnicmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+            const char* value = line + nameLen + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+    }
+
+    return nullptr;
+}
+
+// Decodes a chunked body in place. Returns 1 if the body is complete, 0 if more
+// data is needed, or -1 if the body is malformed.
+static int DecodeChunkedBody(char* body, int length, int* decodedLength)
+{
+    int readPos = 0;
+    int writePos = 0;
+
+    // Make sure the whole body has arrived before modifying anything
+    for (int pass = 0; pass < 2; pass++) {
+        readPos = 0;
+        writePos = 0;
+
+        for (;;) {
+            char* lineEnd = (char*)memchr(&body[readPos], '\n', length - readPos);
+            if (lineEnd == nullptr) {
+                return 0;
+            }
+
+            char* sizeEnd;
+            unsigned long chunkSize = strtoul(&body[readPos], &sizeEnd, 16);
+            if (sizeEnd == &body[readPos]) {
+                return -1;
+            }
+
+            readPos = (int)(lineEnd - body) + 1;
+
+            if (chunkSize == 0) {
+                // Skip any trailers up to the final empty line
+                for (;;) {
+                    lineEnd = (char*)memchr(&body[readPos], '\n', length - readPos);
+                    if (lineEnd == nullptr) {
+                        return 0;
+                    }
+
+                    bool emptyLine = lineEnd == &body[readPos] || (lineEnd == &body[readPos + 1] && body[readPos] == '\r');
+                    readPos = (int)(lineEnd - body) + 1;
+                    if (emptyLine) {
+                        break;
+                    }
+                }
+
+                *decodedLength = writePos;
+                break;
+            }
+
+            if (chunkSize > (unsigned long)(length - readPos)) {
+                return 0;
+            }
+
+            if (pass == 1) {
+                memmove(&body[writePos], &body[readPos], chunkSize);
+            }
+            writePos += chunkSize;
+            readPos += chunkSize;
+
+            // Skip the CRLF after the chunk data
+            if (length - readPos < 2) {
+                return 0;
+            }
+            readPos += 2;
+        }
+    }
+
+    return 1;
+}
+
+// Sends a request and reads the whole response. Returns the HTTP status code, or
+// SOAP_NETWORK_ERROR if the exchange failed. *bodyStart is null terminated. *peerClosed
+// is set if the failure was the IGD closing or resetting the connection before sending
+// any of the response, which is what a reused connection that went stale looks like.
+static int SoapTransact(SOCKET sock, const char* request, int requestLen, char* response, int responseSize, char** bodyStart, bool* keepAlive, bool* peerClosed)
+{
+    *peerClosed = false;
+
+    int sent = 0;
+    while (sent < requestLen) {
+        int ret = send(sock, &request[sent], requestLen - sent, 0);
+        if (ret == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            *peerClosed = error == WSAECONNRESET || error == WSAECONNABORTED;
+            return SOAP_NETWORK_ERROR;
+        }
+        sent += ret;
+    }
+
+    int received = 0;
+    char* headersEnd = nullptr;
+    char* body = nullptr;
+    int contentLength = -1;
+    bool chunked = false;
+    int status = 0;
+
+    *keepAlive = true;
+
+    for (;;) {
+        // Leave room for the null terminator
+        int ret = recv(sock, &response[received], responseSize - received - 1, 0);
+        if (ret == SOCKET_ERROR) {
+            // A timeout means the IGD may still be working on the request
+            int error = WSAGetLastError();
+            *peerClosed = received == 0 && (error == WSAECONNRESET || error == WSAECONNABORTED);
+            return SOAP_NETWORK_ERROR;
+        }
+        else if (ret == 0) {
+            // The connection was closed. That's only fine if the body is delimited by the close.
+            *keepAlive = false;
+            if (body != nullptr && contentLength < 0 && !chunked) {
+                break;
+            }
+            *peerClosed = received == 0;
+            return SOAP_NETWORK_ERROR;
+        }
+
+        received += ret;
+        response[received] = 0;
+
+        if (headersEnd == nullptr) {
+            headersEnd = strstr(response, "\r\n\r\n");
+            if (headersEnd == nullptr) {
+                if (received == responseSize - 1) {
+                    return SOAP_NETWORK_ERROR;
+                }
+                continue;
+            }
+
+            if (sscanf(response, "HTTP/1.%*d %d", &status) != 1) {
+                return SOAP_NETWORK_ERROR;
+            }
+
+            const char* value;
+            if ((value = FindHeader(response, headersEnd, "Transfer-Encoding")) != nullptr && _strnicmp(value, "chunked", 7) == 0) {
+                chunked = true;
+            }
+            else if ((value = FindHeader(response, headersEnd, "Content-Length")) != nullptr) {
+                contentLength = atoi(value);
+            }
+
+            if ((value = FindHeader(response, headersEnd, "Connection")) != nullptr && _strnicmp(value, "close", 5) == 0) {
+                *keepAlive = false;
+            }
+            else if (contentLength < 0 && !chunked) {
+                // The body will be terminated by closing the connection
+                *keepAlive = false;
+            }
+
+            body = headersEnd + 4;
+        }
+
+        int bodyLength = received - (int)(body - response);
+        if (chunked) {
+            int decodedLength;
+            int ret = DecodeChunkedBody(body, bodyLength, &decodedLength);
+            if (ret < 0) {
+                return SOAP_NETWORK_ERROR;
+            }
+            else if (ret > 0) {
+                body[decodedLength] = 0;
+                break;
+            }
+        }
+        else if (contentLength >= 0 && bodyLength >= contentLength) {
+            body[contentLength] = 0;
+            break;
+        }
+
+        if (received == responseSize - 1) {
+            // Response too large for us
+            return SOAP_NETWORK_ERROR;
+        }
+    }
+
+    *bodyStart = body;
+    return status;
+}
+
+// Performs a SOAP action on a pooled connection. Returns the HTTP status code,
+// SOAP_TRANSPORT_ERROR if the caller should fall back to miniupnpc, or
+// SOAP_NETWORK_ERROR if the IGD couldn't be reached or didn't answer.
+static int SoapCall(const char* controlURL, const char* serviceType, const char* action, const char* args, char* response, int responseSize, char** body)
+{
+    char host[128];
+    char port[8];
+    char authority[160];
+    const char* path;
+    char envelope[SOAP_REQUEST_SIZE];
+    char request[SOAP_REQUEST_SIZE];
+    int envelopeLen;
+    int requestLen;
+
+    if (strlen(controlURL) >= SOAP_MAX_URL_LENGTH ||
+            !ParseControlURL(controlURL, host, sizeof(host), port, sizeof(port), authority, sizeof(authority), &path)) {
+        return SOAP_TRANSPORT_ERROR;
+    }
+
+    envelopeLen = snprintf(envelope, sizeof(envelope), k_EnvelopeTemplate, action, serviceType, args, action);
+    if (envelopeLen < 0 || envelopeLen >= sizeof(envelope)) {
+        return SOAP_TRANSPORT_ERROR;
+    }
+
+    requestLen = snprintf(request, sizeof(request), k_RequestTemplate, path, authority, envelopeLen, serviceType, action, envelope);
+    if (requestLen < 0 || requestLen >= sizeof(request)) {
+        return SOAP_TRANSPORT_ERROR;
+    }
+
+    // Try a reused connection first, then a fresh one if the IGD closed it while it was idle
+    for (int attempt = 0; attempt < 2; attempt++) {
+        PSOAP_CONNECTION conn = AcquireConnection(controlURL);
+        if (conn == nullptr) {
+            return SOAP_TRANSPORT_ERROR;
+        }
+
+        bool reused = conn->controlURL[0] != 0;
+        if (!reused) {
+            conn->socket = SoapConnect(host, port);
+            if (conn->socket == INVALID_SOCKET) {
+                ReleaseConnection(conn, false);
+                return SOAP_NETWORK_ERROR;
+            }
+            strcpy(conn->controlURL, controlURL);
+        }
+
+        bool keepAlive;
+        bool peerClosed;
+        int status = SoapTransact(conn->socket, request, requestLen, response, responseSize, body, &keepAlive, &peerClosed);
+        if (status == SOAP_NETWORK_ERROR) {
+            ReleaseConnection(conn, false);
+
+            // Only a stale connection is safe to retry. If the IGD timed out or failed partway
+            // through the response, it may have already applied the request.
+            if (reused && peerClosed) {
+                continue;
+            }
+            return SOAP_NETWORK_ERROR;
+        }
+
+        ReleaseConnection(conn, keepAlive);
+        return status;
+    }
+
+    return SOAP_NETWORK_ERROR;
+}
+
+// Finds the text of the first element with the given local name (ignoring any namespace prefix)
+static bool GetElementText(const char* body, const char* name, char* value, int valueSize)
+{
+    size_t nameLen = strlen(name);
+
+    for (const char* p = strchr(body, '<'); p != nullptr; p = strchr(p + 1, '<')) {
+        const char* tag = p + 1;
+        const char* tagEnd = tag + strcspn(tag, " \t\r\n/>");
+        const char* colon = (const char*)memchr(tag, ':', tagEnd - tag);
+        const char* localName = colon != nullptr ? colon + 1 : tag;
+
+        if ((size_t)(tagEnd - localName) != nameLen || memcmp(localName, name, nameLen) != 0) {
+            continue;
+        }
+
+        const char* text = strchr(tagEnd, '>');
+        if (text == nullptr) {
+            return false;
+        }
+        else if (text[-1] == '/') {
+            // Empty element
+            value[0] = 0;
+            return true;
+        }
+
+        text++;
+        const char* textEnd = strchr(text, '<');
+        if (textEnd == nullptr) {
+            return false;
+        }
+
+        int textLen = (int)min(textEnd - text, valueSize - 1);
+        memcpy(value, text, textLen);
+        value[textLen] = 0;
+        return true;
+    }
+
+    return false;
+}
+
+static int GetSoapError(int status, const char* body)
+{
+    char errorCode[16];
+
+    if (GetElementText(body, "errorCode", errorCode, sizeof(errorCode))) {
+        return atoi(errorCode);
+    }
+    else if (status != 200) {
+        return UPNPCOMMAND_HTTP_ERROR;
+    }
+    else {
+        return UPNPCOMMAND_UNKNOWN_ERROR;
+    }
+}
+
+int SoapGetSpecificPortMappingEntry(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* proto,
+    char* intClient, char* intPort, char* desc, char* enabled, char* leaseDuration)
+{
+    char args[512];
+    char response[SOAP_RESPONSE_SIZE];
+    char* body;
+
+    snprintf(args, sizeof(args), k_GetSpecificPortMappingEntryArgs, extPort, proto);
+    int status = SoapCall(controlURL, serviceType, "GetSpecificPortMappingEntry", args, response, sizeof(response), &body);
+    if (status == SOAP_TRANSPORT_ERROR) {
+        return UPNP_GetSpecificPortMappingEntry(controlURL, serviceType, extPort, proto, nullptr,
+            intClient, intPort, desc, enabled, leaseDuration);
+    }
+    else if (status == SOAP_NETWORK_ERROR) {
+        intClient[0] = 0;
+        intPort[0] = 0;
+        return UPNPCOMMAND_HTTP_ERROR;
+    }
+
+    // Buffer sizes match what miniupnpc requires of callers
+    if (status == 200 &&
+            GetElementText(body, "NewInternalClient", intClient, 16) &&
+            GetElementText(body, "NewInternalPort", intPort, 6)) {
+        if (!GetElementText(body, "NewPortMappingDescription", desc, 80)) {
+            desc[0] = 0;
+        }
+        if (!GetElementText(body, "NewEnabled", enabled, 4)) {
+            enabled[0] = 0;
+        }
+        if (!GetElementText(body, "NewLeaseDuration", leaseDuration, 16)) {
+            leaseDuration[0] = 0;
+        }
+        return UPNPCOMMAND_SUCCESS;
+    }
+
+    intClient[0] = 0;
+    intPort[0] = 0;
+    return GetSoapError(status, body);
+}
+
+int SoapAddPortMapping(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* inPort, const char* inClient,
+    const char* desc, const char* proto, const char* leaseDuration)
+{
+    char args[1024];
+    char response[SOAP_RESPONSE_SIZE];
+    char* body;
+
+    snprintf(args, sizeof(args), k_AddPortMappingArgs, extPort, proto, inPort, inClient, desc, leaseDuration ? leaseDuration : "0");
+    int status = SoapCall(controlURL, serviceType, "AddPortMapping", args, response, sizeof(response), &body);
+    if (status == SOAP_TRANSPORT_ERROR) {
+        return UPNP_AddPortMapping(controlURL, serviceType, extPort, inPort, inClient, desc, proto, nullptr, leaseDuration);
+    }
+    else if (status == SOAP_NETWORK_ERROR) {
+        return UPNPCOMMAND_HTTP_ERROR;
+    }
+    else if (status == 200) {
+        return UPNPCOMMAND_SUCCESS;
+    }
+
+    return GetSoapError(status, body);
+}
+
+int SoapDeletePortMapping(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* proto)
+{
+    char args[512];
+    char response[SOAP_RESPONSE_SIZE];
+    char* body;
+
+    snprintf(args, sizeof(args), k_DeletePortMappingArgs, extPort, proto);
+    int status = SoapCall(controlURL, serviceType, "DeletePortMapping", args, response, sizeof(response), &body);
+    if (status == SOAP_TRANSPORT_ERROR) {
+        return UPNP_DeletePortMapping(controlURL, serviceType, extPort, proto, nullptr);
+    }
+    else if (status == SOAP_NETWORK_ERROR) {
+        return UPNPCOMMAND_HTTP_ERROR;
+    }
+    else if (status == 200) {
+        return UPNPCOMMAND_SUCCESS;
+    }
+
+    return GetSoapError(status, body);
+}
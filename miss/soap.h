@@ -0,0 +1,17 @@
+#pragma once
+
+// Drop-in replacements for the miniupnpc port mapping calls that reuse HTTP/1.1
+// keep-alive connections to the IGD control URL. They fall back to miniupnpc only
+// if we can't send the request ourselves. If the IGD can't be reached or doesn't
+// answer in time, they return UPNPCOMMAND_HTTP_ERROR without sending it again.
+
+int SoapGetSpecificPortMappingEntry(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* proto,
+    char* intClient, char* intPort, char* desc, char* enabled, char* leaseDuration);
+
+int SoapAddPortMapping(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* inPort, const char* inClient,
+    const char* desc, const char* proto, const char* leaseDuration);
+
+int SoapDeletePortMapping(const char* controlURL, const char* serviceType,
+    const char* extPort, const char* proto);
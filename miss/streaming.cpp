@@ -0,0 +1,33 @@
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <tlhelp32.h>
+
+#include <string.h>
+
+#include "streaming.h"
+
+bool IsCurrentlyStreaming()
+{
+    bool ret = false;
+    HANDLE processSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (processSnapshot == INVALID_HANDLE_VALUE) {
+        // Assume we're still streaming if we can't tell
+        return true;
+    }
+
+    PROCESSENTRY32 procEntry;
+    procEntry.dwSize = sizeof(procEntry);
+    if (Process32First(processSnapshot, &procEntry)) {
+        do {
+            // If we find nvstreamer.exe running, we're currently streaming
+            if (_stricmp(procEntry.szExeFile, "nvstreamer.exe") == 0) {
+                ret = true;
+                break;
+            }
+        } while (Process32Next(processSnapshot, &procEntry));
+    }
+
+    CloseHandle(processSnapshot);
+
+    return ret;
+}
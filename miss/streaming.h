@@ -0,0 +1,5 @@
+#pragma once
+
+// Returns true if GameStream has a streaming session running. Shared by MISS
+// and MIST so they agree on what counts as streaming.
+bool IsCurrentlyStreaming();
@@ -0,0 +1,224 @@
+#define WIN32_LEAN_AND_MEAN
+#define _WINSOCK_DEPRECATED_NO_WARNINGS
+#include <Windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <WinSock2.h>
+
+#define STUN_MESSAGE_BINDING_REQUEST 0x0001
+#define STUN_MESSAGE_BINDING_SUCCESS 0x0101
+#define STUN_MESSAGE_COOKIE 0x2112a442
+
+#define STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS 0x0020
+
+// Limits on how fast we answer binding requests, both in total and per source address.
+// This keeps the beacon from being useful as a reflector.
+#define STUN_GLOBAL_RATE_PER_SEC 50
+#define STUN_GLOBAL_BURST 100
+#define STUN_SOURCE_RATE_PER_SEC 5
+#define STUN_SOURCE_BURST 10
+#define STUN_SOURCE_SLOTS 256
+
+#define STUN_DROP_LOG_INTERVAL_MS 60000
+
+#pragma pack(push, 1)
+
+typedef struct _STUN_ATTRIBUTE_HEADER {
+    unsigned short type;
+    unsigned short length;
+} STUN_ATTRIBUTE_HEADER, *PSTUN_ATTRIBUTE_HEADER;
+
+typedef struct _STUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE {
+    STUN_ATTRIBUTE_HEADER hdr;
+    unsigned char reserved;
+    unsigned char addressFamily;
+    unsigned short port;
+    unsigned int address;
+} STUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE, *PSTUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE;
+
+#define TXID_DWORDS 3
+typedef struct _STUN_MESSAGE {
+    unsigned short messageType;
+    unsigned short messageLength;
+    unsigned int magicCookie;
+    int transactionId[TXID_DWORDS];
+} STUN_MESSAGE, *PSTUN_MESSAGE;
+
+typedef struct _STUN_BINDING_RESPONSE {
+    STUN_MESSAGE hdr;
+    STUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE xorMappedAddress;
+} STUN_BINDING_RESPONSE, *PSTUN_BINDING_RESPONSE;
+
+#pragma pack(pop)
+
+typedef struct _TOKEN_BUCKET {
+    ULONGLONG lastRefillTime;
+    unsigned int tokens;
+} TOKEN_BUCKET, *PTOKEN_BUCKET;
+
+typedef struct _SOURCE_SLOT {
+    unsigned int address;
+    TOKEN_BUCKET bucket;
+} SOURCE_SLOT, *PSOURCE_SLOT;
+
+// Only touched by the beacon thread
+static TOKEN_BUCKET s_GlobalBucket;
+static SOURCE_SLOT s_SourceSlots[STUN_SOURCE_SLOTS];
+
+static bool TakeToken(PTOKEN_BUCKET bucket, ULONGLONG now, unsigned int ratePerSec, unsigned int burst)
+{
+    ULONGLONG refill = ((now - bucket->lastRefillTime) * ratePerSec) / 1000;
+    if (refill > 0) {
+        bucket->tokens = (unsigned int)min(burst, bucket->tokens + refill);
+        bucket->lastRefillTime = now;
+    }
+
+    if (bucket->tokens == 0) {
+        return false;
+    }
+
+    bucket->tokens--;
+    return true;
+}
+
+static bool IsRequestAllowed(PSOCKADDR_IN sourceAddr, ULONGLONG now)
+{
+    unsigned int address = sourceAddr->sin_addr.S_un.S_addr;
+
+    // Hash the source address into a fixed table. A colliding address just takes over
+    // the slot with a fresh bucket, and the global bucket still bounds the total rate.
+    unsigned int hash = address * 2654435761U;
+    PSOURCE_SLOT slot = &s_SourceSlots[hash % STUN_SOURCE_SLOTS];
+    if (slot->address != address) {
+        slot->address = address;
+        slot->bucket.lastRefillTime = now;
+        slot->bucket.tokens = STUN_SOURCE_BURST;
+    }
+
+    if (!TakeToken(&slot->bucket, now, STUN_SOURCE_RATE_PER_SEC, STUN_SOURCE_BURST)) {
+        return false;
+    }
+
+    return TakeToken(&s_GlobalBucket, now, STUN_GLOBAL_RATE_PER_SEC, STUN_GLOBAL_BURST);
+}
+
+static bool IsBindingRequest(PSTUN_MESSAGE msg, int len)
+{
+    if (len < sizeof(*msg)) {
+        return false;
+    }
+    else if (htonl(msg->magicCookie) != STUN_MESSAGE_COOKIE) {
+        return false;
+    }
+    else if (htons(msg->messageType) != STUN_MESSAGE_BINDING_REQUEST) {
+        return false;
+    }
+    else if (htons(msg->messageLength) != len - sizeof(*msg) || (htons(msg->messageLength) & 3) != 0) {
+        return false;
+    }
+
+    return true;
+}
+
+DWORD
+WINAPI
+StunBeaconThreadProc(LPVOID Context)
+{
+    SOCKET sock = (SOCKET)Context;
+    ULONGLONG answeredRequests = 0;
+    ULONGLONG droppedRequests = 0;
+    ULONGLONG lastDropLogTime = 0;
+
+    for (;;) {
+        union {
+            STUN_MESSAGE hdr;
+            char buf[548];
+        } req;
+        STUN_BINDING_RESPONSE resp;
+        SOCKADDR_IN sourceAddr;
+        int sourceAddrLen;
+        int recvLen;
+
+        sourceAddrLen = sizeof(sourceAddr);
+        recvLen = recvfrom(sock, req.buf, sizeof(req.buf), 0, (PSOCKADDR)&sourceAddr, &sourceAddrLen);
+        if (recvLen == SOCKET_ERROR) {
+            continue;
+        }
+
+        // Silently ignore anything that isn't a well-formed binding request
+        if (!IsBindingRequest(&req.hdr, recvLen)) {
+            continue;
+        }
+
+        ULONGLONG now = GetTickCount64();
+        if (!IsRequestAllowed(&sourceAddr, now)) {
+            droppedRequests++;
+            if (now - lastDropLogTime >= STUN_DROP_LOG_INTERVAL_MS) {
+                printf("STUN beacon rate limited %llu requests (last from %s, %llu answered)\n",
+                    droppedRequests, inet_ntoa(sourceAddr.sin_addr), answeredRequests);
+                lastDropLogTime = now;
+            }
+            continue;
+        }
+
+        resp.hdr.messageType = htons(STUN_MESSAGE_BINDING_SUCCESS);
+        resp.hdr.messageLength = htons(sizeof(resp.xorMappedAddress));
+        resp.hdr.magicCookie = req.hdr.magicCookie;
+        memcpy(resp.hdr.transactionId, req.hdr.transactionId, sizeof(resp.hdr.transactionId));
+
+        // The address and port are XORed with the cookie
+        resp.xorMappedAddress.hdr.type = htons(STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS);
+        resp.xorMappedAddress.hdr.length = htons(sizeof(resp.xorMappedAddress) - sizeof(resp.xorMappedAddress.hdr));
+        resp.xorMappedAddress.reserved = 0;
+        resp.xorMappedAddress.addressFamily = 1;
+        resp.xorMappedAddress.port = sourceAddr.sin_port ^ (unsigned short)req.hdr.magicCookie;
+        resp.xorMappedAddress.address = sourceAddr.sin_addr.S_un.S_addr ^ req.hdr.magicCookie;
+
+        if (sendto(sock, (char*)&resp, sizeof(resp), 0, (PSOCKADDR)&sourceAddr, sourceAddrLen) != SOCKET_ERROR) {
+            answeredRequests++;
+        }
+    }
+
+    closesocket(sock);
+    return 0;
+}
+
+int StartStunBeacon(unsigned short Port)
+{
+    SOCKET sock;
+    SOCKADDR_IN addr;
+    HANDLE thread;
+    int error;
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        error = WSAGetLastError();
+        printf("socket() failed: %d\n", error);
+        return error;
+    }
+
+    RtlZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Port);
+    if (bind(sock, (PSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        error = WSAGetLastError();
+        printf("bind() failed: %d\n", error);
+        closesocket(sock);
+        return error;
+    }
+
+    thread = CreateThread(NULL, 0, StunBeaconThreadProc, (LPVOID)sock, 0, NULL);
+    if (thread == NULL) {
+        error = GetLastError();
+        printf("CreateThread() failed: %d\n", error);
+        closesocket(sock);
+        return error;
+    }
+
+    CloseHandle(thread);
+
+    printf("STUN beacon listening on UDP %d\n", Port);
+    return 0;
+}
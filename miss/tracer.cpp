@@ -10,77 +10,354 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <intrin.h>
 
 #define MINIUPNP_STATICLIB
 #include <miniupnpc/miniupnpc.h>
 
+#include "transact.h"
+#include "mapper.h"
+
+// Devices must answer an M-SEARCH within MX seconds. We allow a little extra
+// time for the response to reach us.
+#define SSDP_SEARCH_MX_SEC 2
+#define SSDP_SEARCH_WINDOW_MS (SSDP_SEARCH_MX_SEC * 1000 + 500)
+
+// Each search is sent once and then collects responses until an IGD answers or the window closes
+static const UDP_RETRANSMIT_SCHEDULE k_SsdpSearchSchedule = { SSDP_SEARCH_WINDOW_MS, SSDP_SEARCH_WINDOW_MS, 1, false };
+
 static const char* k_SsdpSearchFormatString =
     "M-SEARCH * HTTP/1.1\r\n"
     "HOST: %s:1900\r\n"
-    "ST: ssdp:all\r\n"
+    "ST: %s\r\n"
     "MAN: \"ssdp:discover\"\r\n"
-    "MX: 5\r\n"
+    "MX: %d\r\n"
     "\r\n";
 
-// Based on logic in https://github.com/miniupnp/miniupnp/blob/master/miniupnpc/minissdpc.c
-static void
-parseReply(const char* reply, int size,
-           const char** location, int *locationsize,
-           const char** st, int* stsize,
-           const char** usn, int* usnsize)
+// Only search for things UPNP_GetValidIGD() can use, so we don't hear from every
+// media renderer on the network. Not all IGDs answer searches for older versions.
+static const char* k_SsdpSearchTargets[] = {
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:2",
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:1",
+    "urn:schemas-upnp-org:service:WANIPConnection:2",
+    "urn:schemas-upnp-org:service:WANIPConnection:1",
+};
+
+// Devices that answer with anything else can't help us map ports, even if they
+// ignored our search target. Matched regardless of version.
+static const char* k_SsdpRelevantTypes[] = {
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:",
+    "urn:schemas-upnp-org:device:WANDevice:",
+    "urn:schemas-upnp-org:device:WANConnectionDevice:",
+    "urn:schemas-upnp-org:service:WANIPConnection:",
+    "urn:schemas-upnp-org:service:WANPPPConnection:",
+};
+
+// Each search target is sent with the real HOST and with the multicast address, since
+// some routers explicitly check for the latter
+#define SSDP_SEARCH_COUNT (ARRAYSIZE(k_SsdpSearchTargets) * 2)
+
+// Must be a power of 2
+#define SSDP_USN_TABLE_SIZE 256
+
+typedef struct _SSDP_SEARCH {
+    UDP_TRANSACTION transactions[SSDP_SEARCH_COUNT];
+    char requests[SSDP_SEARCH_COUNT][256];
+    struct UPNPDev* deviceList;
+    bool foundIgd;
+
+    // Hashes of the USNs we've kept, so retransmitted and duplicate replies
+    // are dropped before we allocate anything for them. 0 marks an empty slot.
+    unsigned int usnHashes[SSDP_USN_TABLE_SIZE];
+    int usnHashCount;
+
+    int responsesSeen;
+    int responsesDropped;
+    int responsesKept;
+} SSDP_SEARCH, *PSSDP_SEARCH;
+
+// A view into the receive buffer, which is only valid during the response callback
+typedef struct _SSDP_VIEW {
+    const char* data;
+    int length;
+} SSDP_VIEW, *PSSDP_VIEW;
+
+typedef struct _SSDP_REPLY {
+    SSDP_VIEW statusLine;
+    SSDP_VIEW location;
+    SSDP_VIEW st;
+    SSDP_VIEW usn;
+
+    // Parser state
+    int lineStartIdx;
+    int colonIdx; // 0 until we see the first colon on this line
+    bool haveStatusLine;
+} SSDP_REPLY, *PSSDP_REPLY;
+
+static bool viewEquals(const char* data, int length, const char* literal)
 {
-    int lineStartIdx = 0;
-    int headerEndIdx = 0;
-    for (int i = 0; i < size; i++) {
-        switch (reply[i])
-        {
-        case ':':
-            // Stop parsing the header at the first colon, but ignore subsequent colons
-            if (headerEndIdx == 0) {
-                headerEndIdx = i;
-            }
-            break;
-        case '\r':
-        case '\n':
-            if (headerEndIdx != 0) {
-                // Skip the colon and spaces
-                do { headerEndIdx++; } while (reply[headerEndIdx] == ' ');
-
-                // Check if it's one of the values we care about
-                if (!_strnicmp(reply + lineStartIdx, "location:", 9)) {
-                    *location = reply + headerEndIdx;
-                    *locationsize = i - headerEndIdx;
-                }
-                else if (!_strnicmp(reply + lineStartIdx, "st:", 3)) {
-                    *st = reply + headerEndIdx;
-                    *stsize = i - headerEndIdx;
-                }
-                else if (!_strnicmp(reply + lineStartIdx, "usn:", 4)) {
-                    *usn = reply + headerEndIdx;
-                    *usnsize = i - headerEndIdx;
-                }
-
-                // Move on to the next header value
-                headerEndIdx = 0;
-            }
-            lineStartIdx = i + 1;
-            break;
-        default:
-            break;
+    return length == (int)strlen(literal) && !_strnicmp(data, literal, length);
+}
+
+// Handles a CR, LF or colon at the given index. Based on logic in
+// https://github.com/miniupnp/miniupnp/blob/master/miniupnpc/minissdpc.c
+static void handleReplyDelimiter(PSSDP_REPLY reply, const char* data, int i)
+{
+    if (data[i] == ':') {
+        // The header name ends at the first colon, but values may contain more
+        if (reply->colonIdx == 0 && reply->haveStatusLine) {
+            reply->colonIdx = i;
+        }
+        return;
+    }
+
+    if (!reply->haveStatusLine) {
+        reply->statusLine.data = data;
+        reply->statusLine.length = i;
+        reply->haveStatusLine = true;
+    }
+    else if (reply->colonIdx != 0) {
+        const char* name = data + reply->lineStartIdx;
+        int nameLength = reply->colonIdx - reply->lineStartIdx;
+
+        // Skip the colon and spaces
+        int valueIdx = reply->colonIdx + 1;
+        while (valueIdx < i && data[valueIdx] == ' ') {
+            valueIdx++;
+        }
+
+        PSSDP_VIEW value = nullptr;
+        if (viewEquals(name, nameLength, "location")) {
+            value = &reply->location;
+        }
+        else if (viewEquals(name, nameLength, "st")) {
+            value = &reply->st;
+        }
+        else if (viewEquals(name, nameLength, "usn")) {
+            value = &reply->usn;
+        }
+
+        if (value != nullptr) {
+            value->data = data + valueIdx;
+            value->length = i - valueIdx;
         }
     }
+
+    // Move on to the next line
+    reply->colonIdx = 0;
+    reply->lineStartIdx = i + 1;
+}
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+// Returns a bit for each CR, LF or colon in the 16 bytes at p
+static unsigned int findReplyDelimiters(const char* p)
+{
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    __m128i matches = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8(':')));
+    return (unsigned int)_mm_movemask_epi8(matches);
+}
+
+#endif
+
+// Finds the status line and the headers we care about without modifying or
+// copying the reply. Most bytes aren't delimiters, so we find those 16 bytes
+// at a time and only visit the ones we find.
+static void parseReply(const char* data, int size, PSSDP_REPLY reply)
+{
+    int i = 0;
+
+    *reply = {};
+
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; i + 16 <= size; i += 16) {
+        unsigned int mask = findReplyDelimiters(data + i);
+        while (mask != 0) {
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+            handleReplyDelimiter(reply, data, i + (int)bit);
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (data[i] == '\r' || data[i] == '\n' || data[i] == ':') {
+            handleReplyDelimiter(reply, data, i);
+        }
+    }
+
+    // Tolerate a reply that doesn't end with a line break
+    if (!reply->haveStatusLine || reply->colonIdx != 0) {
+        handleReplyDelimiter(reply, data, size);
+    }
+}
+
+// Parses the status line:
+// HTTP/1.1 200 OK
+static bool checkReplyStatus(PSSDP_VIEW statusLine)
+{
+    const char* data = statusLine->data;
+    int length = statusLine->length;
+    int protocolLength = 0;
+
+    while (protocolLength < length && data[protocolLength] != ' ') {
+        protocolLength++;
+    }
+
+    int statusIdx = protocolLength;
+    while (statusIdx < length && data[statusIdx] == ' ') {
+        statusIdx++;
+    }
+
+    // Check for a valid response header
+    if (protocolLength == 0) {
+        MappingLog("Missing protocol in SSDP header\n");
+        return false;
+    }
+    else if (statusIdx == length) {
+        MappingLog("Missing status code in SSDP header\n");
+        return false;
+    }
+    // FIXME: Should we require the status message too?
+    else if (!viewEquals(data, protocolLength, "HTTP/1.0") && !viewEquals(data, protocolLength, "HTTP/1.1")) {
+        MappingLog("Unexpected protocol: %.*s\n", protocolLength, data);
+        return false;
+    }
+    else if (length - statusIdx < 3 || strncmp(data + statusIdx, "200", 3) ||
+             (length - statusIdx > 3 && data[statusIdx + 3] != ' ')) {
+        MappingLog("Unexpected status: %.*s\n", length - statusIdx, data + statusIdx);
+        return false;
+    }
+
+    return true;
+}
+
+static bool isRelevantType(PSSDP_VIEW st)
+{
+    for (int i = 0; i < ARRAYSIZE(k_SsdpRelevantTypes); i++) {
+        int prefixLength = (int)strlen(k_SsdpRelevantTypes[i]);
+        if (st->length > prefixLength && !_strnicmp(st->data, k_SsdpRelevantTypes[i], prefixLength)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns false if we've already kept a reply with this USN. If the table
+// is full, we stop de-duplicating rather than dropping new devices.
+static bool addUsn(PSSDP_SEARCH search, PSSDP_VIEW usn)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261;
+    for (int i = 0; i < usn->length; i++) {
+        hash = (hash ^ (unsigned char)usn->data[i]) * 16777619;
+    }
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    if (search->usnHashCount == SSDP_USN_TABLE_SIZE) {
+        return true;
+    }
+
+    for (unsigned int i = hash & (SSDP_USN_TABLE_SIZE - 1);; i = (i + 1) & (SSDP_USN_TABLE_SIZE - 1)) {
+        if (search->usnHashes[i] == hash) {
+            return false;
+        }
+        else if (search->usnHashes[i] == 0) {
+            search->usnHashes[i] = hash;
+            search->usnHashCount++;
+            return true;
+        }
+    }
+}
+
+// SSDP responses aren't tied to a particular search, so whichever search
+// transaction sees a response adds it to the shared device list
+static bool handleSsdpResponse(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length)
+{
+    PSSDP_SEARCH search = (PSSDP_SEARCH)transaction->context;
+
+    SSDP_REPLY reply;
+
+    search->responsesSeen++;
+
+    parseReply(data, length, &reply);
+    if (!checkReplyStatus(&reply.statusLine)) {
+        search->responsesDropped++;
+        return true;
+    }
+    else if (reply.location.length == 0 || reply.st.length == 0) {
+        MappingLog("Required value missing: %d %d\n", reply.location.length, reply.st.length);
+        search->responsesDropped++;
+        return true;
+    }
+    // Devices without a USN are keyed by their description URL instead
+    else if (!isRelevantType(&reply.st) || !addUsn(search, reply.usn.length != 0 ? &reply.usn : &reply.location)) {
+        search->responsesDropped++;
+        return true;
+    }
+
+    // The USN is optional
+    int usnSize = reply.usn.length;
+    int locSize = reply.location.length;
+    int stSize = reply.st.length;
+
+    // This is the only copy of the reply we make. It must be a single allocation
+    // because freeUPNPDevlist() frees each device on its own.
+    struct UPNPDev* newDev = (struct UPNPDev*)malloc(sizeof(*newDev) + usnSize + locSize + stSize + 3);
+    if (newDev == nullptr) {
+        search->responsesDropped++;
+        return true;
+    }
+
+    newDev->pNext = search->deviceList;
+
+    newDev->usn = &newDev->buffer[0];
+    memcpy(newDev->usn, reply.usn.data, usnSize);
+    newDev->usn[usnSize] = 0;
+
+    newDev->descURL = newDev->usn + usnSize + 1;
+    memcpy(newDev->descURL, reply.location.data, locSize);
+    newDev->descURL[locSize] = 0;
+
+    newDev->st = newDev->descURL + locSize + 1;
+    memcpy(newDev->st, reply.st.data, stSize);
+    newDev->st[stSize] = 0;
+
+    newDev->scope_id = 0; // IPv6 only
+
+    search->deviceList = newDev;
+    search->responsesKept++;
+
+    // One IGD description is all we need, so there's no point waiting out the
+    // MX window for duplicates
+    if (!search->foundIgd) {
+        search->foundIgd = true;
+        for (int i = 0; i < ARRAYSIZE(search->transactions); i++) {
+            CancelUdpTransaction(&search->transactions[i]);
+        }
+    }
+
+    return true;
 }
 
 struct UPNPDev* getUPnPDevicesByAddress(IN_ADDR address)
 {
     SOCKET s;
     SOCKADDR_IN connAddr;
-    char searchBuffer[512];
-    int chars;
+    SSDP_SEARCH search;
+    PUDP_TRANSACTION transactionList[SSDP_SEARCH_COUNT];
+    const char* hosts[2];
+    ULONGLONG startTime;
 
     s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (s == INVALID_SOCKET) {
-        printf("socket() failed: %d\n", WSAGetLastError());
+        MappingLog("socket() failed: %d\n", WSAGetLastError());
         return nullptr;
     }
 
@@ -91,139 +368,385 @@ struct UPNPDev* getUPnPDevicesByAddress(IN_ADDR address)
 
     // Use connect() to ensure we don't get responses from other devices
     if (connect(s, (struct sockaddr*)&connAddr, sizeof(connAddr)) == SOCKET_ERROR) {
-        printf("connect() failed: %d\n", WSAGetLastError());
+        MappingLog("connect() failed: %d\n", WSAGetLastError());
         closesocket(s);
         return nullptr;
     }
 
-    // We will be reading all responses at the end, so ensure we have ample buffer space
-    // to allow responses to accumulate without loss.
-    int recvBufferSize = 65535;
+    // Devices can answer with a burst of responses, so ensure we have ample buffer space
+    // to allow responses to accumulate without loss while we parse them. This is enough
+    // for a few hundred typical replies arriving at once.
+    int recvBufferSize = 256 * 1024;
     if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, (char*)&recvBufferSize, sizeof(recvBufferSize)) == SOCKET_ERROR) {
-        printf("setsockopt() failed: %d\n", WSAGetLastError());
+        MappingLog("setsockopt() failed: %d\n", WSAGetLastError());
     }
 
-    // Send the first search message with HOST set properly
-    chars = snprintf(searchBuffer, ARRAYSIZE(searchBuffer), k_SsdpSearchFormatString, inet_ntoa(address));
-    if (send(s, searchBuffer, chars, 0) == SOCKET_ERROR) {
-        printf("send() failed: %d\n", WSAGetLastError());
-        closesocket(s);
-        return nullptr;
+    search = {};
+
+    // Send each search with HOST set properly and again with HOST set to 239.255.255.250
+    // to avoid issues on routers that explicitly check for that HOST value
+    hosts[0] = inet_ntoa(address);
+    hosts[1] = "239.255.255.250";
+
+    for (int i = 0; i < SSDP_SEARCH_COUNT; i++) {
+        int requestLength = snprintf(search.requests[i], sizeof(search.requests[i]), k_SsdpSearchFormatString,
+            hosts[i % 2], k_SsdpSearchTargets[i / 2], SSDP_SEARCH_MX_SEC);
+        InitUdpTransaction(&search.transactions[i], s, nullptr, 0, search.requests[i], requestLength,
+            &k_SsdpSearchSchedule, 0, handleSsdpResponse, &search);
+        transactionList[i] = &search.transactions[i];
     }
 
-    // Send another search message with HOST set to 239.255.255.250 to avoid issues
-    // on routers that explicitly check for that HOST value
-    chars = snprintf(searchBuffer, ARRAYSIZE(searchBuffer), k_SsdpSearchFormatString, "239.255.255.250");
-    if (send(s, searchBuffer, chars, 0) == SOCKET_ERROR) {
-        printf("send() failed: %d\n", WSAGetLastError());
-        closesocket(s);
-        return nullptr;
+    // Collect responses until an IGD answers or the search window closes. If nothing
+    // is listening on the SSDP port, the ICMP error ends the search early.
+    startTime = GetTickCount64();
+    RunUdpTransactions(transactionList, SSDP_SEARCH_COUNT);
+
+    if (search.foundIgd) {
+        MappingLog("Found UPnP IGD at %s after %llu ms\n", hosts[0], GetTickCount64() - startTime);
     }
+    MappingLog("SSDP responses: %d seen, %d dropped, %d kept\n",
+        search.responsesSeen, search.responsesDropped, search.responsesKept);
 
-    Sleep(5000);
+    for (int i = 0; i < SSDP_SEARCH_COUNT; i++) {
+        if (search.transactions[i].state == UdpTransactionFailed) {
+            MappingLog("SSDP search failed: %d\n", search.transactions[i].error);
+            break;
+        }
+    }
+
+    closesocket(s);
+
+    return search.deviceList;
+}
 
-    // Switch to non-blocking mode to read the responses
-    u_long mode = 1;
-    ioctlsocket(s, FIONBIO, &mode);
+// Start at TTL 2 to skip contacting our default gateway
+#define TTL_START 2
+
+// Probes for every TTL are in flight at once. A hop that still hasn't answered
+// this long after a hop beyond it did is assumed to be silent.
+#define TRACE_TIMEOUT_MS 3000
+#define TRACE_SILENT_HOP_GRACE_MS 500
+#define TRACE_MAX_HOPS 32
+
+// Destination port for UDP probes, as in classic traceroute
+#define TRACE_UDP_PORT 33434
+
+#define ICMP_TYPE_DEST_UNREACHABLE 3
+#define ICMP_TYPE_TIME_EXCEEDED 11
+#define ICMP_CODE_PORT_UNREACHABLE 3
+
+typedef enum _TRACE_HOP_STATE {
+    TraceHopPending,
+    TraceHopSilent,
+    TraceHopTransit, // A router on the path answered
+    TraceHopEnd, // We reached the destination or got an error
+} TRACE_HOP_STATE;
+
+typedef struct _TRACE_HOP {
+    TRACE_HOP_STATE state;
+    IN_ADDR address;
+    ULONG status;
+    ULONGLONG replyTime;
+} TRACE_HOP, *PTRACE_HOP;
+
+static void recordHopReply(PTRACE_HOP hop, TRACE_HOP_STATE state, IN_ADDR address, ULONG status)
+{
+    hop->state = state;
+    hop->address = address;
+    hop->status = status;
+    hop->replyTime = GetTickCount64();
+}
+
+// Returns how long to keep waiting for replies, or 0 once the hops we report are
+// settled. Hops that we give up on are marked silent.
+static DWORD getTraceWaitTime(PTRACE_HOP hops, int hopCount, ULONGLONG deadline)
+{
+    ULONGLONG now = GetTickCount64();
 
-    char responseBuffer[2048];
-    struct UPNPDev* deviceList = nullptr;
-    for (;;) {
-        int bytesRead = recv(s, responseBuffer, sizeof(responseBuffer) - 1, 0);
-        if (bytesRead == SOCKET_ERROR) {
-            if (WSAGetLastError() == WSAEMSGSIZE) {
-                // Skip packets larger than our buffer
-                printf("recv() message too large\n");
-                continue;
+    if (now >= deadline) {
+        return 0;
+    }
+
+    for (int i = 0; i < hopCount; i++) {
+        ULONGLONG laterReplyTime = 0;
+
+        if (hops[i].state == TraceHopTransit) {
+            continue;
+        }
+        else if (hops[i].state != TraceHopPending) {
+            // Nothing after this hop will be reported
+            return 0;
+        }
+
+        // If a hop beyond this one has answered, this one probably isn't going to
+        for (int j = i + 1; j < hopCount; j++) {
+            if ((hops[j].state == TraceHopTransit || hops[j].state == TraceHopEnd) &&
+                    (laterReplyTime == 0 || hops[j].replyTime < laterReplyTime)) {
+                laterReplyTime = hops[j].replyTime;
             }
-            else if (WSAGetLastError() != WSAEWOULDBLOCK) {
-                printf("recv() failed: %d\n", WSAGetLastError());
+        }
+
+        if (laterReplyTime != 0) {
+            if (now >= laterReplyTime + TRACE_SILENT_HOP_GRACE_MS) {
+                hops[i].state = TraceHopSilent;
+                return 0;
             }
-            break;
+
+            return (DWORD)(min(deadline, laterReplyTime + TRACE_SILENT_HOP_GRACE_MS) - now);
         }
 
-        // Null-terminate the buffer
-        responseBuffer[bytesRead] = 0;
+        return (DWORD)(deadline - now);
+    }
 
-        // Parse the first status line:
-        // HTTP/1.1 200 OK
-        char* protocol = strtok(responseBuffer, " ");
-        char* statusCodeStr = strtok(nullptr, " ");
-        char* statusMessage = strtok(nullptr, "\r");
+    // Every hop has answered
+    return 0;
+}
+
+static void traceIcmp(IPAddr destination, PTRACE_HOP hops, int hopCount)
+{
+    char requestData[] = "Test";
+    HANDLE icmpFile;
+    HANDLE events[TRACE_MAX_HOPS] = {};
+    union {
+        ICMP_ECHO_REPLY reply;
+
+        // Asynchronous requests need room for an IO_STATUS_BLOCK too
+        char buffer[256];
+    } replies[TRACE_MAX_HOPS];
+    ULONGLONG deadline;
+    DWORD waitMs;
+
+    icmpFile = IcmpCreateFile();
+    if (icmpFile == INVALID_HANDLE_VALUE) {
+        printf("IcmpCreateFile() failed: %d\n", GetLastError());
+        return;
+    }
+
+    for (int i = 0; i < hopCount; i++) {
+        IP_OPTION_INFORMATION ipOptions;
+
+        ipOptions.Ttl = TTL_START + i;
+        ipOptions.Tos = 0;
+        ipOptions.Flags = 0;
+        ipOptions.OptionsSize = 0;
+        ipOptions.OptionsData = nullptr;
 
-        // Check for a valid response header
-        if (protocol == nullptr) {
-            printf("Missing protocol in SSDP header\n");
+        // Each request gets its own reply buffer, so replies are matched to their TTL for us
+        events[i] = CreateEvent(nullptr, true, false, nullptr);
+        if (events[i] == nullptr) {
+            printf("CreateEvent() failed: %d\n", GetLastError());
+            hops[i].state = TraceHopSilent;
             continue;
         }
-        else if (statusCodeStr == nullptr) {
-            printf("Missing status code in SSDP header\n");
-            continue;
+
+        if (IcmpSendEcho2(icmpFile, events[i], nullptr, nullptr, destination,
+                requestData, sizeof(requestData), &ipOptions,
+                &replies[i], sizeof(replies[i]), TRACE_TIMEOUT_MS) == 0 &&
+                GetLastError() != ERROR_IO_PENDING) {
+            printf("IcmpSendEcho2() failed: %d\n", GetLastError());
+            CloseHandle(events[i]);
+            events[i] = nullptr;
+            hops[i].state = TraceHopSilent;
         }
-        // FIXME: Should we require statusMessage too?
-        else if (_stricmp(protocol, "HTTP/1.0") && _stricmp(protocol, "HTTP/1.1")) {
-            printf("Unexpected protocol: %s\n", protocol);
-            continue;
+    }
+
+    deadline = GetTickCount64() + TRACE_TIMEOUT_MS;
+    while ((waitMs = getTraceWaitTime(hops, hopCount, deadline)) != 0) {
+        HANDLE pendingEvents[TRACE_MAX_HOPS];
+        int pendingHops[TRACE_MAX_HOPS];
+        int pendingCount = 0;
+
+        for (int i = 0; i < hopCount; i++) {
+            if (events[i] != nullptr && hops[i].state == TraceHopPending) {
+                pendingEvents[pendingCount] = events[i];
+                pendingHops[pendingCount] = i;
+                pendingCount++;
+            }
         }
-        else if (atoi(statusCodeStr) != 200) {
-            printf("Unexpected status: %s %s\n", statusCodeStr, statusMessage);
+
+        if (pendingCount == 0) {
+            break;
+        }
+
+        DWORD waitResult = WaitForMultipleObjects(pendingCount, pendingEvents, false, waitMs);
+        if (waitResult >= WAIT_OBJECT_0 + pendingCount) {
+            // Timed out or failed, so let getTraceWaitTime() decide what's next
             continue;
         }
 
-        // Parse the header options
-        char* remainder = strtok(nullptr, "");
-        const char* loc = nullptr;
-        const char* st = nullptr;
-        const char* usn = ""; // Initialize to empty since it's optional
-        int locSize = 0;
-        int stSize = 0;
-        int usnSize = 0;
-        parseReply(remainder, strlen(remainder),
-            &loc, &locSize, &st, &stSize, &usn, &usnSize);
+        int i = pendingHops[waitResult - WAIT_OBJECT_0];
+        if (IcmpParseReplies(&replies[i], sizeof(replies[i])) == 0) {
+            // Most likely IP_REQ_TIMED_OUT
+            hops[i].state = TraceHopSilent;
+        }
+        else if (replies[i].reply.Status == IP_TTL_EXPIRED_TRANSIT) {
+            recordHopReply(&hops[i], TraceHopTransit, *(IN_ADDR*)&replies[i].reply.Address, 0);
+        }
+        else {
+            recordHopReply(&hops[i], TraceHopEnd, *(IN_ADDR*)&replies[i].reply.Address, replies[i].reply.Status);
+        }
+    }
 
-        if (!loc || locSize == 0 || !st || stSize == 0) {
-            printf("Required value missing: %d %d\n", locSize, stSize);
-            continue;
+    // Don't leave the driver writing into our reply buffers after we return. Completed
+    // requests leave their events signalled, so this only waits on the ones we gave up on.
+    CancelIoEx(icmpFile, nullptr);
+    for (int i = 0; i < hopCount; i++) {
+        if (events[i] != nullptr) {
+            WaitForSingleObject(events[i], TRACE_TIMEOUT_MS);
+            CloseHandle(events[i]);
         }
+    }
 
-        struct UPNPDev* newDev = (struct UPNPDev*)malloc(sizeof(*newDev) + usnSize + locSize + stSize + 3);
+    IcmpCloseHandle(icmpFile);
+}
+
+// For networks that drop ICMP echo requests. Every probe goes to the same destination
+// port from the same source port so that load balancers hash them all onto the same
+// path (as in Paris traceroute). Instead of varying the ports, each probe has a
+// different payload length, which comes back to us in the ICMP error's quoted UDP header.
+static void traceUdp(IPAddr destination, PTRACE_HOP hops, int hopCount)
+{
+    SOCKET udpSock = INVALID_SOCKET;
+    SOCKET icmpSock = INVALID_SOCKET;
+    SOCKADDR_IN destAddr = {};
+    SOCKADDR_IN localAddr;
+    int localAddrLen;
+    unsigned short localPort;
+    char payload[TRACE_MAX_HOPS] = {};
+    ULONGLONG deadline;
+    DWORD waitMs;
+
+    // We need a raw socket to see the ICMP errors for our probes
+    icmpSock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (icmpSock == INVALID_SOCKET) {
+        printf("socket() failed: %d\n", WSAGetLastError());
+        return;
+    }
 
-        newDev->pNext = deviceList;
+    udpSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpSock == INVALID_SOCKET) {
+        printf("socket() failed: %d\n", WSAGetLastError());
+        goto Exit;
+    }
 
-        newDev->usn = &newDev->buffer[0];
-        memcpy(newDev->usn, usn, usnSize);
-        newDev->usn[usnSize] = 0;
+    destAddr.sin_family = AF_INET;
+    destAddr.sin_addr.S_un.S_addr = destination;
+    destAddr.sin_port = htons(TRACE_UDP_PORT);
+    if (connect(udpSock, (struct sockaddr*)&destAddr, sizeof(destAddr)) == SOCKET_ERROR) {
+        printf("connect() failed: %d\n", WSAGetLastError());
+        goto Exit;
+    }
 
-        newDev->descURL = newDev->usn + usnSize + 1;
-        memcpy(newDev->descURL, loc, locSize);
-        newDev->descURL[locSize] = 0;
+    localAddrLen = sizeof(localAddr);
+    if (getsockname(udpSock, (struct sockaddr*)&localAddr, &localAddrLen) == SOCKET_ERROR) {
+        printf("getsockname() failed: %d\n", WSAGetLastError());
+        goto Exit;
+    }
 
-        newDev->st = newDev->descURL + locSize + 1;
-        memcpy(newDev->st, st, stSize);
-        newDev->st[stSize] = 0;
+    // Raw sockets only receive if they're bound to an interface address
+    localPort = localAddr.sin_port;
+    localAddr.sin_port = 0;
+    if (bind(icmpSock, (struct sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR) {
+        printf("bind() failed: %d\n", WSAGetLastError());
+        goto Exit;
+    }
 
-        newDev->scope_id = 0; // IPv6 only
+    for (int i = 0; i < hopCount; i++) {
+        DWORD ttl = TTL_START + i;
 
-        deviceList = newDev;
+        if (setsockopt(udpSock, IPPROTO_IP, IP_TTL, (char*)&ttl, sizeof(ttl)) == SOCKET_ERROR ||
+                send(udpSock, payload, i + 1, 0) == SOCKET_ERROR) {
+            printf("Failed to send UDP probe: %d\n", WSAGetLastError());
+            hops[i].state = TraceHopSilent;
+        }
     }
 
-    closesocket(s);
+    deadline = GetTickCount64() + TRACE_TIMEOUT_MS;
+    while ((waitMs = getTraceWaitTime(hops, hopCount, deadline)) != 0) {
+        unsigned char buf[576];
+        SOCKADDR_IN sourceAddr;
+        int sourceAddrLen;
+        fd_set fds;
+        struct timeval timeout;
+        int len;
+
+        FD_ZERO(&fds);
+        FD_SET(icmpSock, &fds);
+        timeout.tv_sec = waitMs / 1000;
+        timeout.tv_usec = (waitMs % 1000) * 1000;
+
+        int err = select(0, &fds, nullptr, nullptr, &timeout);
+        if (err == 0) {
+            continue;
+        }
+        else if (err == SOCKET_ERROR) {
+            printf("select() failed: %d\n", WSAGetLastError());
+            break;
+        }
 
-    return deviceList;
-}
+        sourceAddrLen = sizeof(sourceAddr);
+        len = recvfrom(icmpSock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&sourceAddr, &sourceAddrLen);
+        if (len == SOCKET_ERROR) {
+            printf("recvfrom() failed: %d\n", WSAGetLastError());
+            break;
+        }
 
-// Start at TTL 2 to skip contacting our default gateway
-#define TTL_START 2
+        // Raw sockets give us the IP header too. The ICMP error is followed by the IP
+        // header of our probe and the first 8 bytes of its payload (the UDP header).
+        int ipHdrLen = (buf[0] & 0x0F) * 4;
+        if (len < ipHdrLen + 8) {
+            continue;
+        }
+
+        unsigned char icmpType = buf[ipHdrLen];
+        unsigned char icmpCode = buf[ipHdrLen + 1];
+        if (icmpType != ICMP_TYPE_TIME_EXCEEDED && icmpType != ICMP_TYPE_DEST_UNREACHABLE) {
+            continue;
+        }
+
+        unsigned char* probeIpHdr = &buf[ipHdrLen + 8];
+        int probeIpHdrLen = (probeIpHdr[0] & 0x0F) * 4;
+        if (len < ipHdrLen + 8 + probeIpHdrLen + 8 ||
+                probeIpHdr[9] != IPPROTO_UDP ||
+                memcmp(&probeIpHdr[16], &destination, sizeof(destination))) {
+            continue;
+        }
+
+        unsigned short probeSrcPort, probeDstPort, probeUdpLen;
+        memcpy(&probeSrcPort, &probeIpHdr[probeIpHdrLen], 2);
+        memcpy(&probeDstPort, &probeIpHdr[probeIpHdrLen + 2], 2);
+        memcpy(&probeUdpLen, &probeIpHdr[probeIpHdrLen + 4], 2);
+        if (probeSrcPort != localPort || probeDstPort != htons(TRACE_UDP_PORT)) {
+            continue;
+        }
+
+        int i = ntohs(probeUdpLen) - 8 - 1;
+        if (i < 0 || i >= hopCount || hops[i].state != TraceHopPending) {
+            continue;
+        }
+
+        if (icmpType == ICMP_TYPE_TIME_EXCEEDED) {
+            recordHopReply(&hops[i], TraceHopTransit, sourceAddr.sin_addr, 0);
+        }
+        else {
+            recordHopReply(&hops[i], TraceHopEnd, sourceAddr.sin_addr,
+                icmpCode == ICMP_CODE_PORT_UNREACHABLE ? IP_DEST_PORT_UNREACHABLE : IP_DEST_HOST_UNREACHABLE);
+        }
+    }
+
+Exit:
+    if (udpSock != INVALID_SOCKET) {
+        closesocket(udpSock);
+    }
+    closesocket(icmpSock);
+}
 
 bool getHopsIP4(IN_ADDR* hopAddress, int* hopAddressCount)
 {
-    HANDLE icmpFile;
     struct hostent* host;
-    const char* requestBuffer = "Test";
-    union {
-        ICMP_ECHO_REPLY replies[ANYSIZE_ARRAY];
-        char replyBuffer[128];
-    };
+    TRACE_HOP hops[TRACE_MAX_HOPS] = {};
+    int hopCount = min(*hopAddressCount, TRACE_MAX_HOPS);
+    int i;
 
     host = gethostbyname("moonlight-stream.org");
     if (host == nullptr) {
@@ -231,52 +754,41 @@ bool getHopsIP4(IN_ADDR* hopAddress, int* hopAddressCount)
         return false;
     }
 
-    icmpFile = IcmpCreateFile();
-    if (icmpFile == INVALID_HANDLE_VALUE) {
-        printf("IcmpCreateFile() failed: %d\n", GetLastError());
-        return false;
-    }
+    traceIcmp(*(IPAddr*)host->h_addr, hops, hopCount);
 
-    int ttl;
-    for (ttl = TTL_START; ttl - TTL_START < *hopAddressCount; ttl++)
-    {
-        IP_OPTION_INFORMATION ipOptions;
-
-        ipOptions.Ttl = ttl;
-        ipOptions.Tos = 0;
-        ipOptions.Flags = 0;
-        ipOptions.OptionsSize = 0;
-
-        DWORD replyCount = IcmpSendEcho(icmpFile,
-            *(IPAddr*)host->h_addr,
-            (LPVOID)requestBuffer, sizeof(requestBuffer),
-            &ipOptions,
-            replyBuffer, sizeof(replyBuffer),
-            3000);
-        if (replyCount == 0) {
-            printf("IcmpSendEcho() failed: %d\n", GetLastError());
-            break;
-        }
-        else if (replyCount != 1) {
-            printf("Got extra replies: %d\n", replyCount);
+    bool gotReply = false;
+    for (i = 0; i < hopCount; i++) {
+        if (hops[i].state == TraceHopTransit || hops[i].state == TraceHopEnd) {
+            gotReply = true;
             break;
         }
+    }
+
+    // Some networks drop ICMP echo requests, so try again with UDP if nothing answered
+    if (hopCount > 0 && !gotReply) {
+        printf("No reply to ICMP probes. Retrying with UDP...\n");
+        memset(hops, 0, sizeof(hops));
+        traceUdp(*(IPAddr*)host->h_addr, hops, hopCount);
+    }
 
-        if (replies[0].Status == IP_TTL_EXPIRED_TRANSIT) {
+    // Report the unbroken run of hops from the start, just like probing one TTL at a time would
+    for (i = 0; i < hopCount; i++) {
+        if (hops[i].state == TraceHopTransit) {
             // Get the IP address that responded to us
-            printf("Hop %d: %s\n", ttl - TTL_START, inet_ntoa(*(IN_ADDR*)&replies[0].Address));
-            hopAddress[ttl - TTL_START] = *(IN_ADDR*)&replies[0].Address;
+            printf("Hop %d: %s\n", i, inet_ntoa(hops[i].address));
+            hopAddress[i] = hops[i].address;
         }
-        else {
+        else if (hops[i].state == TraceHopEnd) {
             // Bail on anything else
-            printf("Hop %d: %s (error %d)\n", ttl - TTL_START, inet_ntoa(*(IN_ADDR*)&replies[0].Address), replies[0].Status);
+            printf("Hop %d: %s (error %d)\n", i, inet_ntoa(hops[i].address), hops[i].status);
+            break;
+        }
+        else {
+            printf("Hop %d: no reply\n", i);
             break;
         }
     }
 
-    IcmpCloseHandle(icmpFile);
-
-    *hopAddressCount = ttl - TTL_START;
+    *hopAddressCount = i;
     return true;
 }
-
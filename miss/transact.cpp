@@ -0,0 +1,264 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+
+#include <limits.h>
+
+#include "transact.h"
+
+#define MAX_RESPONSE_SIZE 2048
+
+void InitUdpTransaction(PUDP_TRANSACTION transaction, SOCKET sock, const struct sockaddr* destination, int destinationLen,
+    const char* request, int requestLength, const UDP_RETRANSMIT_SCHEDULE* schedule, unsigned int deadlineMs,
+    PUDP_RESPONSE_FN onResponse, void* context)
+{
+    transaction->sock = sock;
+    transaction->destination = destination;
+    transaction->destinationLen = destinationLen;
+    transaction->request = request;
+    transaction->requestLength = requestLength;
+    transaction->schedule = schedule;
+    transaction->deadlineMs = deadlineMs;
+    transaction->onResponse = onResponse;
+    transaction->context = context;
+
+    transaction->state = UdpTransactionPending;
+    transaction->error = 0;
+    transaction->attempts = 0;
+    transaction->timeoutMs = 0;
+    transaction->nextSendTime = 0;
+    transaction->deadline = 0;
+}
+
+void CompleteUdpTransaction(PUDP_TRANSACTION transaction)
+{
+    if (transaction->state == UdpTransactionPending) {
+        transaction->state = UdpTransactionComplete;
+    }
+}
+
+void CancelUdpTransaction(PUDP_TRANSACTION transaction)
+{
+    if (transaction->state == UdpTransactionPending) {
+        transaction->state = UdpTransactionCancelled;
+    }
+}
+
+void RestartUdpTransaction(PUDP_TRANSACTION transaction, const char* request, int requestLength)
+{
+    ULONGLONG now = GetTickCount64();
+
+    transaction->request = request;
+    transaction->requestLength = requestLength;
+    transaction->state = UdpTransactionPending;
+    transaction->attempts = 0;
+    transaction->timeoutMs = 0;
+    transaction->nextSendTime = now;
+    transaction->deadline = transaction->deadlineMs != 0 ? now + transaction->deadlineMs : 0;
+}
+
+static unsigned int getNextTimeout(PUDP_TRANSACTION transaction)
+{
+    const UDP_RETRANSMIT_SCHEDULE* schedule = transaction->schedule;
+
+    if (transaction->timeoutMs == 0) {
+        transaction->timeoutMs = schedule->initialTimeoutMs;
+    }
+    else if (transaction->timeoutMs < schedule->maxTimeoutMs) {
+        transaction->timeoutMs = min(transaction->timeoutMs * 2, schedule->maxTimeoutMs);
+    }
+
+    if (!schedule->jitter) {
+        return transaction->timeoutMs;
+    }
+
+    // Scale by a random factor between 0.9 and 1.1
+    unsigned int randValue;
+    if (rand_s(&randValue) != 0) {
+        randValue = UINT_MAX / 2;
+    }
+    double rnd = ((double)randValue / UINT_MAX) * 0.2 - 0.1;
+    return (unsigned int)((1 + rnd) * transaction->timeoutMs);
+}
+
+static bool isFromDestination(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr)
+{
+    const struct sockaddr* destination = transaction->destination;
+
+    if (destination == nullptr) {
+        // Connected sockets only receive from their peer
+        return true;
+    }
+    else if (destination->sa_family != sourceAddr->ss_family) {
+        return false;
+    }
+    else if (destination->sa_family == AF_INET) {
+        PSOCKADDR_IN sin = (PSOCKADDR_IN)destination;
+        PSOCKADDR_IN sourceSin = (PSOCKADDR_IN)sourceAddr;
+        return sin->sin_port == sourceSin->sin_port &&
+            sin->sin_addr.S_un.S_addr == sourceSin->sin_addr.S_un.S_addr;
+    }
+    else {
+        PSOCKADDR_IN6 sin6 = (PSOCKADDR_IN6)destination;
+        PSOCKADDR_IN6 sourceSin6 = (PSOCKADDR_IN6)sourceAddr;
+        return sin6->sin6_port == sourceSin6->sin6_port &&
+            !memcmp(&sin6->sin6_addr, &sourceSin6->sin6_addr, sizeof(sin6->sin6_addr));
+    }
+}
+
+static void failSocketTransactions(PUDP_TRANSACTION* transactions, int transactionCount, SOCKET sock, int error, bool connectedOnly)
+{
+    for (int i = 0; i < transactionCount; i++) {
+        PUDP_TRANSACTION transaction = transactions[i];
+        if (transaction->state == UdpTransactionPending && transaction->sock == sock &&
+                (!connectedOnly || transaction->destination == nullptr)) {
+            transaction->state = UdpTransactionFailed;
+            transaction->error = error;
+        }
+    }
+}
+
+static void receiveResponse(PUDP_TRANSACTION* transactions, int transactionCount, SOCKET sock)
+{
+    char buffer[MAX_RESPONSE_SIZE];
+    SOCKADDR_STORAGE sourceAddr;
+    int sourceAddrLen = sizeof(sourceAddr);
+
+    int bytesRead = recvfrom(sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&sourceAddr, &sourceAddrLen);
+    if (bytesRead == SOCKET_ERROR) {
+        int error = WSAGetLastError();
+        if (error == WSAEMSGSIZE) {
+            // Skip packets larger than our buffer
+        }
+        else if (error == WSAECONNRESET) {
+            // An ICMP Port Unreachable was received. On a connected socket that means the
+            // server isn't listening. Unconnected sockets may be talking to several servers,
+            // so the others may still answer.
+            failSocketTransactions(transactions, transactionCount, sock, error, true);
+        }
+        else {
+            failSocketTransactions(transactions, transactionCount, sock, error, false);
+        }
+        return;
+    }
+
+    buffer[bytesRead] = 0;
+
+    for (int i = 0; i < transactionCount; i++) {
+        PUDP_TRANSACTION transaction = transactions[i];
+        if (transaction->state == UdpTransactionPending && transaction->sock == sock &&
+                isFromDestination(transaction, &sourceAddr) &&
+                transaction->onResponse(transaction, &sourceAddr, buffer, bytesRead)) {
+            break;
+        }
+    }
+}
+
+void RunUdpTransactions(PUDP_TRANSACTION* transactions, int transactionCount)
+{
+    ULONGLONG now = GetTickCount64();
+
+    for (int i = 0; i < transactionCount; i++) {
+        PUDP_TRANSACTION transaction = transactions[i];
+        if (transaction->state == UdpTransactionPending && transaction->attempts == 0) {
+            transaction->nextSendTime = now;
+            transaction->deadline = transaction->deadlineMs != 0 ? now + transaction->deadlineMs : 0;
+        }
+    }
+
+    for (;;) {
+        SOCKET sockets[FD_SETSIZE];
+        int socketCount = 0;
+        ULONGLONG nextWakeTime = ULLONG_MAX;
+
+        now = GetTickCount64();
+        for (int i = 0; i < transactionCount; i++) {
+            PUDP_TRANSACTION transaction = transactions[i];
+            const UDP_RETRANSMIT_SCHEDULE* schedule = transaction->schedule;
+
+            if (transaction->state != UdpTransactionPending) {
+                continue;
+            }
+            else if (transaction->deadline != 0 && now >= transaction->deadline) {
+                transaction->state = UdpTransactionTimedOut;
+                continue;
+            }
+
+            if (now >= transaction->nextSendTime) {
+                if (schedule->maxAttempts != 0 && transaction->attempts >= schedule->maxAttempts) {
+                    transaction->state = UdpTransactionTimedOut;
+                    continue;
+                }
+
+                int err;
+                if (transaction->destination != nullptr) {
+                    err = sendto(transaction->sock, transaction->request, transaction->requestLength, 0,
+                        transaction->destination, transaction->destinationLen);
+                }
+                else {
+                    err = send(transaction->sock, transaction->request, transaction->requestLength, 0);
+                }
+                if (err == SOCKET_ERROR) {
+                    transaction->state = UdpTransactionFailed;
+                    transaction->error = WSAGetLastError();
+                    continue;
+                }
+
+                transaction->attempts++;
+                transaction->nextSendTime = now + getNextTimeout(transaction);
+            }
+
+            nextWakeTime = min(nextWakeTime, transaction->nextSendTime);
+            if (transaction->deadline != 0) {
+                nextWakeTime = min(nextWakeTime, transaction->deadline);
+            }
+
+            // Each socket only needs to be waited on once
+            bool found = false;
+            for (int j = 0; j < socketCount; j++) {
+                if (sockets[j] == transaction->sock) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found && socketCount < ARRAYSIZE(sockets)) {
+                sockets[socketCount++] = transaction->sock;
+            }
+        }
+
+        if (socketCount == 0) {
+            // Nothing left pending
+            break;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        for (int i = 0; i < socketCount; i++) {
+            FD_SET(sockets[i], &fds);
+        }
+
+        ULONGLONG waitMs = nextWakeTime > now ? nextWakeTime - now : 0;
+        struct timeval tv;
+        tv.tv_sec = (long)(waitMs / 1000);
+        tv.tv_usec = (long)((waitMs % 1000) * 1000);
+
+        int selectRes = select(0, &fds, nullptr, nullptr, &tv);
+        if (selectRes == SOCKET_ERROR) {
+            int error = WSAGetLastError();
+            for (int i = 0; i < socketCount; i++) {
+                failSocketTransactions(transactions, transactionCount, sockets[i], error, false);
+            }
+            break;
+        }
+
+        for (int i = 0; i < socketCount && selectRes > 0; i++) {
+            if (FD_ISSET(sockets[i], &fds)) {
+                receiveResponse(transactions, transactionCount, sockets[i]);
+            }
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// Event-driven engine for the UDP request/response protocols we speak (PCP,
+// NAT-PMP, STUN and SSDP). Any number of transactions spread across any number
+// of sockets run together on the calling thread, each with its own
+// retransmission schedule and deadline.
+
+typedef struct _UDP_TRANSACTION UDP_TRANSACTION, *PUDP_TRANSACTION;
+
+// Called for each datagram received on the transaction's socket. Returns true if
+// the datagram belongs to this transaction (by transaction ID, nonce or whatever
+// else the protocol matches on) or false to offer it to the next transaction.
+// The data is always null-terminated.
+typedef bool (*PUDP_RESPONSE_FN)(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length);
+
+typedef struct _UDP_RETRANSMIT_SCHEDULE {
+    unsigned int initialTimeoutMs;
+    unsigned int maxTimeoutMs; // The timeout doubles after each attempt up to this
+    int maxAttempts; // 0 to keep retransmitting until the deadline
+    bool jitter; // Randomize each timeout by +/-10%
+} UDP_RETRANSMIT_SCHEDULE, *PUDP_RETRANSMIT_SCHEDULE;
+
+typedef enum _UDP_TRANSACTION_STATE {
+    UdpTransactionPending,
+    UdpTransactionComplete,
+    UdpTransactionTimedOut,
+    UdpTransactionFailed,
+    UdpTransactionCancelled,
+} UDP_TRANSACTION_STATE;
+
+struct _UDP_TRANSACTION {
+    SOCKET sock;
+
+    // Destination for unconnected sockets or null for connected ones. Responses
+    // on unconnected sockets must come from this address.
+    const struct sockaddr* destination;
+    int destinationLen;
+
+    const char* request;
+    int requestLength;
+
+    const UDP_RETRANSMIT_SCHEDULE* schedule;
+    unsigned int deadlineMs; // 0 if only bounded by the schedule
+
+    PUDP_RESPONSE_FN onResponse;
+    void* context;
+
+    // Managed by the engine
+    UDP_TRANSACTION_STATE state;
+    int error; // Winsock error if the transaction failed
+    int attempts;
+    unsigned int timeoutMs;
+    ULONGLONG nextSendTime;
+    ULONGLONG deadline;
+};
+
+void InitUdpTransaction(PUDP_TRANSACTION transaction, SOCKET sock, const struct sockaddr* destination, int destinationLen,
+    const char* request, int requestLength, const UDP_RETRANSMIT_SCHEDULE* schedule, unsigned int deadlineMs,
+    PUDP_RESPONSE_FN onResponse, void* context);
+
+// Runs until every transaction has completed, failed, timed out or been cancelled
+void RunUdpTransactions(PUDP_TRANSACTION* transactions, int transactionCount);
+
+// These may be called from response callbacks on any transaction in the run
+void CompleteUdpTransaction(PUDP_TRANSACTION transaction);
+void CancelUdpTransaction(PUDP_TRANSACTION transaction);
+
+// Starts the transaction over with a new request and a fresh schedule
+void RestartUdpTransaction(PUDP_TRANSACTION transaction, const char* request, int requestLength);
@@ -9,7 +9,6 @@
 #include <wtsapi32.h>
 #include <powerbase.h>
 #include <VersionHelpers.h>
-#include <tlhelp32.h>
 
 #pragma comment(lib, "miniupnpc.lib")
 #pragma comment(lib, "libnatpmp.lib")
@@ -27,6 +26,9 @@
 #define NATPMP_STATICLIB
 #include <natpmp.h>
 
+#include "..\miss\relay.h"
+#include "..\miss\streaming.h"
+
 #define LOOPBACK_SERVER_PORT_OFFSET -10000
 
 #define GAA_INITIAL_SIZE 8192
@@ -271,28 +273,6 @@ bool IsGameStreamEnabled()
     }
 }
 
-bool IsCurrentlyStreaming()
-{
-    bool ret = false;
-    HANDLE processSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-
-    PROCESSENTRY32 procEntry;
-    procEntry.dwSize = sizeof(procEntry);
-    Process32First(processSnapshot, &procEntry);
-
-    do {
-        // If we find nvstreamer.exe running, we're currently streaming
-        if (_stricmp(procEntry.szExeFile, "nvstreamer.exe") == 0) {
-            ret = true;
-            break;
-        }
-    } while (Process32Next(processSnapshot, &procEntry));
-
-    CloseHandle(processSnapshot);
-
-    return ret;
-}
-
 bool IsConsoleSessionActive()
 {
     PWTS_SESSION_INFO_1 sessionInfo;
@@ -407,6 +387,99 @@ enum PortTestStatus {
     PortTestError,
     PortTestUnknown
 };
+
+PortTestStatus TestUdpPortWithEcho(PSOCKADDR_STORAGE addr, int port)
+{
+    SOCKET sock;
+    SOCKADDR_IN targets[2];
+    char probe[64];
+    char expectedReply[64];
+    unsigned int nonce;
+    int probeLen;
+    int err;
+    bool relayAnswered = false;
+
+    // MISS only runs relays for IPv4
+    if (addr->ss_family != AF_INET) {
+        fprintf(LOG_OUT, "Unknown (in use)\n");
+        return PortTestUnknown;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        fprintf(LOG_OUT, "socket() failed: %d\n", WSAGetLastError());
+        return PortTestError;
+    }
+
+    rand_s(&nonce);
+    probeLen = snprintf(probe, sizeof(probe), "%s %u", RELAY_ECHO_PROBE, nonce);
+    snprintf(expectedReply, sizeof(expectedReply), "%s %u", RELAY_ECHO_REPLY, nonce);
+
+    // Probe the port itself, which reaches the relay if the router forwards it there,
+    // and the relay's own port, which tells us whether the relay is alive. Only an
+    // echo from the port itself proves the GameStream port works, since the relay
+    // port always answers when we're testing from the same LAN.
+    RtlCopyMemory(&targets[0], addr, sizeof(targets[0]));
+    targets[0].sin_port = htons(port);
+    targets[1] = targets[0];
+    targets[1].sin_port = htons(port + RELAY_PORT_OFFSET);
+
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < ARRAYSIZE(targets); j++) {
+            if (sendto(sock, probe, probeLen, 0, (struct sockaddr*)&targets[j], sizeof(targets[j])) == SOCKET_ERROR) {
+                fprintf(LOG_OUT, "sendto() failed: %d\n", WSAGetLastError());
+            }
+        }
+
+        for (;;) {
+            struct timeval timeout = {};
+            fd_set fds;
+
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+
+            timeout.tv_usec = 200 * 1000;
+            err = select(0, &fds, nullptr, nullptr, &timeout);
+            if (err != 1) {
+                // Timed out or failed - send the probes again
+                break;
+            }
+
+            char reply[64];
+            SOCKADDR_IN replyAddr;
+            int replyAddrLen = sizeof(replyAddr);
+            int replyLen = recvfrom(sock, reply, sizeof(reply), 0, (struct sockaddr*)&replyAddr, &replyAddrLen);
+            if (replyLen == SOCKET_ERROR) {
+                // WSAECONNRESET just means one of the probes hit a closed port
+                continue;
+            }
+
+            if (replyLen != probeLen || !RtlEqualMemory(reply, expectedReply, probeLen)) {
+                continue;
+            }
+            else if (replyAddr.sin_port == targets[0].sin_port) {
+                fprintf(LOG_OUT, "Success (MISS echo from port %d)\n", port);
+                closesocket(sock);
+                return PortTestOk;
+            }
+            else if (replyAddr.sin_port == targets[1].sin_port) {
+                // Keep waiting for the port itself to answer
+                relayAnswered = true;
+            }
+        }
+    }
+
+    closesocket(sock);
+
+    if (relayAnswered) {
+        fprintf(LOG_OUT, "Unknown (in use, MISS relay on port %d answered but port %d didn't)\n", port + RELAY_PORT_OFFSET, port);
+    }
+    else {
+        fprintf(LOG_OUT, "Unknown (in use)\n");
+    }
+    return PortTestUnknown;
+}
+
 PortTestStatus TestPort(PSOCKADDR_STORAGE addr, int proto, int port, bool withServer, bool isLoopbackRelay, bool mtuTest)
 {
     SOCKET clientSock = INVALID_SOCKET, serverSock = INVALID_SOCKET;
@@ -441,6 +514,14 @@ PortTestStatus TestPort(PSOCKADDR_STORAGE addr, int proto, int port, bool withSe
                     closesocket(serverSock);
                     serverSock = INVALID_SOCKET;
                 }
+                else if (proto == IPPROTO_UDP && !isLoopbackRelay) {
+                    // We can't listen on this UDP port ourselves, but the MISS
+                    // relay for this port will echo a probe back to us.
+                    fprintf(LOG_OUT, "In use, probing MISS relay...");
+                    closesocket(clientSock);
+                    closesocket(serverSock);
+                    return TestUdpPortWithEcho(addr, port);
+                }
                 else {
                     // We can't continue to test for UDP ports.
                     fprintf(LOG_OUT, "Unknown (in use)\n");
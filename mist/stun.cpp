@@ -1,10 +1,18 @@
 #include "mist.h"
 
 #include <stdio.h>
+#include <limits.h>
+
+#include "..\miss\transact.h"
 
 #define STUN_PORT 3478
 
-#define STUN_RECV_TIMEOUT_SEC 5
+// RFC 5389 retransmission timing, bounded by an overall deadline
+#define STUN_RTO_MS 500
+#define STUN_MAX_ATTEMPTS 7
+#define STUN_DEADLINE_MS 5000
+
+#define STUN_MAX_SERVER_ADDRESSES 8
 
 #define STUN_MESSAGE_BINDING_REQUEST 0x0001
 #define STUN_MESSAGE_BINDING_SUCCESS 0x0101
@@ -38,26 +46,106 @@ typedef struct _STUN_MESSAGE {
 
 #pragma pack(pop)
 
+typedef struct _STUN_REQUEST_CONTEXT {
+    STUN_MESSAGE request;
+    UDP_TRANSACTION transactions[STUN_MAX_SERVER_ADDRESSES];
+    int transactionCount;
+
+    PSOCKADDR_IN wanAddr;
+    bool found;
+} STUN_REQUEST_CONTEXT, *PSTUN_REQUEST_CONTEXT;
+
+// RFC 5389 section 7.2.1 with the overall wait capped at our old timeout
+static const UDP_RETRANSMIT_SCHEDULE k_StunRetransmitSchedule = { STUN_RTO_MS, UINT_MAX, STUN_MAX_ATTEMPTS, false };
+
+static void completeAllTransactions(PSTUN_REQUEST_CONTEXT context)
+{
+    // We only need one answer, so stop asking the other addresses too
+    for (int i = 0; i < context->transactionCount; i++) {
+        CompleteUdpTransaction(&context->transactions[i]);
+    }
+}
+
+static bool handleBindingResponse(PUDP_TRANSACTION transaction, PSOCKADDR_STORAGE sourceAddr, char* data, int length)
+{
+    PSTUN_REQUEST_CONTEXT context = (PSTUN_REQUEST_CONTEXT)transaction->context;
+    PSTUN_MESSAGE resp = (PSTUN_MESSAGE)data;
+    PSTUN_ATTRIBUTE_HEADER attribute;
+    PSTUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE ipv4Attrib;
+    int bytesRead = length;
+
+    if (bytesRead < sizeof(*resp)) {
+        fprintf(LOG_OUT, "STUN message truncated: %d\n", bytesRead);
+        return false;
+    }
+    else if (htonl(resp->magicCookie) != STUN_MESSAGE_COOKIE) {
+        fprintf(LOG_OUT, "Bad STUN cookie value: %x\n", htonl(resp->magicCookie));
+        return false;
+    }
+    else if (memcmp(context->request.transactionId, resp->transactionId, sizeof(resp->transactionId))) {
+        fprintf(LOG_OUT, "STUN transaction ID mismatch\n");
+        return false;
+    }
+
+    completeAllTransactions(context);
+
+    if (htons(resp->messageType) != STUN_MESSAGE_BINDING_SUCCESS) {
+        fprintf(LOG_OUT, "STUN message type mismatch: %x\n", htons(resp->messageType));
+        return true;
+    }
+
+    attribute = (PSTUN_ATTRIBUTE_HEADER)(resp + 1);
+    bytesRead -= sizeof(*resp);
+    while (bytesRead > sizeof(*attribute)) {
+        if (bytesRead < sizeof(*attribute) + htons(attribute->length)) {
+            fprintf(LOG_OUT, "STUN attribute out of bounds: %d\n", htons(attribute->length));
+            return true;
+        }
+        // Mask off the comprehension bit
+        else if ((htons(attribute->type) & 0x7FFF) != STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS) {
+            // Continue searching if this wasn't our address
+            bytesRead -= sizeof(*attribute) + htons(attribute->length);
+            attribute = (PSTUN_ATTRIBUTE_HEADER)(((char*)attribute) + sizeof(*attribute) + htons(attribute->length));
+            continue;
+        }
+
+        ipv4Attrib = (PSTUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE)attribute;
+        if (htons(ipv4Attrib->hdr.length) != 8) {
+            fprintf(LOG_OUT, "STUN address length mismatch: %d\n", htons(ipv4Attrib->hdr.length));
+            return true;
+        }
+        else if (ipv4Attrib->addressFamily != 1) {
+            fprintf(LOG_OUT, "STUN address family mismatch: %x\n", ipv4Attrib->addressFamily);
+            return true;
+        }
+
+        *context->wanAddr = {};
+        context->wanAddr->sin_family = AF_INET;
+
+        // The address and port are XORed with the cookie
+        context->wanAddr->sin_port = ipv4Attrib->port ^ (short)resp->magicCookie;
+        context->wanAddr->sin_addr.S_un.S_addr = ipv4Attrib->address ^ resp->magicCookie;
+
+        context->found = true;
+        return true;
+    }
+
+    fprintf(LOG_OUT, "No XOR mapped address found in STUN response!\n");
+    return true;
+}
+
 bool getExternalAddressPortIP4(unsigned short localPort, PSOCKADDR_IN wanAddr)
 {
     SOCKET sock;
-    STUN_MESSAGE reqMsg;
+    STUN_REQUEST_CONTEXT context;
+    PUDP_TRANSACTION transactions[STUN_MAX_SERVER_ADDRESSES];
     int i;
-    int bytesRead;
     int err;
-    bool ret;
-    PSTUN_ATTRIBUTE_HEADER attribute;
-    PSTUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE ipv4Attrib;
     struct addrinfo* result;
     struct addrinfo hints;
     struct sockaddr_in bindAddr;
-    union {
-        STUN_MESSAGE hdr;
-        char buf[1024];
-    } resp;
 
     sock = INVALID_SOCKET;
-    ret = false;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -70,6 +158,10 @@ bool getExternalAddressPortIP4(unsigned short localPort, PSOCKADDR_IN wanAddr)
         return false;
     }
 
+    context.wanAddr = wanAddr;
+    context.found = false;
+    context.transactionCount = 0;
+
     sock = socket(hints.ai_family, hints.ai_socktype, hints.ai_protocol);
     if (sock == INVALID_SOCKET) {
         fprintf(LOG_OUT, "socket() failed: %d\n", WSAGetLastError());
@@ -84,116 +176,37 @@ bool getExternalAddressPortIP4(unsigned short localPort, PSOCKADDR_IN wanAddr)
         goto Exit;
     }
 
-    reqMsg.messageType = htons(STUN_MESSAGE_BINDING_REQUEST);
-    reqMsg.messageLength = 0;
-    reqMsg.magicCookie = htonl(STUN_MESSAGE_COOKIE);
+    context.request.messageType = htons(STUN_MESSAGE_BINDING_REQUEST);
+    context.request.messageLength = 0;
+    context.request.magicCookie = htonl(STUN_MESSAGE_COOKIE);
     for (i = 0; i < TXID_DWORDS; i++) {
-        reqMsg.transactionId[i] = rand();
+        context.request.transactionId[i] = rand();
     }
 
-    bytesRead = 0;
-    for (i = 0; i < STUN_RECV_TIMEOUT_SEC; i++) {
-        // Retransmit the request every second to all resolved IP addresses until the timeout elapses
-        for (struct addrinfo* current = result; current != NULL; current = current->ai_next) {
-            if (sendto(sock, (char*)&reqMsg, sizeof(reqMsg), 0, current->ai_addr, current->ai_addrlen) == SOCKET_ERROR) {
-                fprintf(LOG_OUT, "sendto() failed: %d\n", WSAGetLastError());
-            }
-        }
+    // Send the same request to all resolved IP addresses at once. The first answer wins.
+    for (struct addrinfo* current = result; current != NULL && context.transactionCount < STUN_MAX_SERVER_ADDRESSES; current = current->ai_next) {
+        PUDP_TRANSACTION transaction = &context.transactions[context.transactionCount];
 
-        for (;;) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
+        InitUdpTransaction(transaction, sock, current->ai_addr, (int)current->ai_addrlen,
+            (char*)&context.request, sizeof(context.request), &k_StunRetransmitSchedule, STUN_DEADLINE_MS,
+            handleBindingResponse, &context);
+        transactions[context.transactionCount++] = transaction;
+    }
 
-            struct timeval tv;
-            tv.tv_sec = 1;
-            tv.tv_usec = 0;
+    RunUdpTransactions(transactions, context.transactionCount);
 
-            int selectRes = select(0, &fds, nullptr, nullptr, &tv);
-            if (selectRes == 0) {
-                // Timeout - break to the enclosing loop
-                break;
-            }
-            else if (selectRes == SOCKET_ERROR) {
-                fprintf(LOG_OUT, "select() failed: %d\n", WSAGetLastError());
-                goto Exit;
+    if (!context.found) {
+        for (i = 0; i < context.transactionCount; i++) {
+            if (context.transactions[i].state == UdpTransactionFailed) {
+                fprintf(LOG_OUT, "STUN request failed: %d\n", context.transactions[i].error);
             }
-
-            // recvfrom() will return WSAECONNRESET if the socket has received an ICMP Port Unreachable
-            // message from one of the IP addresses we've attempted communication with. The socket is still
-            // operable (and may even contain queued messages to receive). We should ignore that error and
-            // continue reading, otherwise exit the loop.
-            bytesRead = recvfrom(sock, resp.buf, sizeof(resp.buf), 0, NULL, NULL);
-            if (bytesRead != SOCKET_ERROR || WSAGetLastError() != WSAECONNRESET) {
-                goto RecvDone;
+            else if (context.transactions[i].state == UdpTransactionTimedOut) {
+                fprintf(LOG_OUT, "No response from STUN server\n");
+                break;
             }
         }
     }
 
-RecvDone:
-    if (bytesRead == 0) {
-        fprintf(LOG_OUT, "No response from STUN server\n");
-        goto Exit;
-    }
-    else if (bytesRead == SOCKET_ERROR) {
-        fprintf(LOG_OUT, "Failed to read STUN binding response: %d\n", WSAGetLastError());
-        goto Exit;
-    }
-    else if (bytesRead < sizeof(resp.hdr)) {
-        fprintf(LOG_OUT, "STUN message truncated: %d\n", bytesRead);
-        goto Exit;
-    }
-    else if (htonl(resp.hdr.magicCookie) != STUN_MESSAGE_COOKIE) {
-        fprintf(LOG_OUT, "Bad STUN cookie value: %x\n", htonl(resp.hdr.magicCookie));
-        goto Exit;
-    }
-    else if (memcmp(reqMsg.transactionId, resp.hdr.transactionId, sizeof(reqMsg.transactionId))) {
-        fprintf(LOG_OUT, "STUN transaction ID mismatch\n");
-        goto Exit;
-    }
-    else if (htons(resp.hdr.messageType) != STUN_MESSAGE_BINDING_SUCCESS) {
-        fprintf(LOG_OUT, "STUN message type mismatch: %x\n", htons(resp.hdr.messageType));
-        goto Exit;
-    }
-
-    attribute = (PSTUN_ATTRIBUTE_HEADER)(&resp.hdr + 1);
-    bytesRead -= sizeof(resp.hdr);
-    while (bytesRead > sizeof(*attribute)) {
-        if (bytesRead < sizeof(*attribute) + htons(attribute->length)) {
-            fprintf(LOG_OUT, "STUN attribute out of bounds: %d\n", htons(attribute->length));
-            goto Exit;
-        }
-        // Mask off the comprehension bit
-        else if ((htons(attribute->type) & 0x7FFF) != STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS) {
-            // Continue searching if this wasn't our address
-            bytesRead -= sizeof(*attribute) + htons(attribute->length);
-            attribute = (PSTUN_ATTRIBUTE_HEADER)(((char*)attribute) + sizeof(*attribute) + htons(attribute->length));
-            continue;
-        }
-
-        ipv4Attrib = (PSTUN_MAPPED_IPV4_ADDRESS_ATTRIBUTE)attribute;
-        if (htons(ipv4Attrib->hdr.length) != 8) {
-            fprintf(LOG_OUT, "STUN address length mismatch: %d\n", htons(ipv4Attrib->hdr.length));
-            goto Exit;
-        }
-        else if (ipv4Attrib->addressFamily != 1) {
-            fprintf(LOG_OUT, "STUN address family mismatch: %x\n", ipv4Attrib->addressFamily);
-            goto Exit;
-        }
-
-        *wanAddr = {};
-        wanAddr->sin_family = AF_INET;
-
-        // The address and port are XORed with the cookie
-        wanAddr->sin_port = ipv4Attrib->port ^ (short)resp.hdr.magicCookie;
-        wanAddr->sin_addr.S_un.S_addr = ipv4Attrib->address ^ resp.hdr.magicCookie;
-
-        ret = true;
-        goto Exit;
-    }
-
-    fprintf(LOG_OUT, "No XOR mapped address found in STUN response!\n");
-
 Exit:
     if (sock != INVALID_SOCKET) {
         closesocket(sock);
@@ -203,5 +216,5 @@ Exit:
         freeaddrinfo(result);
     }
 
-    return ret;
+    return context.found;
 }
\ No newline at end of file